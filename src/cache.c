@@ -0,0 +1,256 @@
+/**
+ * @file cache.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Persistent on disk chunk cache for the client
+ * @version 0.1
+ * @date 2023-05-18
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+
+#define CACHE_HDR_LEN   4  // CRC32C of the payload
+#define CACHE_TMP_GRACE 60 // Seconds before a stray temporary file is removed
+
+typedef struct {
+    char     name[NAME_MAX + 1];
+    time_t   mtime;
+    uint64_t size;
+} cache_entry_t;
+
+/**
+ * @brief Reject names that could escape the cache directory
+ */
+static int cache_name_valid(const char *name) {
+    return name && *name && !strchr(name, '/') && name[0] != '.' &&
+           strlen(name) <= NAME_MAX;
+}
+
+/**
+ * @brief Size of every entry in the directory, removing stale temporaries
+ *
+ * @param entries Output, may be NULL; allocated by the callee
+ * @return ssize_t Number of entries, -1 on error
+ */
+static ssize_t cache_scan(cache_t *cache, cache_entry_t **entries,
+                          uint64_t *total) {
+    DIR *dir = opendir(cache->dir);
+    if (!dir) {
+        return -1;
+    }
+    size_t         n   = 0;
+    size_t         max = 0;
+    cache_entry_t *all = NULL;
+    time_t         now = time(NULL);
+    *total             = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        char        path[PATH_MAX + NAME_MAX + 2];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (ent->d_name[0] == '.') {
+            // Left behind by a client that died while inserting
+            if (now - st.st_mtime > CACHE_TMP_GRACE) {
+                unlink(path);
+            }
+            continue;
+        }
+        *total += st.st_size;
+        if (!entries) {
+            continue;
+        }
+        if (n == max) {
+            max                 = max ? max * 2 : 256;
+            cache_entry_t *grow = realloc(all, max * sizeof(cache_entry_t));
+            if (!grow) {
+                free(all);
+                closedir(dir);
+                return -1;
+            }
+            all = grow;
+        }
+        strncpy(all[n].name, ent->d_name, NAME_MAX);
+        all[n].mtime = st.st_mtime;
+        all[n].size  = st.st_size;
+        n++;
+    }
+    closedir(dir);
+    if (entries) {
+        *entries = all;
+    }
+    return n;
+}
+
+static int cache_entry_older(const void *a, const void *b) {
+    const cache_entry_t *ea = a;
+    const cache_entry_t *eb = b;
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/**
+ * @brief Remove least recently used entries down to the low water mark
+ * @details Called with the lock held. The directory is rescanned, so
+ * entries added by other clients count too.
+ */
+static void cache_evict(cache_t *cache) {
+    cache_entry_t *entries = NULL;
+    uint64_t       total   = 0;
+    ssize_t        n       = cache_scan(cache, &entries, &total);
+    if (n < 0) {
+        return;
+    }
+    qsort(entries, n, sizeof(cache_entry_t), cache_entry_older);
+    uint64_t target = cache->cap / 100 * CACHE_LOW_WATER;
+    for (ssize_t i = 0; i < n && total > target; i++) {
+        char path[PATH_MAX + NAME_MAX + 2];
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+        if (unlink(path) == 0) {
+            total -= entries[i].size;
+        }
+    }
+    free(entries);
+    cache->size = total;
+}
+
+/**
+ * @brief Take bytes that left the cache off its size. Called with the lock
+ * held.
+ * @details Entries written by other clients are not counted until the next
+ * scan, so removing one may take off more than was added.
+ */
+static void cache_shrink(cache_t *cache, uint64_t bytes) {
+    cache->size = bytes < cache->size ? cache->size - bytes : 0;
+}
+
+/**
+ * @brief Remove the entry at path and its size. Called with the lock held.
+ */
+static void cache_unlink(cache_t *cache, const char *path) {
+    struct stat st;
+    if (stat(path, &st) == 0 && unlink(path) == 0) {
+        cache_shrink(cache, st.st_size);
+    }
+}
+
+int cache_init(cache_t *cache, const char *dir, uint64_t cap) {
+    memset(cache, 0, sizeof(*cache));
+    strncpy(cache->dir, dir, PATH_MAX - 1);
+    pthread_mutex_init(&cache->lock, NULL);
+    if (!cap) {
+        return 0;
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    uint64_t total = 0;
+    if (cache_scan(cache, NULL, &total) < 0) {
+        perror("opendir");
+        return -1;
+    }
+    cache->cap  = cap;
+    cache->size = total;
+    return 0;
+}
+
+int cache_get(cache_t *cache, const char *name, uint8_t *buf, size_t cap,
+              size_t *len) {
+    if (!cache->cap || !cache_name_valid(name)) {
+        return -1;
+    }
+    char path[PATH_MAX + NAME_MAX + 2];
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, name);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    uint8_t hdr[CACHE_HDR_LEN];
+    ssize_t n = -1;
+    if (pread(fd, hdr, CACHE_HDR_LEN, 0) == CACHE_HDR_LEN) {
+        n = pread(fd, buf, cap, CACHE_HDR_LEN);
+    }
+    close(fd);
+    uint32_t crc = hdr[0] | hdr[1] << 8 | hdr[2] << 16 | (uint32_t)hdr[3] << 24;
+    if (n < 0 || crc32c(0, buf, n) != crc) {
+        fprintf(stderr, "[INFO]\tDropping damaged cache entry: %s\n", name);
+        pthread_mutex_lock(&cache->lock);
+        cache_unlink(cache, path);
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    // Mark as recently used
+    utimensat(AT_FDCWD, path, NULL, 0);
+    *len = n;
+    return 0;
+}
+
+void cache_put(cache_t *cache, const char *name, const uint8_t *buf,
+               size_t len) {
+    if (!cache->cap || !cache_name_valid(name) || len > cache->cap) {
+        return;
+    }
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", cache->dir);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        return;
+    }
+    uint32_t crc                = crc32c(0, buf, len);
+    uint8_t  hdr[CACHE_HDR_LEN] = {crc, crc >> 8, crc >> 16, crc >> 24};
+    int      ok                 = 0;
+    if (pwrite(fd, hdr, CACHE_HDR_LEN, 0) == CACHE_HDR_LEN) {
+        size_t total = 0;
+        while (total < len) {
+            ssize_t w = pwrite(fd, buf + total, len - total,
+                               CACHE_HDR_LEN + total);
+            if (w <= 0) {
+                break;
+            }
+            total += w;
+        }
+        ok = total == len;
+    }
+    close(fd);
+    if (!ok) {
+        unlink(tmp);
+        return;
+    }
+    char path[PATH_MAX + NAME_MAX + 2];
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, name);
+
+    // Under the lock, so the entry replaced is the one subtracted
+    pthread_mutex_lock(&cache->lock);
+    struct stat st;
+    uint64_t    replaced = stat(path, &st) == 0 ? st.st_size : 0;
+    if (rename(tmp, path) < 0) {
+        pthread_mutex_unlock(&cache->lock);
+        unlink(tmp);
+        return;
+    }
+    cache_shrink(cache, replaced);
+    cache->size += CACHE_HDR_LEN + len;
+    if (cache->size > cache->cap) {
+        cache_evict(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_destroy(cache_t *cache) {
+    pthread_mutex_destroy(&cache->lock);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file cache.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Persistent on disk chunk cache for the client
+ * @details Chunks are kept as files named after the stored chunk name, which
+ * encodes the upload time and client id and therefore never refers to
+ * different content. Each entry starts with the CRC32C of the payload (4
+ * bytes, little endian), so a damaged entry is dropped instead of served.
+ * Entries are written to a temporary file and renamed into place, which
+ * lets several clients share one cache directory. A hit refreshes the
+ * entry's modification time; once the cache outgrows its cap the least
+ * recently used entries are removed until it is back under
+ * CACHE_LOW_WATER percent of the cap.
+ * @version 0.1
+ * @date 2023-05-18
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CACHE_LOW_WATER 90 // Percent of the cap left after an eviction
+
+typedef struct {
+    char            dir[PATH_MAX];
+    uint64_t        cap;  // Bytes, 0 when the cache is disabled
+    uint64_t        size; // Bytes in the directory, as far as we know
+    pthread_mutex_t lock;
+} cache_t;
+
+/**
+ * @brief Open (creating if needed) the cache directory
+ * @details cap == 0 disables the cache, every lookup then misses.
+ *
+ * @return int 0 on success, -1 if the directory cannot be used
+ */
+int cache_init(cache_t *cache, const char *dir, uint64_t cap);
+
+/**
+ * @brief Look up a chunk
+ *
+ * @param buf Output, the chunk payload
+ * @param cap Capacity of buf
+ * @param len Set to the payload length
+ * @return int 0 on a hit, -1 on a miss
+ */
+int cache_get(cache_t *cache, const char *name, uint8_t *buf, size_t cap,
+              size_t *len);
+
+/**
+ * @brief Insert a chunk, evicting old entries if the cache is full
+ *
+ */
+void cache_put(cache_t *cache, const char *name, const uint8_t *buf,
+               size_t len);
+
+/**
+ * @brief Release the cache (the entries stay on disk)
+ *
+ */
+void cache_destroy(cache_t *cache);
+
+#endif // CACHE_H
@@ -0,0 +1,226 @@
+/**
+ * @file catalog.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Client side copy of a server's listing, kept between runs
+ * @version 0.1
+ * @date 2023-05-19
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "catalog.h"
+
+#include <inttypes.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int catalog_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int catalog_change_cmp(const void *a, const void *b) {
+    const catalog_change_t *x   = a;
+    const catalog_change_t *y   = b;
+    int                     cmp = strcmp(x->name, y->name);
+    if (cmp) {
+        return cmp;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * @brief Sort the names and drop duplicates
+ * @details Snapshots arrive in directory order, so names are appended
+ * unsorted and put in order once before the first lookup.
+ */
+static void catalog_sort_names(catalog_t *catalog) {
+    if (catalog->sorted) {
+        return;
+    }
+    qsort(catalog->names, catalog->num_names, sizeof(char *), catalog_cmp);
+    size_t n = 0;
+    for (size_t i = 0; i < catalog->num_names; i++) {
+        if (n && strcmp(catalog->names[n - 1], catalog->names[i]) == 0) {
+            free(catalog->names[i]);
+            continue;
+        }
+        catalog->names[n++] = catalog->names[i];
+    }
+    catalog->num_names = n;
+    catalog->sorted    = 1;
+}
+
+/**
+ * @brief Drop the queued changes
+ */
+static void catalog_clear_changes(catalog_t *catalog) {
+    for (size_t i = 0; i < catalog->num_changes; i++) {
+        free(catalog->changes[i].name);
+    }
+    catalog->num_changes = 0;
+}
+
+int catalog_add(catalog_t *catalog, const char *name) {
+    if (catalog->num_names == catalog->max_names) {
+        size_t max   = catalog->max_names ? catalog->max_names * 2 : 256;
+        char **names = realloc(catalog->names, max * sizeof(char *));
+        if (!names) {
+            return -1;
+        }
+        catalog->names     = names;
+        catalog->max_names = max;
+    }
+    char *copy = strdup(name);
+    if (!copy) {
+        return -1;
+    }
+    catalog->names[catalog->num_names++] = copy;
+    catalog->sorted                      = 0;
+    return 0;
+}
+
+void catalog_init(catalog_t *catalog) {
+    memset(catalog, 0, sizeof(*catalog));
+    catalog->sorted = 1;
+}
+
+int catalog_load(catalog_t *catalog, const char *path) {
+    catalog_free(catalog);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[PATH_MAX];
+    if (!fgets(line, sizeof(line), file) ||
+        sscanf(line, "epoch %16s %" SCNu64, catalog->epoch,
+               &catalog->seq) != 2) {
+        fclose(file);
+        catalog_free(catalog);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] && catalog_add(catalog, line) < 0) {
+            fclose(file);
+            catalog_free(catalog);
+            return -1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+int catalog_save(catalog_t *catalog, const char *path) {
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.tmp%d", path, getpid());
+    FILE *file = fopen(tmp, "w");
+    if (!file) {
+        return -1;
+    }
+    if (catalog_sort(catalog) < 0) {
+        fclose(file);
+        unlink(tmp);
+        return -1;
+    }
+    fprintf(file, "epoch %s %" PRIu64 "\n", catalog->epoch, catalog->seq);
+    for (size_t i = 0; i < catalog->num_names; i++) {
+        fprintf(file, "%s\n", catalog->names[i]);
+    }
+    if (fclose(file) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int catalog_apply(catalog_t *catalog, char op, const char *name) {
+    if (op != '+' && op != '-') {
+        return -1;
+    }
+    if (catalog->num_changes == catalog->max_changes) {
+        size_t max = catalog->max_changes ? catalog->max_changes * 2 : 256;
+        catalog_change_t *changes =
+            realloc(catalog->changes, max * sizeof(catalog_change_t));
+        if (!changes) {
+            return -1;
+        }
+        catalog->changes     = changes;
+        catalog->max_changes = max;
+    }
+    char *copy = strdup(name);
+    if (!copy) {
+        return -1;
+    }
+    catalog_change_t *change = &catalog->changes[catalog->num_changes];
+    change->name             = copy;
+    change->order            = catalog->num_changes++;
+    change->op               = op;
+    return 0;
+}
+
+int catalog_sort(catalog_t *catalog) {
+    catalog_sort_names(catalog);
+    if (!catalog->num_changes) {
+        return 0;
+    }
+    qsort(catalog->changes, catalog->num_changes, sizeof(catalog_change_t),
+          catalog_change_cmp);
+
+    // Walk the sorted names and the changes together, keeping the names in
+    // place and appending new ones after them, already in order
+    catalog_change_t *changes = catalog->changes;
+    size_t            num     = catalog->num_names;
+    size_t            kept    = 0;
+    size_t            i       = 0;
+    int               err     = 0;
+    for (size_t k = 0; k < catalog->num_changes; k++) {
+        if (k + 1 < catalog->num_changes &&
+            strcmp(changes[k].name, changes[k + 1].name) == 0) {
+            continue; // A later change to the same name wins
+        }
+        while (i < num && strcmp(catalog->names[i], changes[k].name) < 0) {
+            catalog->names[kept++] = catalog->names[i++];
+        }
+        int found = i < num && strcmp(catalog->names[i], changes[k].name) == 0;
+        if (changes[k].op == '-' && found) {
+            free(catalog->names[i++]);
+        } else if (changes[k].op == '+' && !found &&
+                   catalog_add(catalog, changes[k].name) < 0) {
+            err = -1;
+        }
+    }
+    while (i < num) {
+        catalog->names[kept++] = catalog->names[i++];
+    }
+    size_t added = catalog->num_names - num;
+    memmove(catalog->names + kept, catalog->names + num,
+            added * sizeof(char *));
+    catalog->num_names = kept + added;
+    catalog_clear_changes(catalog);
+    catalog_sort_names(catalog);
+    return err;
+}
+
+void catalog_clear(catalog_t *catalog) {
+    for (size_t i = 0; i < catalog->num_names; i++) {
+        free(catalog->names[i]);
+    }
+    catalog->num_names = 0;
+    catalog->sorted    = 1;
+    catalog_clear_changes(catalog);
+}
+
+void catalog_free(catalog_t *catalog) {
+    catalog_clear(catalog);
+    free(catalog->names);
+    free(catalog->changes);
+    catalog->names       = NULL;
+    catalog->max_names   = 0;
+    catalog->changes     = NULL;
+    catalog->max_changes = 0;
+    catalog->epoch[0]  = '\0';
+    catalog->seq       = 0;
+}
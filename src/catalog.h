@@ -0,0 +1,104 @@
+/**
+ * @file catalog.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Client side copy of a server's listing, kept between runs
+ * @details A catalog is the set of names a server stored as of a position
+ * (epoch and sequence number) in its change log, see store_list. With it
+ * the client asks only for the changes since that position instead of the
+ * whole listing. It is saved as
+ *      epoch <epoch> <seq>\n
+ * followed by one name per line.
+ * @version 0.1
+ * @date 2023-05-19
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CATALOG_EPOCH_LEN 17 // Hex digits + NUL
+
+typedef struct {
+    char  *name;
+    size_t order; // Position in the log, the last change to a name wins
+    char   op;    // '+' or '-'
+} catalog_change_t;
+
+typedef struct {
+    char              epoch[CATALOG_EPOCH_LEN]; // "" until the server sent one
+    uint64_t          seq;
+    char            **names;
+    size_t            num_names;
+    size_t            max_names;
+    int               sorted; // names is sorted and free of duplicates
+    catalog_change_t *changes; // Applied, not yet merged into names
+    size_t            num_changes;
+    size_t            max_changes;
+} catalog_t;
+
+/**
+ * @brief Set up an empty catalog
+ *
+ */
+void catalog_init(catalog_t *catalog);
+
+/**
+ * @brief Replace the catalog with the one saved at path
+ *
+ * @return int 0 on success, -1 if there is none (the catalog is then empty)
+ */
+int catalog_load(catalog_t *catalog, const char *path);
+
+/**
+ * @brief Save the catalog to path, replacing it atomically
+ *
+ * @return int 0 on success, -1 on error
+ */
+int catalog_save(catalog_t *catalog, const char *path);
+
+/**
+ * @brief Add a name from a snapshot
+ * @details Names are appended as they come and sorted before the next
+ * lookup, duplicates are dropped then.
+ *
+ * @return int 0 on success, -1 on error
+ */
+int catalog_add(catalog_t *catalog, const char *name);
+
+/**
+ * @brief Apply one change log entry
+ * @details Changes are queued and merged into the names together by
+ * catalog_sort, so a listing of c changes costs one sort of the changes
+ * and one pass over the names instead of a move per change.
+ *
+ * @param op '+' to add name, '-' to remove it
+ * @return int 0 on success, -1 on error
+ */
+int catalog_apply(catalog_t *catalog, char op, const char *name);
+
+/**
+ * @brief Merge the applied changes and sort the names
+ * @details Must be called before names is read; catalog_save does.
+ *
+ * @return int 0 on success, -1 if a name could not be added
+ */
+int catalog_sort(catalog_t *catalog);
+
+/**
+ * @brief Remove every name and queued change, keeping the epoch and
+ * sequence number
+ *
+ */
+void catalog_clear(catalog_t *catalog);
+
+/**
+ * @brief Free the names
+ *
+ */
+void catalog_free(catalog_t *catalog);
+
+#endif // CATALOG_H
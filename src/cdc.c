@@ -0,0 +1,78 @@
+/**
+ * @file cdc.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Content defined chunking (FastCDC style Gear rolling hash)
+ * @version 0.1
+ * @date 2023-05-15
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "cdc.h"
+
+#define CDC_GEAR_SEED 0x9E3779B97F4A7C15ULL
+
+/**
+ * @brief splitmix64, used to fill the Gear table deterministically so every
+ * client cuts identical data at identical offsets
+ */
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z          = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z          = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * @brief Mask with the top *bits* bits set
+ * The Gear hash shifts left each byte, so the high bits depend on the most
+ * input (the last 64 bytes) and give the best boundary distribution.
+ */
+static uint64_t cdc_mask(unsigned int bits) {
+    return bits ? ~0ULL << (64 - bits) : 0;
+}
+
+int cdc_init(cdc_params_t *params, size_t min, size_t avg, size_t max) {
+    if (min < 64 || min > avg || avg > max) {
+        return -1;
+    }
+    params->min = min;
+    params->avg = avg;
+    params->max = max;
+
+    unsigned int bits = 0;
+    while (((size_t)1 << (bits + 1)) <= avg) {
+        bits++;
+    }
+    params->mask_s = cdc_mask(bits + 1);
+    params->mask_l = cdc_mask(bits - 1);
+
+    uint64_t state = CDC_GEAR_SEED;
+    for (int i = 0; i < 256; i++) {
+        params->gear[i] = splitmix64(&state);
+    }
+    return 0;
+}
+
+size_t cdc_cut(const cdc_params_t *params, const uint8_t *buf, size_t len) {
+    if (len <= params->min) {
+        return len;
+    }
+    size_t   end    = len < params->max ? len : params->max;
+    size_t   normal = params->avg < end ? params->avg : end;
+    size_t   i      = params->min;
+    uint64_t h      = 0;
+    for (; i < normal; i++) {
+        h = (h << 1) + params->gear[buf[i]];
+        if (!(h & params->mask_s)) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        h = (h << 1) + params->gear[buf[i]];
+        if (!(h & params->mask_l)) {
+            return i + 1;
+        }
+    }
+    return end;
+}
@@ -0,0 +1,52 @@
+/**
+ * @file cdc.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Content defined chunking (FastCDC style Gear rolling hash)
+ * @details Chunk boundaries are placed where the rolling hash of the last
+ * 64 bytes matches a mask, so inserting or deleting bytes only moves the
+ * boundaries near the edit. Unchanged regions of an edited file produce the
+ * same chunks, which the content addressed store then deduplicates.
+ * Normalized chunking uses a stricter mask before the average size and a
+ * looser one after it to keep chunk sizes close to the average.
+ * @version 0.1
+ * @date 2023-05-15
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CDC_MIN_DEFAULT 16384U
+#define CDC_AVG_DEFAULT 32768U
+#define CDC_MAX_DEFAULT 65536U
+
+typedef struct {
+    size_t   min;
+    size_t   avg;
+    size_t   max;
+    uint64_t mask_s; // Used below avg, harder to match
+    uint64_t mask_l; // Used above avg, easier to match
+    uint64_t gear[256];
+} cdc_params_t;
+
+/**
+ * @brief Set up chunking parameters
+ *
+ * @return int 0 on success, -1 unless 64 <= min <= avg <= max
+ */
+int cdc_init(cdc_params_t *params, size_t min, size_t avg, size_t max);
+
+/**
+ * @brief Find the length of the next chunk at the start of buf
+ * @details buf should hold at least params->max bytes unless it is the end
+ * of the input, in which case the remainder becomes the last chunk.
+ *
+ * @return size_t Length of the chunk, between 1 and min(len, max)
+ */
+size_t cdc_cut(const cdc_params_t *params, const uint8_t *buf, size_t len);
+
+#endif // CDC_H
@@ -18,7 +18,7 @@
 #define MAX_CLIENTS     16
 #define FTP_PACKET_SIZE 65536U // 64Ki bytes
 #define MAX_CHUNKS      1024
-#define TIMEOUT_MS      1000   // 1s  timeout
+#define TIMEOUT_MS      1000   // 1s  timeout, see ftp_set_timeout
 #define REDUNDENCY      2 // Minimum number of servers to store each chunk on
 #define NUM_SERVERS     1
 
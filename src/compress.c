@@ -0,0 +1,283 @@
+/**
+ * @file compress.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Per packet compression codecs for the transfer protocol
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "compress.h"
+
+#include <string.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#define ZSTD_LEVEL 3
+#endif
+
+#define PROBE_SAMPLES 4096
+
+/* -------------------------------------------------------------------------
+ * LZ4 block format
+ * ---------------------------------------------------------------------- */
+
+#define LZ4_HASH_LOG     12
+#define LZ4_MIN_MATCH    4
+#define LZ4_LAST_LITERAL 5  // The last 5 bytes are always literals
+#define LZ4_MF_LIMIT     12 // No match may start within 12 bytes of the end
+#define LZ4_MAX_OFFSET   65535
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/**
+ * @brief Write a length continuation (255, 255, ..., rest)
+ */
+static uint8_t *lz4_write_len(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * @brief Emit one sequence: literals, then a match unless mlen is 0
+ *
+ * @return uint8_t* New output position, NULL if it does not fit
+ */
+static uint8_t *lz4_emit(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                         size_t lit_len, size_t offset, size_t mlen) {
+    // Worst case size of this sequence
+    if ((size_t)(oend - op) < 1 + lit_len + lit_len / 255 + 1 + 2 +
+                                  mlen / 255 + 1) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token         = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) {
+        op = lz4_write_len(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (mlen == 0) {
+        return op;
+    }
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    mlen -= LZ4_MIN_MATCH;
+    *token |= mlen >= 15 ? 15 : mlen;
+    if (mlen >= 15) {
+        op = lz4_write_len(op, mlen - 15);
+    }
+    return op;
+}
+
+static size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst,
+                           size_t cap) {
+    uint32_t       table[1 << LZ4_HASH_LOG] = {0};
+    const uint8_t *ip                       = src;
+    const uint8_t *anchor                   = src;
+    const uint8_t *end                      = src + len;
+    uint8_t       *op                       = dst;
+    uint8_t       *oend                     = dst + cap;
+
+    if (len > LZ4_MF_LIMIT) {
+        const uint8_t *mf_limit    = end - LZ4_MF_LIMIT;
+        const uint8_t *match_limit = end - LZ4_LAST_LITERAL;
+        while (ip < mf_limit) {
+            uint32_t       seq = read32(ip);
+            uint32_t       h   = (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+            const uint8_t *ref = src + table[h];
+            table[h]           = ip - src;
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+            // Extend the match backwards over pending literals, then forwards
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + LZ4_MIN_MATCH;
+            const uint8_t *rp = ref + LZ4_MIN_MATCH;
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            op = lz4_emit(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+            if (!op) {
+                return 0;
+            }
+            ip     = mp;
+            anchor = ip;
+        }
+    }
+    op = lz4_emit(op, oend, anchor, end - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+/**
+ * @brief Read a length continuation
+ *
+ * @return int 0 on success, -1 if the input ends first
+ */
+static int lz4_read_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+static ssize_t lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                              size_t cap) {
+    const uint8_t *ip   = src;
+    const uint8_t *iend = src + len;
+    uint8_t       *op   = dst;
+    uint8_t       *oend = dst + cap;
+    while (ip < iend) {
+        uint8_t token   = *ip++;
+        size_t  lit_len = token >> 4;
+        if (lit_len == 15 && lz4_read_len(&ip, iend, &lit_len) < 0) {
+            return -1;
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend) {
+            break; // The last sequence has no match
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz4_read_len(&ip, iend, &mlen) < 0) {
+            return -1;
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) {
+            return -1;
+        }
+        // Byte by byte, the match may overlap the output
+        const uint8_t *ref = op - offset;
+        while (mlen--) {
+            *op++ = *ref++;
+        }
+    }
+    return op - dst;
+}
+
+/* -------------------------------------------------------------------------
+ * Public interface
+ * ---------------------------------------------------------------------- */
+
+int compress_probe(const uint8_t *buf, size_t len) {
+    if (len < COMPRESS_MIN_LEN) {
+        return 0;
+    }
+    uint32_t hist[256] = {0};
+    size_t   n         = len < PROBE_SAMPLES ? len : PROBE_SAMPLES;
+    size_t   step      = len / n;
+    for (size_t i = 0; i < n; i++) {
+        hist[buf[i * step]]++;
+    }
+    // H2 = -log2(sum p^2) > 7.5 bits  <=>  sum c^2 * 181 < n^2
+    uint64_t sum_sq = 0;
+    for (int i = 0; i < 256; i++) {
+        sum_sq += (uint64_t)hist[i] * hist[i];
+    }
+    return sum_sq * 181 >= (uint64_t)n * n;
+}
+
+size_t compress_buf(compress_codec_t codec, const uint8_t *src, size_t len,
+                    uint8_t *dst, size_t cap) {
+    switch (codec) {
+    case COMPRESS_LZ4:
+        return lz4_compress(src, len, dst, cap);
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t n = ZSTD_compress(dst, cap, src, len, ZSTD_LEVEL);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+ssize_t decompress_buf(compress_codec_t codec, const uint8_t *src, size_t len,
+                       uint8_t *dst, size_t cap) {
+    switch (codec) {
+    case COMPRESS_LZ4:
+        return lz4_decompress(src, len, dst, cap);
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        size_t n = ZSTD_decompress(dst, cap, src, len);
+        return ZSTD_isError(n) ? -1 : (ssize_t)n;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+int compress_supported(compress_codec_t codec) {
+    switch (codec) {
+    case COMPRESS_NONE:
+    case COMPRESS_LZ4:
+        return 1;
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+const char *compress_codec_to_str(compress_codec_t codec) {
+    switch (codec) {
+    case COMPRESS_NONE:
+        return "none";
+    case COMPRESS_LZ4:
+        return "lz4";
+    case COMPRESS_ZSTD:
+        return "zstd";
+    default:
+        return "invalid";
+    }
+}
+
+int compress_codec_from_str(const char *str, compress_codec_t *codec) {
+    if (!str || !codec)
+        return -1;
+    if (strcmp(str, "none") == 0) {
+        *codec = COMPRESS_NONE;
+    } else if (strcmp(str, "lz4") == 0) {
+        *codec = COMPRESS_LZ4;
+    } else if (strcmp(str, "zstd") == 0) {
+        *codec = COMPRESS_ZSTD;
+    } else {
+        return -1;
+    }
+    return 0;
+}
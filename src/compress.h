@@ -0,0 +1,69 @@
+/**
+ * @file compress.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Per packet compression codecs for the transfer protocol
+ * @details lz4 (block format, built in) favours speed, zstd favours ratio and
+ * is only available when built with HAVE_ZSTD (make HAVE_ZSTD=1). Payloads
+ * that look incompressible are sent as is, see compress_probe.
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define COMPRESS_NONE ((uint8_t)0x00)
+#define COMPRESS_LZ4  ((uint8_t)0x01)
+#define COMPRESS_ZSTD ((uint8_t)0x02)
+typedef uint8_t compress_codec_t;
+
+#define COMPRESS_MIN_LEN 512 // Smaller payloads are never worth it
+
+/**
+ * @brief Cheap entropy estimate on a sample of buf
+ * @details Estimates the collision (Renyi order 2) entropy of the byte
+ * histogram of up to 4KiB sampled across the buffer. Media, archives and
+ * encrypted data come out close to 8 bits per byte and are skipped.
+ *
+ * @return int 1 if buf is likely to compress, 0 otherwise
+ */
+int compress_probe(const uint8_t *buf, size_t len);
+
+/**
+ * @brief Compress src into dst
+ *
+ * @return size_t Compressed length, 0 if it would not fit in cap (the caller
+ * should then send the data uncompressed)
+ */
+size_t compress_buf(compress_codec_t codec, const uint8_t *src, size_t len,
+                    uint8_t *dst, size_t cap);
+
+/**
+ * @brief Decompress src into dst
+ *
+ * @return ssize_t Decompressed length, -1 on malformed input or overflow
+ */
+ssize_t decompress_buf(compress_codec_t codec, const uint8_t *src, size_t len,
+                       uint8_t *dst, size_t cap);
+
+/**
+ * @brief Whether this build can encode and decode the codec
+ *
+ */
+int compress_supported(compress_codec_t codec);
+
+/**
+ * @brief Convert between compress_codec_t and its config/protocol name
+ *
+ * @return int 0 on success, -1 if the name is unknown
+ */
+const char *compress_codec_to_str(compress_codec_t codec);
+int compress_codec_from_str(const char *str, compress_codec_t *codec);
+
+#endif // COMPRESS_H
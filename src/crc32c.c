@@ -0,0 +1,146 @@
+/**
+ * @file crc32c.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief CRC32C (Castagnoli) checksums for chunk and packet integrity
+ * @version 0.1
+ * @date 2023-05-12
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78U // Reflected Castagnoli polynomial
+
+static uint32_t crc32c_table[8][256];
+
+typedef uint32_t (*crc32c_fn_t)(uint32_t crc, const uint8_t *p, size_t len);
+
+/**
+ * @brief Portable slicing-by-8 implementation
+ */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF] ^
+              crc32c_table[6][(word >> 8) & 0xFF] ^
+              crc32c_table[5][(word >> 16) & 0xFF] ^
+              crc32c_table[4][(word >> 24) & 0xFF] ^
+              crc32c_table[3][(word >> 32) & 0xFF] ^
+              crc32c_table[2][(word >> 40) & 0xFF] ^
+              crc32c_table[1][(word >> 48) & 0xFF] ^
+              crc32c_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief SSE4.2 implementation, 8 bytes per instruction
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+    }
+    return (uint32_t)crc64;
+}
+#elif defined(__aarch64__)
+/**
+ * @brief ARMv8 CRC extension implementation, 8 bytes per instruction
+ */
+__attribute__((target("+crc"))) static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static crc32c_fn_t crc32c_fn   = crc32c_sw;
+static const char *crc32c_name = "software";
+
+/**
+ * @brief Build the lookup tables and pick the fastest implementation
+ * Runs before main() so the dispatch is settled before any threads exist.
+ */
+__attribute__((constructor)) static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev      = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = crc32c_table[0][prev & 0xFF] ^ (prev >> 8);
+        }
+    }
+#if defined(CRC32C_SOFTWARE)
+    // Built to test the portable tables on any CPU
+#elif defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_fn   = crc32c_hw;
+        crc32c_name = "sse4.2";
+    }
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_fn   = crc32c_hw;
+        crc32c_name = "armv8";
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    return ~crc32c_fn(~crc, (const uint8_t *)buf, len);
+}
+
+const char *crc32c_impl(void) { return crc32c_name; }
@@ -0,0 +1,38 @@
+/**
+ * @file crc32c.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief CRC32C (Castagnoli) checksums for chunk and packet integrity
+ * @version 0.1
+ * @date 2023-05-12
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Compute (or continue) a CRC32C over buf
+ * @details Uses the SSE4.2 crc32 instruction on x86-64 or the ARMv8 CRC
+ * extension when available, falling back to a portable slicing-by-8 table.
+ * The implementation is selected once at program startup; building with
+ * -DCRC32C_SOFTWARE always selects the table.
+ *
+ * @param crc Previous crc value, 0 to start a new checksum
+ * @param buf Data to checksum
+ * @param len Length of buf in bytes
+ * @return uint32_t Updated crc value
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief Return the name of the selected implementation ("sse4.2", "armv8",
+ * or "software")
+ *
+ */
+const char *crc32c_impl(void);
+
+#endif // CRC32C_H
@@ -11,26 +11,49 @@
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h> // mkdir
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "catalog.h"
 #include "common.h"
-#include "md5.h"
+#include "crc32c.h"
+#include "hash.h"
+#include "manifest.h"
 #include "parse_conf.c"
+#include "pool.h"
+#include "prefetch.h"
+#include "ring.h"
+#include "throttle.h"
 #include "transfer.h"
 
 #define CONFIG_PATH "~/dfc.conf"
 
-#define FINF_CHUNK_SUCCESS     ((void *)0)
-#define FINF_CHUNK_FAILURE     ((void *)1)
-#define FINF_CHUNK_SUCCESS_IDX MAX_SERVERS + 1
+#define PUT_BATCH 16 // Chunks read, hashed and sent per pipeline stage
+#define PUT_OWED  2  // Answers a server may owe before the next chunk waits
+
+#define SYNC_TIMEOUT_MS 10000 // For a server to flush its store, see serv_ack
+
+#define PACK_PREFIX    "dfc-pack-" // Filename under which small files are packed
+#define PACK_INDEX_MAX (FTP_PACKET_SIZE - 1024) // Member lines per manifest
+
+#define LIST_STATE_MAX (PATH_MAX + NAME_MAX + 8) // See list_state_path
+#define HEALTH_FILE    "servers" // Server estimates in conf.state_dir
+
+#define SERV_MIN_FREE (256ULL * FTP_PACKET_SIZE) // Takes no chunks below this
+#define SERV_HOT_LOAD 1.0 // Load per CPU above which a server is used last
 
 typedef struct file_info {
     char     filename[NAME_MAX];
@@ -38,19 +61,212 @@ typedef struct file_info {
     time_t   stime;
     uint16_t client_id;
     size_t   num_chunks;
+    int      streamed; // Count not in the name, see file_info_resolve
     int      reproducible;
     serv_t  *chunk_locs[MAX_CHUNKS]
                       [MAX_SERVERS + 2]; // +1 for NULL, +1 for success status
+    serv_t  *manifest_locs[MAX_SERVERS + 1]; // +1 for NULL
 } file_info_t;
 
+typedef struct put_chunk {
+    size_t   chunk_id;
+    uint8_t *buf;
+    size_t   len;
+    uint8_t  digest[HASH_MAX_LEN];
+} put_chunk_t;
+
+typedef struct put_batch {
+    put_chunk_t chunks[PUT_BATCH];
+    size_t      count;
+    hash_ctx_t *file_hash;
+} put_batch_t;
+
+typedef struct range {
+    file_info_t *finf;
+    const off_t *offs; // Chunk layout, NULL for fixed size chunks
+    off_t        offset;
+    off_t        end;
+} range_t;
+
+typedef struct put_stream {
+    int        fd;
+    chunking_t chunking;
+    uint8_t   *buf; // Bytes read past the last chunk boundary
+    size_t     len;
+    int        eof;
+} put_stream_t;
+
+typedef struct repair_stats {
+    size_t          copies; // Replicas written
+    size_t          bytes;  // Payload bytes sent (links are free)
+    size_t          lost;   // Chunks with no replica left
+    size_t          failed; // Chunks no replica could be read for
+    pthread_mutex_t lock;
+} repair_stats_t;
+
+typedef struct pack {
+    int     fd;          // Pack data being assembled in tmp_path, or -1
+    off_t   size;
+    char   *members;     // Member lines for the manifest
+    size_t  members_len;
+    int    *files;       // Indices of the files in this pack
+    size_t  num_files;
+    int    *packed;      // Set for each file once its pack is stored
+    size_t  seq;
+    time_t  started; // Run that made the pack, part of its name
+} pack_t;
+
+typedef struct transfer_job {
+    serv_t     *servlist;
+    int         put; // PUT the file, otherwise GET it
+    char       *path;
+    int         same; // Earlier job for the same file name, or -1
+    int         rv;
+} transfer_job_t;
+
+typedef enum {
+    LIST_PENDING,  // First line not seen yet
+    LIST_CHANGES,  // Change log since the catalog's seq
+    LIST_SNAPSHOT, // Every name the server stores
+    LIST_LEGACY,   // ls -l output from a server without a change log
+} list_mode_t;
+
+typedef struct list_recv {
+    serv_t     *serv;
+    ftp_msg_t   msg;            // Packet being received
+    size_t      got;            // Bytes of msg received so far
+    char        line[PATH_MAX]; // Line carried over between packets
+    size_t      line_len;
+    size_t      line_no;
+    list_mode_t mode;
+    catalog_t   catalog; // Names as of the last LIST, see list_state_path
+    int         done;
+} list_recv_t;
+
+typedef struct gc_batch {
+    char   names[FTP_PACKET_SIZE]; // Pending DELETE, one name per line
+    size_t len;
+} gc_batch_t;
+
+typedef struct gc_copies {
+    char   name[NAME_MAX]; // A packed file
+    size_t count;          // Packs seen so far holding it
+    size_t pack;           // Last of those, +1, see gc_packs
+} gc_copies_t;
+
+typedef struct repair_job {
+    serv_t         *servlist;
+    file_info_t    *finf;
+    size_t          chunk_id;
+    int             rebalance;
+    throttle_t     *throttle;
+    repair_stats_t *stats;
+} repair_job_t;
+
 // Function prototypes
 int  handle__GET(serv_t servlist[], char *filename);
+int  file_get(const char *filename);
+int  handle_BATCH(serv_t servlist[], int put, char *paths[], int num_paths,
+                  const int skip[], int results[]);
+void transfer_file(void *arg);
 int  handle__PUT(serv_t servlist[], char *filename);
+int  handle__PUT_stream(serv_t servlist[], char *filename);
+int  handle__GET_stream(serv_t servlist[], char *filename, int file);
+int  file_get_stream(const char *filename, int file);
+ftp_err_t chunk_prefetch(void *arg, size_t chunk_id, ftp_msg_t *msg);
+int  file_info_resolve(file_info_t *finf);
+int  put_fd(serv_t servlist[], int fd, const char *filename, off_t size,
+            time_t stime, chunking_t chunking, const char *members,
+            size_t members_len);
+int  put_chunks(serv_t servlist[], int fd, uint8_t *map, const char *filename,
+                off_t size, time_t stime, chunking_t chunking,
+                const char *members, size_t members_len);
 int  handle_LIST(serv_t servlist[]);
+int  list_recv_step(list_recv_t *state);
+int  list_recv_line(list_recv_t *state);
+void list_recv_finish(list_recv_t *state);
+void list_state_path(const serv_t *serv, char path[LIST_STATE_MAX]);
+int  handle_REPAIR(serv_t servlist[], int rebalance);
+void repair_chunk(void *arg);
+void repair_manifest(serv_t servlist[], file_info_t *finf);
+int  handle_GC(serv_t servlist[], char *filenames[], int num_filenames);
+int  handle_PACK(serv_t servlist[], char *paths[], int num_paths, int packed[]);
+int  pack_flush(serv_t servlist[], pack_t *pack);
+int  pack_get(const char *filename, int file, time_t newer_than, off_t offset,
+              ssize_t len);
+int  pack_manifest(file_info_t *finf, manifest_t *manifest, ftp_msg_t *msg);
+int  pack_read_member(file_info_t *finf, const manifest_t *manifest,
+                      const manifest_member_t *member, int file);
+int  handle_READ(serv_t servlist[], char *filename, off_t offset, size_t len,
+                 char *dest);
+int  file_get_range(const char *filename, off_t offset, size_t len, int file);
+int  gc_delete(serv_t *serv, gc_batch_t *batch, const char *name,
+               uint64_t *reclaimed);
+int  gc_flush(serv_t *serv, gc_batch_t *batch, uint64_t *reclaimed);
+int  gc_remove(serv_t servlist[], gc_batch_t batches[], file_info_t *finf,
+               uint64_t *reclaimed, size_t *num_deleted);
+int  gc_packs(serv_t servlist[], gc_batch_t batches[], char *filenames[],
+              int num_filenames, uint64_t *reclaimed, size_t *num_removed,
+              size_t *num_deleted);
 void file_list_insert(char *filename, serv_t *serv);
 void file_list_analyze(void);
 void file_list_clear(void);
 void file_list_print(void);
+int  chunk_list_cdc(int fd, const uint8_t *map, off_t size, off_t chunk_offs[],
+                    size_t *num_chunks);
+int  put_batch_read(int fd, uint8_t *map, put_batch_t *batch, size_t first,
+                    size_t num_chunks, const off_t chunk_offs[]);
+int  put_batch_read_stream(put_stream_t *in, put_batch_t *batch, size_t first,
+                           off_t chunk_offs[]);
+void put_chunk_hash(void *arg);
+void put_batch_file_hash(void *arg);
+void chunk_have(serv_t *serv, put_chunk_t *chunks[], size_t num_chunks,
+                int have[]);
+int  put_batch_send(put_batch_t *batch, serv_t servlist[], char *base_name);
+void chunk_put(serv_t *serv, const char *chunk_name, const put_chunk_t *chunk,
+               int have, ftp_durable_t level);
+size_t    serv_acks(serv_t *serv, size_t *owed, size_t keep,
+                    ftp_durable_t last);
+int       serv_link_acks(serv_t *serv, int have[], const size_t linked[],
+                         size_t sent, size_t *acked, size_t keep,
+                         ftp_durable_t last);
+ftp_err_t serv_ack(serv_t *serv, ftp_durable_t level, size_t bytes);
+int  manifest_put(serv_t *servs[], int num_servs, char *base_name,
+                  manifest_t *manifest);
+int  manifest_get(file_info_t *finf, manifest_t *manifest);
+int  manifest_fetch(file_info_t *finf, manifest_t *manifest, ftp_msg_t *msg);
+int  write_all(int fd, off_t offset, const uint8_t *buf, size_t len);
+void serv_hello(serv_t *serv);
+void serv_stat(serv_t *serv);
+ftp_durable_t serv_level(serv_t *serv);
+void serv_health_save(serv_t servlist[]);
+int  serv_timeout(serv_t *serv, size_t bytes);
+void serv_connect(serv_t *serv);
+void serv_reset(serv_t *serv);
+void serv_sockopts(serv_t *serv, ftp_sockopts_t *opts);
+ftp_err_t serv_open(serv_t *serv, const char *name, ftp_msg_t *msg);
+
+ftp_err_t serv_request(serv_t *serv, ftp_cmd_t cmd, const char *arg,
+                       ssize_t len, size_t bytes, ftp_msg_t *msg);
+ftp_err_t serv_request_fd(serv_t *serv, ftp_cmd_t cmd, const char *arg,
+                          ssize_t len, size_t bytes, ftp_msg_t *msg,
+                          int *passfd);
+int  placement_init(serv_t servlist[]);
+
+size_t    placement_lookup(serv_t servlist[], const uint8_t *digest,
+                           size_t placement[REDUNDENCY]);
+size_t    file_info_versions(const char *filename, int ids[], size_t max);
+size_t    serv_rank(serv_t *const locs[], size_t max, size_t bytes,
+                    serv_t *ranked[]);
+ftp_err_t chunk_get(file_info_t *finf, size_t chunk_id, ftp_msg_t *msg);
+ftp_err_t chunk_get_range(file_info_t *finf, size_t chunk_id, size_t offset,
+                          size_t len, ftp_msg_t *msg);
+ssize_t   range_read(file_info_t *finf, const off_t offs[], off_t offset,
+                     size_t len, int file, hash_ctx_t *ctx);
+ftp_err_t range_prefetch(void *arg, size_t chunk_id, ftp_msg_t *msg);
+off_t     range_base(const range_t *range, size_t c);
+ssize_t   range_read_scan(file_info_t *finf, off_t offset, size_t len, int file,
+                          ftp_msg_t *msg);
 
 // Global variables
 uint16_t    client_id;
@@ -58,9 +274,16 @@ char        tmp_path[NAME_MAX]   = {0};
 file_info_t file_info[MAX_FILES] = {0};
 size_t      num_files            = 0;
 size_t      num_servers          = 0;
+ring_t      ring;  // Chunk placement over every configured server
+cache_t     cache; // Chunks read earlier, see conf.cache_size
+char        state_path[PATH_MAX] = {0}; // conf.state_dir with ~ expanded
 
 void printUsage(char *argv[]) {
     printf("Usage: %s <command> [filename] ... [filename]\n", argv[0]);
+    printf("       %s read <filename> <offset> <length> [dest]\n", argv[0]);
+    printf("       %s put - <filename>   (from stdin)\n", argv[0]);
+    printf("       %s get <filename> -   (to stdout)\n", argv[0]);
+    printf("Commands: get, put, list, read, repair, rebalance, gc\n");
 }
 
 enum command {
@@ -68,6 +291,10 @@ enum command {
     GET,
     PUT,
     LIST,
+    REPAIR,
+    REBALANCE,
+    GC,
+    READ,
 } cmd = INVALID;
 
 enum command parseArgs(int argc, char *argv[]) {
@@ -84,14 +311,32 @@ enum command parseArgs(int argc, char *argv[]) {
         cmd = PUT;
     } else if (strcmp(argv[1], "list") == 0) {
         cmd = LIST;
+    } else if (strcmp(argv[1], "repair") == 0) {
+        cmd = REPAIR;
+    } else if (strcmp(argv[1], "rebalance") == 0) {
+        cmd = REBALANCE;
+    } else if (strcmp(argv[1], "gc") == 0) {
+        cmd = GC;
+    } else if (strcmp(argv[1], "read") == 0 && argc >= 5) {
+        cmd = READ;
     }
     return cmd;
 }
 
 int main(int argc, char *argv[]) {
+    cmd = parseArgs(argc, argv);
+
+    // "put - name" reads the file from stdin, "get name -" writes it to
+    // stdout, which then only carries the file; messages go to stderr
+    int stream = (cmd == PUT || cmd == GET) && argc == 4 &&
+                 strcmp(argv[cmd == PUT ? 2 : 3], "-") == 0;
+    int out    = STDOUT_FILENO;
+    if (stream && cmd == GET) {
+        out = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
     puts("");
 
-    cmd = parseArgs(argc, argv);
     if (cmd == INVALID) {
         printUsage(argv);
         exit(1);
@@ -110,36 +355,63 @@ int main(int argc, char *argv[]) {
     char config_path[PATH_MAX] = {0};
     snprintf(config_path, PATH_MAX, "%s%s", getenv("HOME"), CONFIG_PATH + 1);
     printf("[INFO]\tLoading server configuration from: %s\n", config_path);
-    serv_t servlist[MAX_SERVERS];
-    int    num_servers2 = parseConfig(config_path, servlist);
+    serv_t servlist[MAX_SERVERS] = {0};
+    int    num_servers2          = parseConfig(config_path, servlist);
     if (num_servers2 < 0) {
         printf("Failed to parse config file\n");
         exit(1);
     }
 
-    // Create a socket for each server
+    // Open the chunk cache shared by every run of the client
+    char cache_path[PATH_MAX] = {0};
+    confPath(conf.cache_dir, cache_path);
+    if (cache_init(&cache, cache_path, (uint64_t)conf.cache_size << 20) < 0) {
+        fprintf(stderr, "[INFO]\tChunk cache disabled: %s\n", cache_path);
+        cache_init(&cache, cache_path, 0);
+    }
+
+    // State kept between runs (server catalogs and estimates)
+    confPath(conf.state_dir, state_path);
+    if (mkdir(state_path, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "[INFO]\tCannot create state directory: %s\n",
+                state_path);
+    }
+
+    // Start from what earlier runs learned about each server
     for (serv_t *serv = servlist; serv; serv = serv->next) {
-        serv->fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (serv->fd < 0) {
-            perror("socket");
-            exit(1);
-        }
+        pthread_mutex_init(&serv->lock, NULL);
+        char health_path[PATH_MAX + 16];
+        snprintf(health_path, sizeof(health_path), "%s/%s", state_path,
+                 HEALTH_FILE);
+        health_init(&serv->health);
+        health_load(&serv->health, health_path, serv->name);
     }
 
     // Connect to each server
     for (serv_t *serv = servlist; serv; serv = serv->next) {
-        struct sockaddr_in serv_addr;
-        serv_addr.sin_family      = AF_INET;
-        serv_addr.sin_port        = htons(atoi(serv->port));
-        serv_addr.sin_addr.s_addr = inet_addr(serv->ip);
+        serv_connect(serv);
+    }
 
-        if (connect(serv->fd, (struct sockaddr *)&serv_addr,
-                    sizeof(serv_addr)) >= 0) {
-            serv->connected = 1;
-        } else {
-            close(serv->fd);
-            serv->connected = 0;
+    // Agree on a compression codec with each server and collect their
+    // capacity and load for placement
+    for (serv_t *serv = servlist; serv; serv = serv->next) {
+        if (!serv->connected)
+            continue;
+        // Compressing only costs time when the server is on this host
+        if (conf.compress != COMPRESS_NONE && !serv->path) {
+            serv_hello(serv);
         }
+        serv_stat(serv);
+        if (serv_level(serv) < conf.durability) {
+            fprintf(stderr,
+                    "[WARN]\tServer does not confirm chunks (%s), not "
+                    "waiting for durability %s there\n",
+                    serv->name, ftp_durable_to_str(conf.durability));
+        }
+    }
+    if (placement_init(servlist) < 0) {
+        perror("placement_init");
+        exit(EXIT_FAILURE);
     }
 
     // update the server id's
@@ -158,26 +430,58 @@ int main(int argc, char *argv[]) {
     int rv = EXIT_SUCCESS;
     switch (cmd) {
     case GET:
-        while (argc > 2) {
-            rv |= handle__GET(servlist, argv[argc - 1]);
-            char *status = rv == EXIT_SUCCESS ? "OK" : "FAIL";
-            printf("[GET] %4s\t%s", status, argv[argc - 1]);
-            argc--;
+    case PUT: {
+        if (stream) {
+            char *filename = argv[cmd == PUT ? 3 : 2];
+            rv |= cmd == PUT ? handle__PUT_stream(servlist, filename)
+                             : handle__GET_stream(servlist, filename, out);
+            printf("[%s] %4s\t%s (stream)\n", cmd == PUT ? "PUT" : "GET",
+                   rv == EXIT_SUCCESS ? "OK" : "FAIL", filename);
+            break;
         }
-        break;
-    case PUT:
-        while (argc > 2) {
-            rv |= handle__PUT(servlist, argv[argc - 1]);
-            char *status = rv == EXIT_SUCCESS ? "OK" : "FAIL";
-            printf("[PUT] %4s\t%s", status, argv[argc - 1]);
-            argc--;
+        // Small files go out in packs first, the rest are transferred
+        // transfer_jobs at a time
+        int num_paths = argc - 2;
+        int packed[num_paths];
+        int results[num_paths];
+        memset(packed, 0, sizeof(packed));
+        if (cmd == PUT && conf.pack_threshold) {
+            rv |= handle_PACK(servlist, argv + 2, num_paths, packed);
+        }
+        if (cmd == GET) {
+            handle_LIST(servlist);
+        }
+        rv |= handle_BATCH(servlist, cmd == PUT, argv + 2, num_paths, packed,
+                           results);
+        for (int i = 0; i < num_paths; i++) {
+            printf("[%s] %4s\t%s%s\n", cmd == PUT ? "PUT" : "GET",
+                   results[i] == EXIT_SUCCESS ? "OK" : "FAIL", argv[i + 2],
+                   packed[i] ? " (packed)" : "");
         }
         break;
+    }
     case LIST:
         rv |= handle_LIST(servlist);
         char *status = rv == EXIT_SUCCESS ? "OK" : "FAIL";
         printf("[LIST] %4s\n", status);
         break;
+    case REPAIR:
+    case REBALANCE:
+        rv |= handle_REPAIR(servlist, cmd == REBALANCE);
+        printf("[%s] %4s\n", cmd == REPAIR ? "REPAIR" : "REBALANCE",
+               rv == EXIT_SUCCESS ? "OK" : "FAIL");
+        break;
+    case GC:
+        rv |= handle_GC(servlist, argv + 2, argc - 2);
+        printf("[GC] %4s\n", rv == EXIT_SUCCESS ? "OK" : "FAIL");
+        break;
+    case READ:
+        rv |= handle_READ(servlist, argv[2], strtol(argv[3], NULL, 10),
+                          strtoul(argv[4], NULL, 10),
+                          argc > 5 ? argv[5] : argv[2]);
+        printf("[READ] %4s\t%s\n", rv == EXIT_SUCCESS ? "OK" : "FAIL",
+               argv[2]);
+        break;
     default:
         printf("Invalid command\n");
         rv |= EXIT_FAILURE;
@@ -185,22 +489,46 @@ int main(int argc, char *argv[]) {
     }
 
     // Cleanup
+    serv_health_save(servlist);
     for (serv_t *serv = servlist; serv; serv = serv->next) {
-        close(serv->fd);
+        ftp_close(serv->fd);
+        health_destroy(&serv->health);
     }
+    ring_free(&ring);
+    cache_destroy(&cache);
     remove(tmp_path);
+    if (out != STDOUT_FILENO) {
+        close(out);
+    }
 
     puts("");
     return rv;
 }
 
-int file_info_get_next_match(char *filename, int start) {
-    for (size_t i = start; i < num_files; i++) {
+static int file_info_newer(const void *a, const void *b) {
+    const file_info_t *fa = &file_info[*(const int *)a];
+    const file_info_t *fb = &file_info[*(const int *)b];
+    if (fa->stime != fb->stime) {
+        return fa->stime > fb->stime ? -1 : 1;
+    }
+    return fb->client_id - fa->client_id;
+}
+
+/**
+ * @brief Find the versions of filename in the file list, newest first
+ *
+ * @param ids Output, indices into file_info ordered by descending stime
+ * @return size_t Number of versions found
+ */
+size_t file_info_versions(const char *filename, int ids[], size_t max) {
+    size_t n = 0;
+    for (size_t i = 0; i < num_files && n < max; i++) {
         if (strcmp(file_info[i].filename, filename) == 0) {
-            return i;
+            ids[n++] = i;
         }
     }
-    return -1;
+    qsort(ids, n, sizeof(int), file_info_newer);
+    return n;
 }
 
 /**
@@ -209,94 +537,117 @@ int file_info_get_next_match(char *filename, int start) {
  */
 int handle__GET(serv_t servlist[], char *filename) {
     handle_LIST(servlist);
+    return file_get(filename);
+}
 
+/**
+ * @brief Download filename using the file list of the last LIST
+ *
+ */
+int file_get(const char *filename) {
     // Create the file locally
-    int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    int file = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0777);
     if (file < 0) {
         perror("open");
         return EXIT_FAILURE;
     }
 
-    // Find the filename in the file_info array
-    int file_id = -1;
-    while ((file_id = file_info_get_next_match(filename, file_id + 1)) >= 0) {
+    // Find the newest complete version of the file
+    int    versions[MAX_FILES];
+    size_t num_versions = file_info_versions(filename, versions, MAX_FILES);
+    size_t v            = 0;
+
+    // A newer copy may have been uploaded in a pack of small files
+    time_t newest = 0;
+    for (; v < num_versions; v++) {
+        if (file_info[versions[v]].reproducible) {
+            newest = file_info[versions[v]].stime;
+            break;
+        }
+    }
+    if (pack_get(filename, file, newest, 0, -1) == EXIT_SUCCESS) {
+        close(file);
+        return EXIT_SUCCESS;
+    }
+
+    for (v = 0; v < num_versions; v++) {
+        int file_id = versions[v];
         // Check if the file is complete
-        if (!file_info[file_id].reproducible)
+        if (!file_info[file_id].reproducible ||
+            file_info_resolve(&file_info[file_id]) < 0)
             continue;
 
         // Easy access
         file_info_t *finf = &file_info[file_id];
-        ftp_err_t    err  = FTP_ERR_NONE;
-
         printf("[INFO]\tFound file: %s\n", finf->storename);
 
-        // Get each chunk
-        for (size_t i = 0; i < finf->num_chunks; i++) {
-            // Clear the chunk success array
-            finf->chunk_locs[i][FINF_CHUNK_SUCCESS_IDX] = FINF_CHUNK_FAILURE;
-            // Try each of the servers which is known to have the file
-            for (size_t j = 0; j < MAX_SERVERS; j++) {
-                serv_t *serv = finf->chunk_locs[i][j];
-                if (!serv || !serv->connected)
-                    continue;
-                // Send the GET command with the chunk id
-                char chunkpath[PATH_MAX] = {0};
-                sprintf(chunkpath, "%s.%lu", finf->storename, i);
-                ftp_send_msg(serv->fd, FTP_CMD_GET, chunkpath, -1);
-                // Wait for the response
-                ftp_msg_t msg = {0};
-                err           = ftp_recv_msg(serv->fd, &msg);
-                // Handle the error
-                switch (err) {
-                case FTP_ERR_NONE:
-                    break;
-                case FTP_ERR_CLOSE:
-                    fprintf(stderr, "[INFO]\tServer closed connection (%s)\n",
-                            serv->name);
-                    serv->connected = 0;
-                    continue;
-                case FTP_ERR_TIMEOUT:
-                    fprintf(stderr, "[INFO]\tServer timed out (%s)\n",
-                            serv->name);
-                    continue;
-                default:
-                    fprintf(stderr, "Unknown ftp_recv_msg error: %s\n",
-                            ftp_err_to_str(err));
-                    goto handle__GET_failure;
-                }
-                // Write the chunk to the file
-                lseek(file, i * FTP_PACKET_SIZE, SEEK_SET);
-                size_t bytes_written = 0;
-                while (bytes_written < msg.nbytes) {
-                    ssize_t n = write(file, msg.packet + bytes_written,
-                                      msg.nbytes - bytes_written);
-                    if (n < 0) {
-                        perror("write");
-                        goto handle__GET_failure;
-                    }
-                    bytes_written += n;
-                }
-                // We got the chunk, so we can stop trying
-                finf->chunk_locs[i][FINF_CHUNK_SUCCESS_IDX] =
-                    FINF_CHUNK_SUCCESS;
-            }
+        // A failed newer version may have left more bytes than this one has
+        if (ftruncate(file, 0) < 0) {
+            perror("ftruncate");
+            goto handle__GET_failure;
         }
 
-        // Check if we got all the chunks
-        for (size_t i = 0; i < finf->num_chunks; i++) {
-            if (finf->chunk_locs[i][FINF_CHUNK_SUCCESS_IDX] ==
-                FINF_CHUNK_FAILURE) {
+        // Older uploads have no manifest and cannot be verified
+        manifest_t manifest;
+        int        verify = manifest_get(finf, &manifest) == EXIT_SUCCESS;
+        hash_ctx_t ctx;
+        if (verify) {
+            hash_init(&ctx, manifest.hash_algo);
+        }
+
+        // Get each chunk, chunks may differ in size (content defined).
+        // The following chunks are requested while one is written.
+        prefetch_t prefetch;
+        if (prefetch_init(&prefetch, chunk_prefetch, finf, finf->num_chunks,
+                          conf.readahead) < 0) {
+            fprintf(stderr, "Failed to set up the read-ahead\n");
+            goto handle__GET_failure;
+        }
+        off_t offset  = 0;
+        int   failed  = 0;
+        int   missing = 0;
+        for (size_t i = 0; i < finf->num_chunks && !failed; i++) {
+            ftp_msg_t *msg;
+            ftp_err_t  err = prefetch_get(&prefetch, i, &msg);
+            if (err == FTP_ERR_SERVER) {
+                // No replica could serve it
                 fprintf(stderr, "Failed to get chunk %lu\n", i);
-                goto handle__GET_next_file;
+                missing = 1;
+                break;
+            }
+            failed = err != FTP_ERR_NONE ||
+                     write_all(file, offset, msg->packet, msg->nbytes) < 0;
+            if (verify && !failed) {
+                hash_update(&ctx, msg->packet, msg->nbytes);
+            }
+            offset += msg->nbytes;
+        }
+        prefetch_destroy(&prefetch);
+        if (failed) {
+            goto handle__GET_failure;
+        }
+        if (missing) {
+            continue;
+        }
+
+        // Check the file hash against the manifest
+        if (verify) {
+            uint8_t digest[HASH_MAX_LEN];
+            hash_final(&ctx, digest);
+            if (memcmp(digest, manifest.checksum,
+                       hash_len(manifest.hash_algo)) != 0) {
+                fprintf(stderr, "[INFO]\tChecksum mismatch (%s): %s\n",
+                        hash_algo_to_str(manifest.hash_algo), finf->storename);
+                continue;
             }
+            printf("[INFO]\tVerified %s checksum\n",
+                   hash_algo_to_str(manifest.hash_algo));
         }
-        // TODO: Check the file hash
         break;
-    handle__GET_next_file:;
     }
-    if (file_id < 0) {
+    if (v == num_versions) {
         printf("[INFO]\tFile is not available\n");
-        return EXIT_FAILURE;
+        goto handle__GET_failure;
     }
 
     close(file);
@@ -339,6 +690,181 @@ handle__GET_failure:;
     // return EXIT_SUCCESS;
 }
 
+/**
+ * @brief Handles "get <filename> -": the newest version of filename to file
+ *
+ */
+int handle__GET_stream(serv_t servlist[], char *filename, int file) {
+    handle_LIST(servlist);
+    return file_get_stream(filename, file);
+}
+
+/**
+ * @brief Write filename to file in order, e.g. a pipe
+ * @details Chunks are read ahead (conf.readahead) and written in order,
+ * so at most that many wait in memory. The file hash is computed on the
+ * way out. Nothing written can
+ * be taken back, so only the newest complete version is tried, and a
+ * missing chunk or checksum mismatch fails the transfer after the fact.
+ */
+int file_get_stream(const char *filename, int file) {
+    int          versions[MAX_FILES];
+    size_t       num_versions = file_info_versions(filename, versions,
+                                                   MAX_FILES);
+    file_info_t *finf         = NULL;
+    for (size_t v = 0; v < num_versions && !finf; v++) {
+        if (file_info[versions[v]].reproducible) {
+            finf = &file_info[versions[v]];
+        }
+    }
+    if (pack_get(filename, file, finf ? finf->stime : 0, 0, -1) ==
+        EXIT_SUCCESS) {
+        return EXIT_SUCCESS;
+    }
+    if (!finf || file_info_resolve(finf) < 0) {
+        printf("[INFO]\tFile is not available\n");
+        return EXIT_FAILURE;
+    }
+    printf("[INFO]\tFound file: %s\n", finf->storename);
+
+    // Older uploads have no manifest and cannot be verified
+    manifest_t manifest;
+    int        verify = manifest_get(finf, &manifest) == EXIT_SUCCESS;
+    hash_ctx_t ctx;
+    prefetch_t prefetch;
+    if (prefetch_init(&prefetch, chunk_prefetch, finf, finf->num_chunks,
+                      conf.readahead) < 0) {
+        fprintf(stderr, "Failed to set up the read-ahead\n");
+        return EXIT_FAILURE;
+    }
+    if (verify) {
+        hash_init(&ctx, manifest.hash_algo);
+    }
+
+    int   rv     = EXIT_SUCCESS;
+    off_t offset = 0;
+    for (size_t i = 0; i < finf->num_chunks; i++) {
+        ftp_msg_t *msg;
+        if (prefetch_get(&prefetch, i, &msg) != FTP_ERR_NONE) {
+            fprintf(stderr, "Failed to get chunk %lu\n", i);
+            rv = EXIT_FAILURE;
+            break;
+        }
+        if (write_all(file, offset, msg->packet, msg->nbytes) < 0) {
+            rv = EXIT_FAILURE;
+            break;
+        }
+        if (verify) {
+            hash_update(&ctx, msg->packet, msg->nbytes);
+        }
+        offset += msg->nbytes;
+    }
+    prefetch_destroy(&prefetch);
+
+    if (rv == EXIT_SUCCESS && verify) {
+        uint8_t digest[HASH_MAX_LEN];
+        hash_final(&ctx, digest);
+        if (memcmp(digest, manifest.checksum, hash_len(manifest.hash_algo))) {
+            fprintf(stderr, "[INFO]\tChecksum mismatch (%s): %s\n",
+                    hash_algo_to_str(manifest.hash_algo), finf->storename);
+            return EXIT_FAILURE;
+        }
+        printf("[INFO]\tVerified %s checksum\n",
+               hash_algo_to_str(manifest.hash_algo));
+    }
+    return rv;
+}
+
+/**
+ * @brief prefetch_fn_t for whole chunks of the file_info_t in arg
+ *
+ */
+ftp_err_t chunk_prefetch(void *arg, size_t chunk_id, ftp_msg_t *msg) {
+    return chunk_get(arg, chunk_id, msg);
+}
+
+/**
+ * @brief Transfer several files at once
+ * @details Files are handed to conf.transfer_jobs workers, so the chunks of
+ * one file go out (or come in) while another is still being read, hashed or
+ * waiting on a reply, and every server sees a steady stream of chunks from
+ * all of them. Each request and its reply hold the server's lock, keeping
+ * the shared connections consistent. GET expects a fresh LIST. Files with
+ * skip[i] set are reported as done. A path repeated in paths is transferred
+ * once; a different path with the same file name fails.
+ *
+ * @param put PUT the files, otherwise GET them
+ * @param results Output, EXIT_SUCCESS or EXIT_FAILURE for each path
+ */
+int handle_BATCH(serv_t servlist[], int put, char *paths[], int num_paths,
+                 const int skip[], int results[]) {
+    transfer_job_t *jobs = calloc(num_paths, sizeof(transfer_job_t));
+    pool_t          pool;
+    size_t          num_jobs = (size_t)num_paths < conf.transfer_jobs
+                                   ? (size_t)num_paths
+                                   : conf.transfer_jobs;
+    if (!jobs || pool_init(&pool, num_jobs ? num_jobs : 1) < 0) {
+        fprintf(stderr, "Failed to set up the transfer pool\n");
+        free(jobs);
+        for (int i = 0; i < num_paths; i++) {
+            results[i] = EXIT_FAILURE;
+        }
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_paths; i++) {
+        jobs[i].servlist = servlist;
+        jobs[i].put      = put;
+        jobs[i].path     = paths[i];
+        jobs[i].same     = -1;
+        jobs[i].rv       = EXIT_SUCCESS;
+        if (skip[i]) {
+            continue;
+        }
+        // Two jobs for one name would race on its chunks and local file
+        const char *name = strrchr(paths[i], '/');
+        name             = name ? name + 1 : paths[i];
+        for (int j = 0; j < i && jobs[i].same < 0; j++) {
+            const char *other = strrchr(paths[j], '/');
+            other             = other ? other + 1 : paths[j];
+            if (!skip[j] && strcmp(name, other) == 0) {
+                jobs[i].same = j;
+            }
+        }
+        if (jobs[i].same < 0) {
+            pool_submit(&pool, transfer_file, &jobs[i]);
+        } else if (strcmp(paths[i], paths[jobs[i].same]) != 0) {
+            fprintf(stderr, "[INFO]\tSkipping %s, %s is already named %s\n",
+                    paths[i], paths[jobs[i].same], name);
+        }
+    }
+    pool_wait(&pool);
+    pool_destroy(&pool);
+
+    int rv = EXIT_SUCCESS;
+    for (int i = 0; i < num_paths; i++) {
+        int same = jobs[i].same;
+        if (same >= 0) {
+            // A repeated path shares the result, another file fails
+            jobs[i].rv = strcmp(paths[i], paths[same]) == 0 ? jobs[same].rv
+                                                             : EXIT_FAILURE;
+        }
+        results[i] = jobs[i].rv;
+        rv |= jobs[i].rv;
+    }
+    free(jobs);
+    return rv;
+}
+
+/**
+ * @brief Pool job: PUT or GET a single file
+ *
+ */
+void transfer_file(void *arg) {
+    transfer_job_t *job = arg;
+    job->rv = job->put ? handle__PUT(job->servlist, job->path)
+                       : file_get(job->path);
+}
+
 /**
  * @brief Handles the PUT command
  *
@@ -371,36 +897,24 @@ int handle__PUT(serv_t servlist[], char *argpath) {
 
     // -- Determine the file info for distribution --
     // get the absolute path of the file
+    // Runs in a transfer worker, a bad path only fails its own job
     char *filepath = realpath(argpath, NULL);
     if (filepath == NULL) {
-        perror("realpath");
-        exit(1);
+        perror(argpath);
+        return EXIT_FAILURE;
     }
     printf("filepath: %s\n", filepath);
 
     // Get file name
-    char *filename = strrchr(filepath, '/');
-    if (filename == NULL) {
-        perror("strrchr");
-        exit(1);
-    }
-    filename++;
+    char *filename = strrchr(filepath, '/') + 1;
     printf("filename: %s\n", filename);
 
-    // Hash the file name
-    uint8_t hash[16];
-    char    hash_str[33];
-    md5String(filename, hash);
-    for (int i = 0; i < 16; i++) {
-        sprintf(hash_str + (i * 2), "%02x", hash[i]);
-    }
-    printf("hash: %s\n", hash_str);
-
     // Stat the file
     struct stat st;
     if (stat(filepath, &st) == -1) {
         perror("stat");
-        exit(1);
+        free(filepath);
+        return EXIT_FAILURE;
     }
     off_t size = st.st_size;
     // time_t mtime = st.st_mtime;
@@ -408,16 +922,113 @@ int handle__PUT(serv_t servlist[], char *argpath) {
     printf("size: %ld\n", size);
     printf("stime: %lu\n", stime);
 
-    // Determine number of chunks
-    size_t full_chunks  = size / FTP_PACKET_SIZE;
-    size_t residual_len = size % FTP_PACKET_SIZE;
-    size_t num_chunks   = full_chunks + (residual_len ? 1 : 0);
-    printf("chunks (%lu): (%lu * FTP_PACKET_SIZE) + %lu = %lu\n", num_chunks,
-           full_chunks, residual_len,
-           full_chunks * FTP_PACKET_SIZE + residual_len);
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        free(filepath);
+        return EXIT_FAILURE;
+    }
+
+    int rv = put_fd(servlist, fd, filename, size, stime, conf.chunking, NULL,
+                    0);
+    close(fd);
+    free(filepath);
+    return rv;
+}
+
+/**
+ * @brief Handles "put - <filename>": stdin is stored as filename
+ *
+ */
+int handle__PUT_stream(serv_t servlist[], char *filename) {
+    if (strchr(filename, '/')) {
+        fprintf(stderr, "Invalid file name: %s\n", filename);
+        return EXIT_FAILURE;
+    }
+    return put_fd(servlist, STDIN_FILENO, filename, -1, time(NULL),
+                  conf.chunking, NULL, 0);
+}
+
+/**
+ * @brief Distribute the contents of fd as filename
+ * @details Shared by plain files, packs and streams. members holds the
+ * member lines of a pack manifest (NULL otherwise). Packs always use fixed
+ * size chunks so the chunks holding a member follow from its offset.
+ * A negative size reads fd (e.g. a pipe) to its end. The chunk count is
+ * then only known once everything is sent, so the chunk names carry a
+ * count of 0 and the manifest, written last, has the real one (see
+ * file_info_resolve).
+ * Regular files are mapped, so chunks are cut, hashed and sent straight
+ * from the page cache without being copied. The file must not shrink
+ * while it is stored.
+ */
+int put_fd(serv_t servlist[], int fd, const char *filename, off_t size,
+           time_t stime, chunking_t chunking, const char *members,
+           size_t members_len) {
+    uint8_t *map = NULL;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL; // Read it instead
+        } else {
+            madvise(map, size, MADV_SEQUENTIAL);
+        }
+    }
+    int rv = put_chunks(servlist, fd, map, filename, size, stime, chunking,
+                        members, members_len);
+    if (map) {
+        munmap(map, size);
+    }
+    return rv;
+}
+
+/**
+ * @brief put_fd for fd, or its mapping map (may be NULL)
+ *
+ */
+int put_chunks(serv_t servlist[], int fd, uint8_t *map, const char *filename,
+               off_t size, time_t stime, chunking_t chunking,
+               const char *members, size_t members_len) {
+    // Determine the chunk boundaries
+    off_t        chunk_offs[MAX_CHUNKS + 1] = {0};
+    size_t       num_chunks                 = 0;
+    put_stream_t in                         = {0};
+    if (size < 0) {
+        in.fd       = fd;
+        in.chunking = chunking;
+        in.buf      = malloc(FTP_PACKET_SIZE);
+        if (!in.buf) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+        printf("chunks: streamed, counted at the end\n");
+    } else if (chunking == CHUNKING_CDC) {
+        if (chunk_list_cdc(fd, map, size, chunk_offs, &num_chunks) < 0) {
+            return EXIT_FAILURE;
+        }
+        printf("chunks (%lu): content defined, avg %lu bytes\n", num_chunks,
+               num_chunks ? size / num_chunks : 0);
+    } else {
+        size_t full_chunks  = size / FTP_PACKET_SIZE;
+        size_t residual_len = size % FTP_PACKET_SIZE;
+        num_chunks          = full_chunks + (residual_len ? 1 : 0);
+        printf("chunks (%lu): (%lu * FTP_PACKET_SIZE) + %lu = %lu\n",
+               num_chunks, full_chunks, residual_len,
+               full_chunks * FTP_PACKET_SIZE + residual_len);
+        if (num_chunks > MAX_CHUNKS) {
+            fprintf(stderr, "File too large (%lu > %d chunks)\n", num_chunks,
+                    MAX_CHUNKS);
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < num_chunks; i++) {
+            chunk_offs[i] = i * FTP_PACKET_SIZE;
+        }
+        chunk_offs[num_chunks] = size;
+    }
 
     // Ensure there are at least NUM_SERVERS servers available for writing
     // This also allows us to index into the servlist array
+    serv_t *servlist_all = servlist;
     serv_t *servlist_i[MAX_SERVERS];
     int     num_servers = 0;
     while (servlist) {
@@ -430,6 +1041,7 @@ int handle__PUT(serv_t servlist[], char *argpath) {
     if (num_servers < NUM_SERVERS) {
         printf("Not enough servers available for writing (%d/%d)\n",
                num_servers, NUM_SERVERS);
+        free(in.buf);
         return EXIT_FAILURE;
     }
 
@@ -440,200 +1052,1717 @@ int handle__PUT(serv_t servlist[], char *argpath) {
              num_chunks);
 
     // Distribute chunks among available servers with REDUNDENCY
-    printf("Distributing file %s\n", filepath);
-    int fd = open(filepath, O_RDONLY);
+    // Chunks move through a two stage pipeline: while the pool hashes one
+    // batch, the main thread sends the previous batch and reads the next.
+    printf("Distributing file %s\n", filename);
+    hash_ctx_t  file_hash;
+    put_batch_t batches[2] = {0};
+    pool_t      pool;
+    uint8_t    *bufs = map ? NULL : malloc(2 * PUT_BATCH * FTP_PACKET_SIZE);
+    if ((!map && !bufs) || pool_init(&pool, 0) < 0) {
+        fprintf(stderr, "Failed to set up the hashing pool\n");
+        free(bufs);
+        free(in.buf);
+        return EXIT_FAILURE;
+    }
+    hash_init(&file_hash, conf.hash);
+    for (size_t b = 0; b < 2; b++) {
+        batches[b].file_hash = &file_hash;
+        for (size_t c = 0; c < PUT_BATCH && bufs; c++) {
+            batches[b].chunks[c].buf =
+                bufs + (b * PUT_BATCH + c) * FTP_PACKET_SIZE;
+        }
+    }
+
+    int          rv   = EXIT_SUCCESS;
+    put_batch_t *prev = NULL;
     puts("Chunk Map:\t(chunk)\t->\t(serv_id)");
-    for (size_t chunk_id = 0; chunk_id < num_chunks; chunk_id++) {
-        // Read the chunk from the file
-        lseek(fd, chunk_id * FTP_PACKET_SIZE, SEEK_SET);
-        uint8_t buf[FTP_PACKET_SIZE] = {0};
-        size_t  nread                = 0;
-        ssize_t n                    = 0;
-        while ((n = read(fd, (char *)buf + nread, FTP_PACKET_SIZE - nread)) >
-               0) {
-            nread += n;
-            if (nread == FTP_PACKET_SIZE) {
-                break;
+    for (size_t first = 0, b = 0;
+         in.buf ? !in.eof || in.len : first < num_chunks;
+         first += PUT_BATCH, b ^= 1) {
+        put_batch_t *cur = &batches[b];
+        if (in.buf ? put_batch_read_stream(&in, cur, first, chunk_offs) < 0
+                   : put_batch_read(fd, map, cur, first, num_chunks,
+                                    chunk_offs) < 0) {
+            rv = EXIT_FAILURE;
+            break;
+        }
+        if (in.buf) {
+            if (!cur->count) {
+                break; // The stream ended on a batch boundary
             }
+            num_chunks = first + cur->count;
         }
-        if (n == -1) {
-            perror("read");
-            close(fd);
-            return EXIT_FAILURE;
+        // The previous batch must be hashed before its buffers are reused
+        // and before the file hash advances past it
+        pool_wait(&pool);
+        for (size_t c = 0; c < cur->count; c++) {
+            pool_submit(&pool, put_chunk_hash, &cur->chunks[c]);
         }
-        // printf("read (%lu): %s\n", chunk_id, buf);
-
-        // Send the chunk to each of the chosen servers
-        for (char r = 0; r < REDUNDENCY; r++) {
-            // // Read the chunk
-            // char chunk[FTP_PACKET_SIZE] = {0};
-            // // TODO: Loop until all data is written
-            // ssize_t bytes_read = read(fd, chunk, FTP_PACKET_SIZE);
-            // if (bytes_read == -1) {
-            //     perror("read");
-            //     return EXIT_FAILURE;
-            // }
-            // if (bytes_read == 0) {
-            //     break;
-            // }
-
-            size_t serv_id = (hash[0] + chunk_id + r) % num_servers;
-            char   chunk_name[PATH_MAX] = {0};
-            snprintf(chunk_name, PATH_MAX, "%s.%lu", base_name, chunk_id);
-            // printf("\t\t[%lu]\t->\t{%lu}\t\t%s\t\t(%ld)\n", chunk_id,
-            // serv_id,
-            //        chunk_name, bytes_read);
-            printf("\t\t[%lu]\t->\t{%lu}\t\t%s\n", chunk_id, serv_id,
-                   chunk_name);
-
-            // Send the chunk to the server
-            serv_t *serv = servlist_i[serv_id];
-            if (!serv->connected) {
-                printf("Server %lu is not connected\n", serv_id);
-                close(fd);
-                return EXIT_FAILURE;
-            }
-
-            // Send the PUT <argpath> command to each server
-            ftp_send_msg(serv->fd, FTP_CMD_PUT, chunk_name, -1);
-
-            ftp_send_msg(serv->fd, FTP_CMD_DATA, (char *)buf, nread);
-            ftp_send_msg(serv->fd, FTP_CMD_TERM, NULL, 0);
-            // ftp_send_data_chunk(serv->fd, fd, FTP_PACKET_SIZE);
-        }
-    }
-
-    // // Send chunks in parallel
-    // for (serv_t *serv = servlist; serv; serv = serv->next) {
-    //     if (!serv->connected)
-    //         continue;
-    //     pid_t pid = fork();
-    //     if (pid == 0) {
-    //         // Child
-    //     } else {
-    //         // Parent
-
-    //     }
-    // }
-    close(fd);
+        pool_submit(&pool, put_batch_file_hash, cur);
+        if (prev && put_batch_send(prev, servlist_all, base_name) !=
+                        EXIT_SUCCESS) {
+            rv = EXIT_FAILURE;
+            break;
+        }
+        prev = cur;
+    }
+    pool_wait(&pool);
+    if (rv == EXIT_SUCCESS && prev) {
+        rv = put_batch_send(prev, servlist_all, base_name);
+    }
+    pool_destroy(&pool);
+    free(bufs);
+    free(in.buf);
+    if (rv != EXIT_SUCCESS) {
+        return rv;
+    }
 
-    return EXIT_SUCCESS;
+    // Record the file checksum in the manifest
+    manifest_t manifest = {0};
+    strncpy(manifest.filename, filename, NAME_MAX - 1);
+    manifest.size       = chunk_offs[num_chunks];
+    manifest.num_chunks = num_chunks;
+    manifest.hash_algo  = conf.hash;
+    if (chunking == CHUNKING_FIXED) {
+        manifest.chunk_size = FTP_PACKET_SIZE;
+    }
+    for (size_t i = 0; i < num_chunks; i++) {
+        manifest.chunk_lens[i] = chunk_offs[i + 1] - chunk_offs[i];
+    }
+    manifest.members     = members;
+    manifest.members_len = members_len;
+    hash_final(&file_hash, manifest.checksum);
+    return manifest_put(servlist_i, num_servers, base_name, &manifest);
 }
 
 /**
- * @brief Handles the LIST command
- *
+ * @brief Split fd (or its mapping, if not NULL) into content defined chunks
+ * @details chunk_offs receives num_chunks + 1 offsets; chunk i spans
+ * [chunk_offs[i], chunk_offs[i + 1]).
  */
-int handle_LIST(serv_t servlist[]) {
-    serv_t *serv;
-
-    // Send the LIST command to each server
-    for (serv = servlist; serv; serv = serv->next) {
-        if (!serv->connected)
+int chunk_list_cdc(int fd, const uint8_t *map, off_t size, off_t chunk_offs[],
+                   size_t *num_chunks) {
+    uint8_t *buf = map ? NULL : malloc(conf.cdc.max);
+    if (!map && !buf) {
+        perror("malloc");
+        return -1;
+    }
+    off_t  off    = 0;
+    size_t n      = 0;
+    chunk_offs[0] = 0;
+    while (off < size) {
+        if (n == MAX_CHUNKS) {
+            fprintf(stderr, "File too large (> %d chunks)\n", MAX_CHUNKS);
+            free(buf);
+            return -1;
+        }
+        if (map) {
+            size_t left = size - off;
+            off += cdc_cut(&conf.cdc, map + off,
+                           left < conf.cdc.max ? left : conf.cdc.max);
+            chunk_offs[++n] = off;
             continue;
-        ftp_send_msg(serv->fd, FTP_CMD_LIST, NULL, 0);
+        }
+        ssize_t len = pread(fd, buf, conf.cdc.max, off);
+        if (len <= 0) {
+            perror("pread");
+            free(buf);
+            return -1;
+        }
+        off += cdc_cut(&conf.cdc, buf, len);
+        chunk_offs[++n] = off;
     }
+    free(buf);
+    *num_chunks = n;
+    return 0;
+}
 
-    file_list_clear();
-    printf("LIST:\t");
-    // Receive the response from each server
-    for (serv = servlist; serv; serv = serv->next) {
-        if (!serv->connected)
+/**
+ * @brief Read the chunks [first, first + PUT_BATCH) of fd into the batch
+ * @details With a mapping the chunks point into it instead, and the kernel
+ * is asked to page the batch in before it is hashed.
+ */
+int put_batch_read(int fd, uint8_t *map, put_batch_t *batch, size_t first,
+                   size_t num_chunks, const off_t chunk_offs[]) {
+    batch->count = 0;
+    for (size_t chunk_id = first;
+         chunk_id < num_chunks && batch->count < PUT_BATCH; chunk_id++) {
+        put_chunk_t *chunk = &batch->chunks[batch->count++];
+        size_t chunk_len   = chunk_offs[chunk_id + 1] - chunk_offs[chunk_id];
+        chunk->chunk_id    = chunk_id;
+        chunk->len         = 0;
+        if (map) {
+            chunk->buf = map + chunk_offs[chunk_id];
+            chunk->len = chunk_len;
             continue;
-        printf("[%s]\t", serv->name);
-        // Receive each manifest file
-        // ftp_msg_t msg = {0};
-        // ftp_recv_msg(serv->fd, &msg);
-        // while (1) {
-        //     ftp_err_t err = ftp_recv_msg(serv->fd, &msg);
-        //     switch (msg.cmd) {
-        //     case FTP_CMD_PUT:
-        //         // Read this as a manifest file
-        //         printf("Received manifest file: %s\n", msg.packet);
-        //         ftp_recv_data(serv->fd, STDOUT_FILENO);
-        //         puts("\n");
-        //         break;
-        //     case FTP_CMD_LIST:
-        //         // Read this as a list of files (ls -l popen output)
-        //         printf("Received file list: \n");
-        //         ftp_recv_data(serv->fd, STDOUT_FILENO);
-        //         puts("\n");
-        //         break;
-        //     default:
-        //         printf("Invalid server response: %s\n",
-        //                ftp_cmd_to_str(msg.cmd));
-        //         return EXIT_FAILURE;
-        //         break;
-        //     }
-        // }
-
-        // Create a temporary file to store the ls -l output
-        char tmp_file[PATH_MAX] = {0};
-        snprintf(tmp_file, PATH_MAX, "%s/%04X.tmp", tmp_path, rand() & 0xFFFF);
-        int file = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-        if (file < 0) {
-            perror("open");
-            return EXIT_FAILURE;
         }
-        ftp_recv_data(serv->fd, file);
-        close(file);
-
-        // Read the file and print it
-        FILE *fp = fopen(tmp_file, "r");
-        if (!fp) {
-            perror("fopen");
-            return EXIT_FAILURE;
+        // Read the chunk from the file
+        lseek(fd, chunk_offs[chunk_id], SEEK_SET);
+        ssize_t n = 0;
+        while (chunk->len < chunk_len &&
+               (n = read(fd, chunk->buf + chunk->len,
+                         chunk_len - chunk->len)) > 0) {
+            chunk->len += n;
+        }
+        if (n == -1) {
+            perror("read");
+            return -1;
         }
-        // Recreate the file list from scratch
-        char   line[PATH_MAX] = {0};
-        size_t line_no        = 0;
-        while (fgets(line, PATH_MAX, fp)) {
-            line_no++;
-            // Parse the filename out of the line
-            if (line_no == 1) {
-                // Skip the first line
+    }
+    if (map && batch->count) {
+        // madvise wants a page aligned start
+        off_t page  = sysconf(_SC_PAGESIZE);
+        off_t start = chunk_offs[first] / page * page;
+        madvise(map + start, chunk_offs[first + batch->count] - start,
+                MADV_WILLNEED);
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the next chunks of a stream into the batch
+ * @details Chunk boundaries are found as the data arrives; chunk_offs
+ * receives the end of every chunk read. in->eof is set once the stream is
+ * drained, the batch may then be empty.
+ */
+int put_batch_read_stream(put_stream_t *in, put_batch_t *batch, size_t first,
+                          off_t chunk_offs[]) {
+    size_t want = in->chunking == CHUNKING_CDC ? conf.cdc.max
+                                               : FTP_PACKET_SIZE;
+    batch->count = 0;
+    for (size_t chunk_id = first; batch->count < PUT_BATCH; chunk_id++) {
+        // A content defined cut needs a full window unless the input ended
+        while (in->len < want && !in->eof) {
+            ssize_t n = read(in->fd, in->buf + in->len, want - in->len);
+            if (n < 0 && errno == EINTR) {
                 continue;
             }
-            char *filename = strrchr(line, ' ') + 1;
-            // Remove the newline
-            char *newline = strchr(filename, '\n');
-            if (newline) {
-                *newline = '\0';
+            if (n < 0) {
+                perror("read");
+                return -1;
             }
-            // Insert the file into the file_list
-            file_list_insert(filename, serv);
+            in->eof = n == 0;
+            in->len += n;
+        }
+        if (!in->len) {
+            break;
+        }
+        if (chunk_id == MAX_CHUNKS) {
+            fprintf(stderr, "Stream too large (> %d chunks)\n", MAX_CHUNKS);
+            return -1;
         }
-        fclose(fp);
+        size_t       len   = in->chunking == CHUNKING_CDC
+                                 ? cdc_cut(&conf.cdc, in->buf, in->len)
+                                 : in->len;
+        put_chunk_t *chunk = &batch->chunks[batch->count++];
+        chunk->chunk_id    = chunk_id;
+        chunk->len         = len;
+        memcpy(chunk->buf, in->buf, len);
+        memmove(in->buf, in->buf + len, in->len - len);
+        in->len -= len;
+        chunk_offs[chunk_id + 1] = chunk_offs[chunk_id] + len;
     }
-    puts("");
-    file_list_analyze();
-    file_list_print();
-
-    return EXIT_SUCCESS;
+    return 0;
 }
 
 /**
- * @brief Parses a filename and inserts it into the list
+ * @brief Pool job: digest of a single chunk
  *
  */
-void file_list_insert(char *filename, serv_t *serv) {
-    // Copy the filename
-    char copyname[NAME_MAX];
-    char storename[NAME_MAX];
-    strncpy(copyname, filename, NAME_MAX);
+void put_chunk_hash(void *arg) {
+    put_chunk_t *chunk = arg;
+    hash_buf(conf.hash, chunk->buf, chunk->len, chunk->digest);
+}
 
-    // Parse the filename:
-    // filename.stime.client_id.num_chunks.chunk_id
-    // Search in reverse
-    char *dot = strrchr(filename, '.');
-    if (!dot)
-        goto file_list_insert_error;
-    *dot               = '\0';
-    char *chunk_id_str = dot + 1;
-    strncpy(storename, filename, NAME_MAX);
+/**
+ * @brief Pool job: advance the whole file hash over a batch, in order
+ *
+ */
+void put_batch_file_hash(void *arg) {
+    put_batch_t *batch = arg;
+    for (size_t c = 0; c < batch->count; c++) {
+        hash_update(batch->file_hash, batch->chunks[c].buf,
+                    batch->chunks[c].len);
+    }
+}
 
-    dot = strrchr(filename, '.');
-    if (!dot)
+/**
+ * @brief Ask serv which of the chunks it already stores (FTP_CMD_HAVE)
+ * @details have[i] is set to 1 for every chunk the server reports. Servers
+ * that do not understand HAVE answer with an error and are marked as not
+ * supporting content addressed chunks. Servers that cannot answer a LINK
+ * (see chunk_put) are not asked, their chunks are sent with the key and
+ * deduplicated on arrival.
+ */
+void chunk_have(serv_t *serv, put_chunk_t *chunks[], size_t num_chunks,
+                int have[]) {
+    memset(have, 0, num_chunks * sizeof(int));
+    if (!serv->cas || serv->durable == FTP_DURABLE_NONE) {
+        return;
+    }
+    char   keys[FTP_PACKET_SIZE] = {0};
+    size_t len                   = 0;
+    for (size_t i = 0; i < num_chunks; i++) {
+        hash_to_key(conf.hash, chunks[i]->digest, keys + len);
+        len += strlen(keys + len);
+        keys[len++] = '\n';
+    }
+    ftp_msg_t msg = {0};
+    ftp_err_t err =
+        serv_request(serv, FTP_CMD_HAVE, keys, len, HEALTH_SMALL, &msg);
+    if (err == FTP_ERR_SERVER) {
+        printf("[INFO]\tServer does not deduplicate chunks (%s)\n",
+               serv->name);
+        serv->cas = 0;
+        return;
+    }
+    if (err != FTP_ERR_NONE || msg.cmd != FTP_CMD_DATA ||
+        msg.nbytes < num_chunks) {
+        return;
+    }
+    for (size_t i = 0; i < num_chunks; i++) {
+        have[i] = msg.packet[i] == '1';
+    }
+}
+
+/**
+ * @brief Send each chunk of the batch to REDUNDENCY servers
+ * @details Chunks are placed on the placement ring by their content digest,
+ * so identical chunks of any file, version or client land on the same
+ * servers. Unreachable servers are skipped in ring order. Each server is
+ * first asked which of its chunks it already stores; those are only linked
+ * under the new chunk name instead of being sent again. Links are always
+ * answered, one the server refuses (the content was swept since it said
+ * HAVE) is sent in full with the other chunks.
+ */
+int put_batch_send(put_batch_t *batch, serv_t servlist[], char *base_name) {
+    int rv = EXIT_SUCCESS;
+    // Work out where every replica goes
+    size_t placement[PUT_BATCH][REDUNDENCY];
+    for (size_t c = 0; c < batch->count; c++) {
+        if (placement_lookup(servlist, batch->chunks[c].digest,
+                             placement[c]) < REDUNDENCY) {
+            printf("Not enough servers to place chunk %lu\n",
+                   batch->chunks[c].chunk_id);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int serv_id = 0; serv_id < ring.num_nodes; serv_id++) {
+        serv_t      *serv = &servlist[serv_id];
+        put_chunk_t *todo[PUT_BATCH];
+        size_t       num_todo = 0;
+        for (size_t c = 0; c < batch->count; c++) {
+            for (size_t r = 0; r < REDUNDENCY; r++) {
+                if (placement[c][r] == (size_t)serv_id) {
+                    todo[num_todo++] = &batch->chunks[c];
+                    break;
+                }
+            }
+        }
+        if (!num_todo) {
+            continue;
+        }
+
+        // Other transfers share the connection, keep the batch together
+        int    have[PUT_BATCH];
+        size_t linked[PUT_BATCH];
+        size_t num_linked = 0;
+        size_t acked      = 0;
+        size_t owed       = 0;
+        size_t failed     = 0;
+        ftp_durable_t durability = serv_level(serv);
+        pthread_mutex_lock(&serv->lock);
+        chunk_have(serv, todo, num_todo, have);
+        size_t num_links = 0;
+        for (size_t t = 0; t < num_todo; t++) {
+            num_links += have[t];
+        }
+        for (size_t t = 0; t < num_todo && !failed; t++) {
+            if (!have[t]) {
+                continue;
+            }
+            put_chunk_t *chunk                = todo[t];
+            char         chunk_name[PATH_MAX] = {0};
+            snprintf(chunk_name, PATH_MAX, "%s.%lu", base_name,
+                     chunk->chunk_id);
+            char key[HASH_KEY_LEN] = {0};
+            hash_to_key(conf.hash, chunk->digest, key);
+            printf("\t\t[%lu]\t->\t{%d}\t\t%s\t%s (dedup)\n",
+                   chunk->chunk_id, serv_id, chunk_name, key);
+            // A flush is only waited for if no PUT follows to cover it
+            ftp_durable_t level = FTP_DURABLE_BUFFERED;
+            if (num_links == num_todo && t + 1 == num_todo &&
+                durability == FTP_DURABLE_SYNC) {
+                level = FTP_DURABLE_SYNC;
+            }
+            chunk_put(serv, chunk_name, chunk, 1, level);
+            linked[num_linked++] = t;
+            size_t keep = num_linked < num_links ? PUT_OWED - 1 : 0;
+            if (serv_link_acks(serv, have, linked, num_linked, &acked, keep,
+                               level) < 0) {
+                failed = num_todo;
+            }
+        }
+
+        size_t last = num_todo;
+        for (size_t t = 0; t < num_todo; t++) {
+            last = have[t] ? last : t;
+        }
+        for (size_t t = 0; t < num_todo && !failed; t++) {
+            if (have[t]) {
+                continue;
+            }
+            put_chunk_t *chunk                = todo[t];
+            char         chunk_name[PATH_MAX] = {0};
+            snprintf(chunk_name, PATH_MAX, "%s.%lu", base_name,
+                     chunk->chunk_id);
+            char key[HASH_KEY_LEN] = {0};
+            hash_to_key(conf.hash, chunk->digest, key);
+            printf("\t\t[%lu]\t->\t{%d}\t\t%s\t%s\n", chunk->chunk_id,
+                   serv_id, chunk_name, key);
+            // Only the last chunk waits for a flush, which covers the rest
+            ftp_durable_t level = durability;
+            if (level == FTP_DURABLE_SYNC && t != last) {
+                level = FTP_DURABLE_BUFFERED;
+            }
+            chunk_put(serv, chunk_name, chunk, 0, level);
+            if (level != FTP_DURABLE_NONE && ++owed >= PUT_OWED) {
+                failed += serv_acks(serv, &owed, PUT_OWED - 1, level);
+            }
+        }
+        failed += serv_acks(serv, &owed, 0, durability);
+        pthread_mutex_unlock(&serv->lock);
+        if (failed) {
+            fprintf(stderr, "[ERROR]\t%lu chunks not stored %s on %s\n",
+                    failed, ftp_durable_to_str(durability), serv->name);
+            rv = EXIT_FAILURE;
+        }
+    }
+    return rv;
+}
+
+/**
+ * @brief Pick the REDUNDENCY servers a chunk belongs on
+ * @details Walks the placement ring from the chunk's digest and takes
+ * connected servers that are not full, leaving hot servers for last.
+ *
+ * @param placement Output, indices into servlist in preference order
+ * @return size_t Number of servers found, less than REDUNDENCY if the
+ * cluster cannot hold another replica
+ */
+size_t placement_lookup(serv_t servlist[], const uint8_t *digest,
+                        size_t placement[REDUNDENCY]) {
+    int    order[MAX_SERVERS];
+    size_t n = ring_lookup(&ring, ring_key(digest), order, MAX_SERVERS);
+    size_t r = 0;
+    // Usable servers in ring order, then hot ones if there are too few
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < n && r < REDUNDENCY; i++) {
+            serv_t *serv = &servlist[order[i]];
+            int full = serv->total_bytes && serv->free_bytes < SERV_MIN_FREE;
+            int hot  = serv->load > SERV_HOT_LOAD;
+            if (serv->connected && !full && hot == pass) {
+                placement[r++] = order[i];
+            }
+        }
+    }
+    return r;
+}
+
+/**
+ * @brief Store one chunk on serv under chunk_name
+ * @details have is the server's HAVE answer for the chunk; stored content
+ * is only linked. Servers without content addressing get a plain PUT.
+ * Unless level is FTP_DURABLE_NONE the server answers once the chunk is
+ * stored that well, the caller collects the answer with serv_acks, or
+ * serv_link_acks for a link. A link must be given a level: the content
+ * may have been swept since HAVE, and only the answer tells.
+ */
+void chunk_put(serv_t *serv, const char *chunk_name, const put_chunk_t *chunk,
+               int have, ftp_durable_t level) {
+    char key[HASH_KEY_LEN]                 = {0};
+    char durable[32]                       = {0};
+    char arg[PATH_MAX + HASH_KEY_LEN + 32] = {0};
+    hash_to_key(conf.hash, chunk->digest, key);
+    if (level != FTP_DURABLE_NONE) {
+        snprintf(durable, sizeof(durable), " durable=%s",
+                 ftp_durable_to_str(level));
+    }
+    if (!serv->cas) {
+        snprintf(arg, sizeof(arg), "%s%s", chunk_name, durable);
+        ftp_set_cork(serv->fd, 1);
+        ftp_send_msg(serv->fd, FTP_CMD_PUT, arg, -1);
+    } else {
+        snprintf(arg, sizeof(arg), "%s %s%s", chunk_name, key, durable);
+        if (have) {
+            // Already stored, only record the new name
+            ftp_send_msg(serv->fd, FTP_CMD_LINK, arg, -1);
+            return;
+        }
+        ftp_set_cork(serv->fd, 1);
+        ftp_send_msg(serv->fd, FTP_CMD_PUT, arg, -1);
+    }
+    // Corked, so the three messages leave as full segments
+    ftp_send_msg(serv->fd, FTP_CMD_DATA, (char *)chunk->buf, chunk->len);
+    ftp_send_msg(serv->fd, FTP_CMD_TERM, NULL, 0);
+    ftp_set_cork(serv->fd, 0);
+}
+
+/**
+ * @brief Read the answers serv owes for chunks sent with a durability level
+ * until at most keep are owed
+ * @details Answers arrive in the order the chunks were sent. They are whole
+ * packets, so the caller reads them while still sending rather than letting
+ * them fill the socket buffers of both ends. Only the newest chunk, answered
+ * when keep is 0, may have been sent with last; the others are buffered.
+ * If the connection fails the remaining answers are lost with it. Called
+ * with serv->lock held.
+ *
+ * @param owed Answers owed, updated
+ * @return size_t Number of chunks the server did not confirm
+ */
+size_t serv_acks(serv_t *serv, size_t *owed, size_t keep,
+                 ftp_durable_t last) {
+    size_t failed = 0;
+    while (*owed > keep) {
+        ftp_durable_t level = *owed == 1 ? last : FTP_DURABLE_BUFFERED;
+        ftp_err_t     err   = serv_ack(serv, level, PUT_OWED * FTP_PACKET_SIZE);
+        (*owed)--;
+        if (err == FTP_ERR_SERVER) {
+            failed++;
+        } else if (err != FTP_ERR_NONE) {
+            failed += *owed + 1;
+            *owed = 0;
+        }
+    }
+    return failed;
+}
+
+/**
+ * @brief Read the answers to LINKs until at most keep are owed
+ * @details Answers arrive in the order the LINKs were sent. A refused one
+ * means the content is gone from the server (swept since its HAVE answer),
+ * so its have entry is cleared and the caller sends the chunk in full.
+ * Called with serv->lock held.
+ *
+ * @param linked Indices into have of the LINKs sent, oldest first
+ * @param sent Number of LINKs sent
+ * @param acked Answers read so far, updated
+ * @param last Level the newest LINK was sent with, the others are buffered
+ * @return int 0, -1 if the connection failed
+ */
+int serv_link_acks(serv_t *serv, int have[], const size_t linked[],
+                   size_t sent, size_t *acked, size_t keep,
+                   ftp_durable_t last) {
+    while (sent - *acked > keep) {
+        ftp_durable_t level =
+            *acked + 1 == sent ? last : FTP_DURABLE_BUFFERED;
+        ftp_err_t err = serv_ack(serv, level, PUT_OWED * FTP_PACKET_SIZE);
+        if (err == FTP_ERR_SERVER) {
+            have[linked[*acked]] = 0;
+        } else if (err != FTP_ERR_NONE) {
+            return -1;
+        }
+        (*acked)++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait for the answer to one PUT or LINK sent with a durability level
+ * @details A sync answer waits for the server to flush its store, which
+ * takes as long as the disks need rather than the network, so it is given
+ * SYNC_TIMEOUT_MS. Called with serv->lock held.
+ *
+ * @param bytes Payload the answer may queue behind, for the timeout
+ * @return ftp_err_t FTP_ERR_SERVER if the server could not store the chunk
+ */
+ftp_err_t serv_ack(serv_t *serv, ftp_durable_t level, size_t bytes) {
+    if (level == FTP_DURABLE_SYNC) {
+        ftp_set_timeout(serv->fd, SYNC_TIMEOUT_MS);
+    } else {
+        serv_timeout(serv, bytes);
+    }
+    ftp_msg_t msg = {0};
+    ftp_err_t err = ftp_recv_msg(serv->fd, &msg);
+    if (err == FTP_ERR_NONE && msg.cmd != FTP_CMD_TERM) {
+        err = FTP_ERR_INVALID; // Out of step with the server
+    }
+    switch (err) {
+    case FTP_ERR_NONE:
+        break;
+    case FTP_ERR_SERVER:
+        fprintf(stderr, "[INFO]\tServer could not store a chunk (%s): %s\n",
+                serv->name, (char *)msg.packet);
+        break;
+    default:
+        fprintf(stderr, "[INFO]\tServer did not confirm a chunk (%s): %s\n",
+                serv->name, ftp_err_to_str(err));
+        health_fail(&serv->health);
+        serv_reset(serv);
+        break;
+    }
+    return err;
+}
+
+/**
+ * @brief Handles the LIST command
+ * @details Each server is asked only for the changes since the catalog
+ * saved by the previous LIST, so a listing costs what changed rather than
+ * what is stored. Without a catalog, or if the server's change log has
+ * started over, the server sends a full snapshot instead.
+ *
+ * @return int EXIT_FAILURE if no server answered, leaving the file list
+ * empty, so commands that act on it (repair, gc) stop
+ */
+int handle_LIST(serv_t servlist[]) {
+    list_recv_t *recvs = calloc(MAX_SERVERS, sizeof(list_recv_t));
+    if (!recvs) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    // Send the LIST command to each server, the replies are read together
+    size_t num_recvs = 0;
+    for (serv_t *serv = servlist; serv; serv = serv->next) {
+        if (!serv->connected)
+            continue;
+        list_recv_t *state = &recvs[num_recvs++];
+        char         path[LIST_STATE_MAX];
+        char         since[CATALOG_EPOCH_LEN + 24] = {0};
+        state->serv                                = serv;
+        catalog_init(&state->catalog);
+        list_state_path(serv, path);
+        if (catalog_load(&state->catalog, path) == 0) {
+            snprintf(since, sizeof(since), "%s %" PRIu64,
+                     state->catalog.epoch, state->catalog.seq);
+        }
+        pthread_mutex_lock(&serv->lock);
+        ftp_send_msg(serv->fd, FTP_CMD_LIST, since, strlen(since));
+    }
+
+    file_list_clear();
+    printf("LIST:\t");
+    // Merge the listings into the file list as packets arrive from any server
+    size_t pending  = num_recvs;
+    size_t answered = 0;
+    while (pending) {
+        struct pollfd fds[MAX_SERVERS];
+        list_recv_t  *polled[MAX_SERVERS];
+        nfds_t        nfds = 0;
+        for (size_t i = 0; i < num_recvs; i++) {
+            if (!recvs[i].done) {
+                fds[nfds].fd      = recvs[i].serv->fd;
+                fds[nfds].events  = POLLIN;
+                fds[nfds].revents = 0;
+                polled[nfds++]    = &recvs[i];
+            }
+        }
+        // Wait as long as the most patient of the pending servers
+        int timeout = 0;
+        for (nfds_t i = 0; i < nfds; i++) {
+            int ms  = serv_timeout(polled[i]->serv, FTP_PACKET_SIZE);
+            timeout = ms > timeout ? ms : timeout;
+        }
+        int ready = poll(fds, nfds, timeout);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            // Nobody answered in time, give up on everyone still pending
+            for (nfds_t i = 0; i < nfds; i++) {
+                fprintf(stderr, "[INFO]\tServer timed out (%s)\n",
+                        polled[i]->serv->name);
+                health_fail(&polled[i]->serv->health);
+                serv_reset(polled[i]->serv);
+                polled[i]->done = 1;
+            }
+            break;
+        }
+        for (nfds_t i = 0; i < nfds; i++) {
+            int step = fds[i].revents ? list_recv_step(polled[i]) : 0;
+            if (step != 0) {
+                answered += step == 1;
+                polled[i]->done = 1;
+                pending--;
+            }
+        }
+    }
+    puts("");
+    for (size_t i = 0; i < num_recvs; i++) {
+        pthread_mutex_unlock(&recvs[i].serv->lock);
+        catalog_free(&recvs[i].catalog);
+    }
+    free(recvs);
+
+    file_list_analyze();
+    file_list_print();
+
+    if (!answered) {
+        fprintf(stderr, "[INFO]\tNo server answered LIST\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Read what is available of a server's LIST reply
+ * @details Complete lines are handed to list_recv_line; a line split across
+ * packets is carried over to the next one.
+ *
+ * @return int 0 while more is expected, 1 once the reply is complete, -1 if
+ * it failed, in which case the connection is replaced so the rest of the
+ * reply cannot be taken for the answer to the next request
+ */
+int list_recv_step(list_recv_t *state) {
+    serv_t *serv = state->serv;
+    ssize_t ret  = recv(serv->fd, (uint8_t *)&state->msg + state->got,
+                        FTP_MSG_SIZE - state->got, MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (ret <= 0) {
+        fprintf(stderr, "[INFO]\tServer closed connection (%s)\n",
+                serv->name);
+        serv->connected = 0;
+        return -1;
+    }
+    state->got += ret;
+    if (state->got < FTP_MSG_SIZE) {
+        return 0;
+    }
+    state->got    = 0;
+    ftp_err_t err = ftp_msg_check(&state->msg);
+    if (err != FTP_ERR_NONE) {
+        fprintf(stderr, "[INFO]\tBad LIST reply from %s (%s)\n", serv->name,
+                ftp_err_to_str(err));
+        goto list_recv_failed;
+    }
+    if (state->msg.cmd == FTP_CMD_TERM) {
+        printf("[%s]\t", serv->name);
+        list_recv_finish(state);
+        return 1;
+    }
+    if (state->msg.cmd != FTP_CMD_DATA) {
+        fprintf(stderr, "[INFO]\tUnexpected %s in LIST reply from %s\n",
+                ftp_cmd_to_str(state->msg.cmd), serv->name);
+        goto list_recv_failed;
+    }
+
+    for (uint32_t i = 0; i < state->msg.nbytes; i++) {
+        char c = state->msg.packet[i];
+        if (c != '\n') {
+            if (state->line_len < PATH_MAX - 1) {
+                state->line[state->line_len++] = c;
+            }
+            continue;
+        }
+        state->line[state->line_len] = '\0';
+        state->line_len              = 0;
+        if (list_recv_line(state) < 0) {
+            goto list_recv_failed;
+        }
+        state->line_no++;
+    }
+    return 0;
+
+list_recv_failed:
+    serv_reset(serv);
+    return -1;
+}
+
+/**
+ * @brief Handle one complete line of a LIST reply
+ * @details The first line tells the kind of reply: "changes <epoch> <seq>"
+ * or "snapshot <epoch> <seq>" from a server with a change log, anything
+ * else ("total ...") is ls -l output from one without.
+ *
+ * @return int 0 on success, -1 if the reply cannot be used
+ */
+int list_recv_line(list_recv_t *state) {
+    catalog_t *catalog = &state->catalog;
+    char      *line    = state->line;
+    if (state->line_no == 0) {
+        char     kind[16]                 = {0};
+        char     epoch[CATALOG_EPOCH_LEN] = {0};
+        uint64_t seq                      = 0;
+        state->mode                       = LIST_LEGACY;
+        if (sscanf(line, "%15s %16s %" SCNu64, kind, epoch, &seq) != 3) {
+            return 0;
+        }
+        if (strcmp(kind, "changes") == 0) {
+            state->mode = LIST_CHANGES;
+        } else if (strcmp(kind, "snapshot") == 0) {
+            state->mode = LIST_SNAPSHOT;
+            catalog_clear(catalog);
+        } else {
+            return 0;
+        }
+        memcpy(catalog->epoch, epoch, CATALOG_EPOCH_LEN);
+        catalog->seq = seq;
+        return 0;
+    }
+
+    switch (state->mode) {
+    case LIST_CHANGES:
+        if (strlen(line) < 3 || line[1] != ' ') {
+            return -1;
+        }
+        return catalog_apply(catalog, line[0], line + 2);
+    case LIST_SNAPSHOT:
+        return line[0] ? catalog_add(catalog, line) : 0;
+    default: {
+        // Parse the filename out of the line
+        char *filename = strrchr(line, ' ');
+        if (filename) {
+            file_list_insert(filename + 1, state->serv);
+        }
+        return 0;
+    }
+    }
+}
+
+/**
+ * @brief Insert the updated catalog into the file list and save it
+ *
+ */
+void list_recv_finish(list_recv_t *state) {
+    char path[LIST_STATE_MAX];
+    list_state_path(state->serv, path);
+    if (state->mode == LIST_LEGACY || state->mode == LIST_PENDING) {
+        unlink(path); // No change log to follow on this server
+        return;
+    }
+    int complete = catalog_sort(&state->catalog) == 0;
+    for (size_t i = 0; i < state->catalog.num_names; i++) {
+        // file_list_insert takes the name apart in place
+        char name[NAME_MAX];
+        snprintf(name, NAME_MAX, "%s", state->catalog.names[i]);
+        file_list_insert(name, state->serv);
+    }
+    if (!complete) {
+        unlink(path); // Names are missing, take a snapshot next time
+    } else if (catalog_save(&state->catalog, path) < 0) {
+        fprintf(stderr, "[INFO]\tCannot save catalog: %s\n", path);
+    }
+}
+
+/**
+ * @brief Where the catalog of a server is kept between runs
+ *
+ */
+void list_state_path(const serv_t *serv, char path[LIST_STATE_MAX]) {
+    snprintf(path, LIST_STATE_MAX, "%s/list-%s", state_path, serv->name);
+}
+
+/**
+ * @brief Handles the REPAIR and REBALANCE commands
+ * @details Scans the catalog and restores REDUNDENCY for every chunk that
+ * lost replicas, copying it from a surviving server to the servers the
+ * placement ring assigns it. With rebalance, chunks that are fully
+ * replicated are also copied to their ring servers, which moves data onto
+ * added or reweighted servers. Old copies are left in place. Manifests are
+ * copied to every connected server that lacks them.
+ * Up to conf.repair_jobs chunks are in flight at once and the data sent is
+ * limited to conf.repair_rate MiB/s, so repairs do not starve other clients.
+ */
+int handle_REPAIR(serv_t servlist[], int rebalance) {
+    if (handle_LIST(servlist) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    pool_t         pool;
+    throttle_t     throttle;
+    repair_stats_t stats = {0};
+    repair_job_t  *jobs  = malloc(MAX_CHUNKS * sizeof(repair_job_t));
+    if (!jobs || pool_init(&pool, conf.repair_jobs) < 0) {
+        fprintf(stderr, "Failed to set up the repair pool\n");
+        free(jobs);
+        return EXIT_FAILURE;
+    }
+    throttle_init(&throttle, conf.repair_rate * 1024 * 1024);
+    pthread_mutex_init(&stats.lock, NULL);
+
+    for (size_t i = 0; i < num_files; i++) {
+        file_info_t *finf = &file_info[i];
+        repair_manifest(servlist, finf);
+        // Chunks of a streamed upload that lost every replica are not in
+        // the listing, only its manifest knows how many there are
+        if (file_info_resolve(finf) == -2) {
+            fprintf(stderr, "[INFO]\tNo manifest for streamed %s\n",
+                    finf->storename);
+            stats.failed++;
+        }
+        for (size_t c = 0; c < finf->num_chunks; c++) {
+            jobs[c] = (repair_job_t){
+                .servlist  = servlist,
+                .finf      = finf,
+                .chunk_id  = c,
+                .rebalance = rebalance,
+                .throttle  = &throttle,
+                .stats     = &stats,
+            };
+            pool_submit(&pool, repair_chunk, &jobs[c]);
+        }
+        pool_wait(&pool);
+    }
+    pool_destroy(&pool);
+    throttle_destroy(&throttle);
+    pthread_mutex_destroy(&stats.lock);
+    free(jobs);
+
+    printf("[INFO]\tWrote %lu replicas (%lu bytes), %lu chunks lost, "
+           "%lu unreadable\n",
+           stats.copies, stats.bytes, stats.lost, stats.failed);
+    return stats.lost || stats.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief Restore the replicas of one chunk (pool job)
+ * @details Each request/response pair holds the server's lock, so jobs
+ * touching the same server take turns on its socket.
+ */
+void repair_chunk(void *arg) {
+    repair_job_t *job      = arg;
+    serv_t      **locs     = job->finf->chunk_locs[job->chunk_id];
+    size_t        num_locs = 0;
+    while (num_locs < MAX_SERVERS && locs[num_locs]) {
+        num_locs++;
+    }
+    if (num_locs == 0) {
+        pthread_mutex_lock(&job->stats->lock);
+        job->stats->lost++;
+        pthread_mutex_unlock(&job->stats->lock);
+        return;
+    }
+    if (num_locs >= REDUNDENCY && !job->rebalance) {
+        return;
+    }
+
+    char chunk_name[PATH_MAX] = {0};
+    snprintf(chunk_name, PATH_MAX, "%s.%lu", job->finf->storename,
+             job->chunk_id);
+
+    // Read a good replica, the checksum is verified by ftp_recv_msg
+    ftp_msg_t msg = {0};
+    ftp_err_t err = FTP_ERR_SERVER;
+    for (size_t j = 0; j < num_locs && err != FTP_ERR_NONE; j++) {
+        pthread_mutex_lock(&locs[j]->lock);
+        err = serv_request(locs[j], FTP_CMD_GET, chunk_name, -1,
+                           FTP_PACKET_SIZE, &msg);
+        pthread_mutex_unlock(&locs[j]->lock);
+    }
+    if (err != FTP_ERR_NONE || msg.cmd != FTP_CMD_DATA) {
+        fprintf(stderr, "[INFO]\tNo readable replica of %s\n", chunk_name);
+        pthread_mutex_lock(&job->stats->lock);
+        job->stats->failed++;
+        pthread_mutex_unlock(&job->stats->lock);
+        return;
+    }
+
+    put_chunk_t chunk = {
+        .chunk_id = job->chunk_id,
+        .buf      = msg.packet,
+        .len      = msg.nbytes,
+    };
+    hash_buf(conf.hash, chunk.buf, chunk.len, chunk.digest);
+    size_t placement[REDUNDENCY];
+    size_t n = placement_lookup(job->servlist, chunk.digest, placement);
+    for (size_t r = 0; r < n; r++) {
+        serv_t *serv = &job->servlist[placement[r]];
+        size_t  j    = 0;
+        while (j < num_locs && locs[j] != serv) {
+            j++;
+        }
+        if (j < num_locs) {
+            continue; // Already holds a replica
+        }
+
+        put_chunk_t *todo   = &chunk;
+        int          have   = 0;
+        size_t       linked = 0;
+        size_t       acked  = 0;
+        size_t       failed = 0;
+        pthread_mutex_lock(&serv->lock);
+        chunk_have(serv, &todo, 1, &have);
+        if (have) {
+            // Sent in full below if the content was swept since HAVE
+            ftp_durable_t level = serv_level(serv) != FTP_DURABLE_NONE
+                                      ? serv_level(serv)
+                                      : FTP_DURABLE_BUFFERED;
+            chunk_put(serv, chunk_name, &chunk, 1, level);
+            failed = serv_link_acks(serv, &have, &linked, 1, &acked, 0,
+                                    level) < 0;
+        }
+        pthread_mutex_unlock(&serv->lock);
+        if (!have && !failed) {
+            throttle_take(job->throttle, chunk.len);
+            ftp_durable_t level = serv_level(serv);
+            size_t        owed  = level != FTP_DURABLE_NONE;
+            pthread_mutex_lock(&serv->lock);
+            chunk_put(serv, chunk_name, &chunk, 0, level);
+            failed = serv_acks(serv, &owed, 0, level);
+            pthread_mutex_unlock(&serv->lock);
+        }
+        if (failed) {
+            fprintf(stderr, "[INFO]\tCould not copy %s to %s\n", chunk_name,
+                    serv->name);
+            continue;
+        }
+        printf("[REPAIR]\t%s\t->\t%s%s\n", chunk_name, serv->name,
+               have ? " (dedup)" : "");
+
+        pthread_mutex_lock(&job->stats->lock);
+        job->stats->copies++;
+        job->stats->bytes += have ? 0 : chunk.len;
+        pthread_mutex_unlock(&job->stats->lock);
+    }
+}
+
+/**
+ * @brief Copy the manifest of finf to every connected server without it
+ *
+ */
+void repair_manifest(serv_t servlist[], file_info_t *finf) {
+    serv_t *missing[MAX_SERVERS];
+    int     num_missing = 0;
+    for (serv_t *serv = servlist; serv; serv = serv->next) {
+        if (!serv->connected)
+            continue;
+        size_t j = 0;
+        while (finf->manifest_locs[j] && finf->manifest_locs[j] != serv) {
+            j++;
+        }
+        if (!finf->manifest_locs[j]) {
+            missing[num_missing++] = serv;
+        }
+    }
+    // Fetched raw so the member lines of a pack are copied too
+    manifest_t manifest = {0};
+    ftp_msg_t  msg      = {0};
+    if (!num_missing || manifest_fetch(finf, &manifest, &msg) != EXIT_SUCCESS) {
+        return;
+    }
+    manifest_put(missing, num_missing, finf->storename, &manifest);
+    for (int i = 0; i < num_missing; i++) {
+        printf("[REPAIR]\t%s.%s\t->\t%s\n", finf->storename,
+               MANIFEST_SUFFIX, missing[i]->name);
+    }
+}
+
+/**
+ * @brief Upload the small files among paths in packs
+ * @details Files of at most conf.pack_threshold bytes are appended to a
+ * pack assembled in the temporary directory, and their name, offset, length
+ * and checksum are listed in the pack's manifest. A pack is stored through
+ * the regular PUT pipeline (with fixed size chunks) whenever its index or
+ * data is full and once at the end, so thousands of tiny files cost a few
+ * chunk transfers instead of a PUT each. packed[i] is set for every file
+ * stored this way; the caller uploads the others as usual.
+ */
+int handle_PACK(serv_t servlist[], char *paths[], int num_paths, int packed[]) {
+    pack_t   pack = {.fd = -1, .packed = packed, .started = time(NULL)};
+    uint8_t *buf  = malloc(conf.pack_threshold);
+    pack.members  = malloc(PACK_INDEX_MAX);
+    pack.files    = malloc(num_paths * sizeof(int));
+    if (!buf || !pack.members || !pack.files) {
+        perror("malloc");
+        free(buf);
+        free(pack.members);
+        free(pack.files);
+        return EXIT_FAILURE;
+    }
+
+    int rv = EXIT_SUCCESS;
+    for (int i = 0; i < num_paths; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) < 0 || !S_ISREG(st.st_mode) ||
+            (size_t)st.st_size > conf.pack_threshold) {
+            continue;
+        }
+        int fd = open(paths[i], O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        ssize_t len = pread(fd, buf, conf.pack_threshold, 0);
+        close(fd);
+        if (len < 0) {
+            continue;
+        }
+
+        const char       *name   = strrchr(paths[i], '/');
+        manifest_member_t member = {
+            .len = len,
+        };
+        strncpy(member.name, name ? name + 1 : paths[i], NAME_MAX - 1);
+        hash_buf(conf.hash, buf, len, member.checksum);
+
+        char    line[NAME_MAX + 128] = {0};
+        ssize_t line_len = 0;
+        for (int attempt = 0; attempt < 2; attempt++) {
+            member.offset = pack.size;
+            line_len = manifest_format_member(&member, conf.hash, line,
+                                              sizeof(line));
+            if (pack.members_len + line_len <= PACK_INDEX_MAX &&
+                pack.size + len <= (off_t)MAX_CHUNKS * FTP_PACKET_SIZE) {
+                break;
+            }
+            rv |= pack_flush(servlist, &pack);
+        }
+        if (pack.fd < 0) {
+            char pack_path[PATH_MAX] = {0};
+            snprintf(pack_path, PATH_MAX, "%s/pack.tmp", tmp_path);
+            pack.fd = open(pack_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            unlink(pack_path); // Gone once closed
+            if (pack.fd < 0) {
+                perror("open");
+                rv = EXIT_FAILURE;
+                break;
+            }
+        }
+        if (write_all(pack.fd, pack.size, buf, len) < 0) {
+            rv = EXIT_FAILURE;
+            break;
+        }
+        memcpy(pack.members + pack.members_len, line, line_len);
+        pack.members_len += line_len;
+        pack.size += len;
+        pack.files[pack.num_files++] = i;
+    }
+    rv |= pack_flush(servlist, &pack);
+
+    free(buf);
+    free(pack.members);
+    free(pack.files);
+    return rv;
+}
+
+/**
+ * @brief Store the pack being assembled, if any, and start a new one
+ *
+ */
+int pack_flush(serv_t servlist[], pack_t *pack) {
+    if (pack->fd < 0) {
+        return EXIT_SUCCESS;
+    }
+    char name[NAME_MAX] = {0};
+    // client_id alone repeats across runs, a pack must never reuse a name
+    snprintf(name, NAME_MAX, "%s%04X-%lX-%d-%lu", PACK_PREFIX, client_id,
+             (unsigned long)pack->started, getpid(), pack->seq++);
+    printf("[INFO]\tPacking %lu files (%ld bytes) as %s\n", pack->num_files,
+           pack->size, name);
+    int rv = put_fd(servlist, pack->fd, name, pack->size, time(NULL),
+                    CHUNKING_FIXED, pack->members, pack->members_len);
+    if (rv == EXIT_SUCCESS) {
+        for (size_t i = 0; i < pack->num_files; i++) {
+            pack->packed[pack->files[i]] = 1;
+        }
+    }
+    close(pack->fd);
+    pack->fd          = -1;
+    pack->size        = 0;
+    pack->members_len = 0;
+    pack->num_files   = 0;
+    return rv;
+}
+
+/**
+ * @brief Fetch filename from the newest pack holding it into file
+ * @details Only packs stored after newer_than (the newest complete plain
+ * upload) are searched, so the most recent copy of the file wins. With
+ * len < 0 the whole file is read and checked against its checksum,
+ * otherwise only len bytes at offset.
+ *
+ * @return int EXIT_SUCCESS if the file was found and written
+ */
+int pack_get(const char *filename, int file, time_t newer_than, off_t offset,
+             ssize_t len) {
+    int        *packs    = malloc(MAX_FILES * sizeof(int));
+    ftp_msg_t  *msg      = malloc(sizeof(ftp_msg_t));
+    manifest_t *manifest = malloc(sizeof(manifest_t));
+    size_t      n        = 0;
+    int         rv       = EXIT_FAILURE;
+    if (!packs || !msg || !manifest) {
+        perror("malloc");
+        goto pack_get_done;
+    }
+    for (size_t i = 0; i < num_files; i++) {
+        if (strncmp(file_info[i].filename, PACK_PREFIX,
+                    strlen(PACK_PREFIX)) == 0 &&
+            file_info[i].reproducible && file_info[i].stime > newer_than) {
+            packs[n++] = i;
+        }
+    }
+    qsort(packs, n, sizeof(int), file_info_newer);
+
+    for (size_t p = 0; p < n && rv != EXIT_SUCCESS; p++) {
+        file_info_t      *finf = &file_info[packs[p]];
+        manifest_member_t member;
+        if (pack_manifest(finf, manifest, msg) != EXIT_SUCCESS ||
+            manifest_find_member((char *)msg->packet, msg->nbytes,
+                                 manifest->hash_algo, filename,
+                                 &member) < 0) {
+            continue;
+        }
+        printf("[INFO]\tFound file in pack: %s\n", finf->storename);
+        if (len >= 0) {
+            // Narrow the member down to the requested range
+            size_t skip = (size_t)offset < member.len ? (size_t)offset
+                                                      : member.len;
+            member.offset += skip;
+            member.len -= skip;
+            if ((size_t)len < member.len) {
+                member.len = len;
+            }
+            ssize_t got = range_read(finf, NULL, member.offset, member.len,
+                                     file, NULL);
+            if (got == (ssize_t)member.len && ftruncate(file, got) == 0) {
+                rv = EXIT_SUCCESS;
+            }
+        } else if (pack_read_member(finf, manifest, &member, file) == 0) {
+            printf("[INFO]\tVerified %s checksum\n",
+                   hash_algo_to_str(manifest->hash_algo));
+            rv = EXIT_SUCCESS;
+        }
+    }
+
+pack_get_done:
+    free(packs);
+    free(msg);
+    free(manifest);
+    return rv;
+}
+
+/**
+ * @brief manifest_fetch for packs, keeping a copy in state_dir
+ * @details A pack is never stored twice under the same name, so its
+ * manifest is fetched from the servers once and read from the copy after
+ * that. A get that searches every pack only costs round trips for the
+ * packs this client has not seen yet.
+ */
+int pack_manifest(file_info_t *finf, manifest_t *manifest, ftp_msg_t *msg) {
+    char path[PATH_MAX + NAME_MAX + 8] = {0};
+    snprintf(path, sizeof(path), "%s/pack-%s", state_path, finf->storename);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = read(fd, msg->packet, FTP_PACKET_SIZE);
+        close(fd);
+        if (n > 0) {
+            msg->packet[n] = 0;
+            msg->nbytes    = n;
+            if (manifest_parse((char *)msg->packet, n, manifest) == 0) {
+                return EXIT_SUCCESS;
+            }
+        }
+    }
+    if (manifest_fetch(finf, manifest, msg) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    // Renamed into place so a concurrent run never reads half a copy
+    char tmp[PATH_MAX + NAME_MAX + 24] = {0};
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        int ok = write_all(fd, 0, msg->packet, msg->nbytes) == 0;
+        close(fd);
+        if (!ok || rename(tmp, path) < 0) {
+            unlink(tmp);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Copy one member out of a pack into file and verify it
+ *
+ * @return int 0 on success, -1 on a missing chunk or checksum mismatch
+ */
+int pack_read_member(file_info_t *finf, const manifest_t *manifest,
+                     const manifest_member_t *member, int file) {
+    hash_ctx_t ctx;
+    hash_init(&ctx, manifest->hash_algo);
+    ssize_t out =
+        range_read(finf, NULL, member->offset, member->len, file, &ctx);
+    uint8_t digest[HASH_MAX_LEN];
+    hash_final(&ctx, digest);
+    if (out != (ssize_t)member->len ||
+        memcmp(digest, member->checksum, hash_len(manifest->hash_algo)) != 0) {
+        fprintf(stderr, "[INFO]\tChecksum mismatch in pack: %s\n",
+                finf->storename);
+        return -1;
+    }
+    // Pipes cannot be truncated, and need not be
+    if (ftruncate(file, out) < 0 && errno != EINVAL) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copy len bytes at offset of a stored file to the start of file
+ * @details offs is the chunk layout from manifest_chunk_offsets; only the
+ * chunks covering the range are fetched, and only the bytes needed from
+ * each. Without offs the layout is that of a pack (fixed size chunks).
+ * Every chunk is CRC checked in transit, the file checksum cannot be
+ * checked for part of a file.
+ *
+ * @param ctx Optional hash advanced over the bytes written
+ * @return ssize_t Bytes written (less than len if the file ends first), -1
+ * if a chunk could not be read or written
+ */
+ssize_t range_read(file_info_t *finf, const off_t offs[], off_t offset,
+                   size_t len, int file, hash_ctx_t *ctx) {
+    range_t range = {finf, offs, offset, offset + len};
+    // Only the chunks up to the end of the range are read ahead
+    size_t  count = finf->num_chunks;
+    while (count && range_base(&range, count - 1) >= range.end) {
+        count--;
+    }
+    prefetch_t prefetch;
+    if (prefetch_init(&prefetch, range_prefetch, &range, count,
+                      conf.readahead) < 0) {
+        fprintf(stderr, "Failed to set up the read-ahead\n");
+        return -1;
+    }
+    ssize_t out = 0;
+    for (size_t c = offs ? 0 : offset / FTP_PACKET_SIZE; c < count; c++) {
+        off_t base = range_base(&range, c);
+        off_t next = range_base(&range, c + 1);
+        if (next <= offset) {
+            continue;
+        }
+        size_t     start = offset > base ? offset - base : 0;
+        size_t     stop  = (range.end < next ? range.end : next) - base;
+        ftp_msg_t *msg;
+        if (prefetch_get(&prefetch, c, &msg) != FTP_ERR_NONE) {
+            fprintf(stderr, "Failed to get chunk %lu\n", c);
+            out = -1;
+            break;
+        }
+        if (write_all(file, out, msg->packet, msg->nbytes) < 0) {
+            out = -1;
+            break;
+        }
+        if (ctx) {
+            hash_update(ctx, msg->packet, msg->nbytes);
+        }
+        out += msg->nbytes;
+        if (msg->nbytes < stop - start) {
+            break; // Last chunk
+        }
+    }
+    prefetch_destroy(&prefetch);
+    return out;
+}
+
+/**
+ * @brief Offset of chunk c in the layout of a range_read
+ *
+ */
+off_t range_base(const range_t *range, size_t c) {
+    return range->offs ? range->offs[c] : (off_t)(c * FTP_PACKET_SIZE);
+}
+
+/**
+ * @brief prefetch_fn_t for the part of chunk c inside a range_t
+ *
+ */
+ftp_err_t range_prefetch(void *arg, size_t c, ftp_msg_t *msg) {
+    const range_t *range = arg;
+    off_t          base  = range_base(range, c);
+    off_t          next  = range_base(range, c + 1);
+    size_t start = range->offset > base ? range->offset - base : 0;
+    size_t stop  = (range->end < next ? range->end : next) - base;
+    return chunk_get_range(range->finf, c, start, stop - start, msg);
+}
+
+/**
+ * @brief Handles the READ command: len bytes at offset of filename to dest
+ *
+ */
+int handle_READ(serv_t servlist[], char *filename, off_t offset, size_t len,
+                char *dest) {
+    if (offset < 0) {
+        fprintf(stderr, "Invalid offset: %ld\n", offset);
+        return EXIT_FAILURE;
+    }
+    handle_LIST(servlist);
+    int file = open(dest, O_RDWR | O_CREAT | O_TRUNC, 0777);
+    if (file < 0) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+    int rv = file_get_range(filename, offset, len, file);
+    close(file);
+    return rv;
+}
+
+/**
+ * @brief Read len bytes at offset of the newest version of filename
+ * @details Versions whose manifest predates chunk layouts are read from the
+ * first chunk onwards, only writing the bytes in range.
+ */
+int file_get_range(const char *filename, off_t offset, size_t len, int file) {
+    int    versions[MAX_FILES];
+    size_t num_versions = file_info_versions(filename, versions, MAX_FILES);
+    time_t newest       = 0;
+    for (size_t v = 0; v < num_versions; v++) {
+        if (file_info[versions[v]].reproducible) {
+            newest = file_info[versions[v]].stime;
+            break;
+        }
+    }
+    if (pack_get(filename, file, newest, offset, len) == EXIT_SUCCESS) {
+        return EXIT_SUCCESS;
+    }
+
+    ftp_msg_t  *msg      = malloc(sizeof(ftp_msg_t));
+    manifest_t *manifest = malloc(sizeof(manifest_t));
+    off_t      *offs     = malloc((MAX_CHUNKS + 1) * sizeof(off_t));
+    int         rv       = EXIT_FAILURE;
+    if (!msg || !manifest || !offs) {
+        perror("malloc");
+        goto file_get_range_done;
+    }
+    for (size_t v = 0; v < num_versions && rv != EXIT_SUCCESS; v++) {
+        file_info_t *finf = &file_info[versions[v]];
+        if (!finf->reproducible || file_info_resolve(finf) < 0)
+            continue;
+        printf("[INFO]\tFound file: %s\n", finf->storename);
+
+        int known = manifest_fetch(finf, manifest, msg) == EXIT_SUCCESS &&
+                    manifest_chunk_offsets(manifest, offs) == 0;
+        if (known) {
+            size_t left = offset < manifest->size ? manifest->size - offset
+                                                  : 0;
+            len         = len < left ? len : left;
+        } else {
+            printf("[INFO]\tNo chunk layout, reading from the start\n");
+        }
+        ssize_t got = known ? range_read(finf, offs, offset, len, file, NULL)
+                            : range_read_scan(finf, offset, len, file, msg);
+        if (got >= 0 && ftruncate(file, got) == 0) {
+            printf("[INFO]\tRead %ld bytes at %ld\n", got, offset);
+            rv = EXIT_SUCCESS;
+        }
+    }
+    if (rv != EXIT_SUCCESS) {
+        printf("[INFO]\tFile is not available\n");
+    }
+
+file_get_range_done:
+    free(msg);
+    free(manifest);
+    free(offs);
+    return rv;
+}
+
+/**
+ * @brief range_read for files of unknown layout, walking whole chunks
+ *
+ */
+ssize_t range_read_scan(file_info_t *finf, off_t offset, size_t len, int file,
+                        ftp_msg_t *msg) {
+    off_t  end  = offset + len;
+    off_t  base = 0;
+    size_t out  = 0;
+    for (size_t c = 0; c < finf->num_chunks && base < end; c++) {
+        if (chunk_get(finf, c, msg) != FTP_ERR_NONE) {
+            fprintf(stderr, "Failed to get chunk %lu\n", c);
+            return -1;
+        }
+        off_t next = base + msg->nbytes;
+        if (next > offset) {
+            size_t start = offset > base ? offset - base : 0;
+            size_t stop  = (end < next ? end : next) - base;
+            if (write_all(file, out, msg->packet + start, stop - start) < 0) {
+                return -1;
+            }
+            out += stop - start;
+        }
+        base = next;
+    }
+    return out;
+}
+
+/**
+ * @brief Handles the GC command
+ * @details Keeps the newest conf.keep_versions complete versions of every
+ * file (or only of the given filenames) and deletes all versions older than
+ * those from every server. Incomplete versions newer than the ones kept
+ * are left alone, they may still be uploading. Packs are collected once
+ * none of their members needs them any more, see gc_packs. Deletes are
+ * sent in batches of up to a packet of names per server.
+ */
+int handle_GC(serv_t servlist[], char *filenames[], int num_filenames) {
+    if (handle_LIST(servlist) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    gc_batch_t *batches  = calloc(MAX_SERVERS, sizeof(gc_batch_t));
+    int        *versions = malloc(MAX_FILES * sizeof(int));
+    if (!batches || !versions) {
+        perror("malloc");
+        free(batches);
+        free(versions);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t reclaimed   = 0;
+    size_t   num_removed = 0;
+    size_t   num_packs   = 0;
+    size_t   num_deleted = 0;
+    int      rv          = EXIT_SUCCESS;
+    for (size_t i = 0; i < num_files; i++) {
+        const char *filename = file_info[i].filename;
+        // Each filename once, at its first entry
+        size_t first = 0;
+        while (strcmp(file_info[first].filename, filename) != 0) {
+            first++;
+        }
+        if (first != i) {
+            continue;
+        }
+        int selected = num_filenames == 0;
+        for (int f = 0; f < num_filenames; f++) {
+            selected |= strcmp(filenames[f], filename) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        if (strncmp(filename, PACK_PREFIX, strlen(PACK_PREFIX)) == 0) {
+            continue; // Every pack is its own file, see gc_packs
+        }
+
+        size_t n    = file_info_versions(filename, versions, MAX_FILES);
+        size_t kept = 0;
+        for (size_t v = 0; v < n; v++) {
+            file_info_t *finf = &file_info[versions[v]];
+            if (kept < conf.keep_versions) {
+                kept += finf->reproducible;
+                continue;
+            }
+            printf("[GC]\tRemoving %s\n", finf->storename);
+            rv |= gc_remove(servlist, batches, finf, &reclaimed, &num_deleted);
+            num_removed++;
+        }
+    }
+    rv |= gc_packs(servlist, batches, filenames, num_filenames, &reclaimed,
+                   &num_packs, &num_deleted);
+    for (serv_t *serv = servlist; serv; serv = serv->next) {
+        rv |= gc_flush(serv, &batches[serv - servlist], &reclaimed);
+    }
+    free(batches);
+    free(versions);
+
+    printf("[INFO]\tRemoved %lu versions and %lu packs (%lu files), "
+           "reclaimed %" PRIu64 " bytes\n",
+           num_removed, num_packs, num_deleted, reclaimed);
+    return rv;
+}
+
+/**
+ * @brief Queue every chunk and the manifest of a stored file for deletion
+ *
+ * @param num_deleted Incremented by the number of names queued
+ */
+int gc_remove(serv_t servlist[], gc_batch_t batches[], file_info_t *finf,
+              uint64_t *reclaimed, size_t *num_deleted) {
+    int  rv             = EXIT_SUCCESS;
+    char name[PATH_MAX] = {0};
+    for (size_t c = 0; c < finf->num_chunks; c++) {
+        snprintf(name, PATH_MAX, "%s.%lu", finf->storename, c);
+        for (size_t j = 0; j < MAX_SERVERS && finf->chunk_locs[c][j]; j++) {
+            serv_t *serv = finf->chunk_locs[c][j];
+            rv |= gc_delete(serv, &batches[serv - servlist], name, reclaimed);
+            (*num_deleted)++;
+        }
+    }
+    snprintf(name, PATH_MAX, "%s.%s", finf->storename, MANIFEST_SUFFIX);
+    for (size_t j = 0; finf->manifest_locs[j]; j++) {
+        serv_t *serv = finf->manifest_locs[j];
+        rv |= gc_delete(serv, &batches[serv - servlist], name, reclaimed);
+        (*num_deleted)++;
+    }
+    return rv;
+}
+
+/**
+ * @brief Collect the packs none of whose members needs them any more
+ * @details A member is covered once conf.keep_versions copies of it are
+ * newer than its pack: complete uploads of the file, or newer packs that
+ * hold it. Packs are visited newest first, counting the packs that hold
+ * each name on the way. Incomplete packs and packs whose manifest cannot
+ * be read are neither collected nor counted. With filenames, only packs
+ * named there are collected.
+ *
+ * @param num_removed Incremented by the number of packs collected
+ */
+int gc_packs(serv_t servlist[], gc_batch_t batches[], char *filenames[],
+             int num_filenames, uint64_t *reclaimed, size_t *num_removed,
+             size_t *num_deleted) {
+    int         *packs      = malloc(MAX_FILES * sizeof(int));
+    int         *versions   = malloc(MAX_FILES * sizeof(int));
+    ftp_msg_t   *msg        = malloc(sizeof(ftp_msg_t));
+    manifest_t  *manifest   = malloc(sizeof(manifest_t));
+    gc_copies_t *copies     = NULL;
+    size_t       num_copies = 0;
+    size_t       max_copies = 0;
+    size_t       n          = 0;
+    int          rv         = EXIT_SUCCESS;
+    if (!packs || !versions || !msg || !manifest) {
+        perror("malloc");
+        rv = EXIT_FAILURE;
+        goto gc_packs_done;
+    }
+    for (size_t i = 0; i < num_files; i++) {
+        if (strncmp(file_info[i].filename, PACK_PREFIX,
+                    strlen(PACK_PREFIX)) == 0 &&
+            file_info[i].reproducible) {
+            packs[n++] = i;
+        }
+    }
+    qsort(packs, n, sizeof(int), file_info_newer);
+
+    for (size_t p = 0; p < n; p++) {
+        file_info_t *finf = &file_info[packs[p]];
+        if (pack_manifest(finf, manifest, msg) != EXIT_SUCCESS) {
+            fprintf(stderr, "[INFO]\tKeeping %s, no manifest\n",
+                    finf->storename);
+            continue;
+        }
+        int               needed = 0;
+        size_t            pos    = 0;
+        manifest_member_t member;
+        while (manifest_next_member((char *)msg->packet, msg->nbytes,
+                                    manifest->hash_algo, &pos,
+                                    &member) == 0) {
+            size_t newer = 0;
+            size_t v     = file_info_versions(member.name, versions, MAX_FILES);
+            for (size_t k = 0; k < v; k++) {
+                file_info_t *version = &file_info[versions[k]];
+                newer += version->reproducible && version->stime > finf->stime;
+            }
+            size_t c = 0;
+            while (c < num_copies && strcmp(copies[c].name, member.name)) {
+                c++;
+            }
+            if (c == num_copies) {
+                if (num_copies == max_copies) {
+                    max_copies = max_copies ? max_copies * 2 : 256;
+                    gc_copies_t *grow =
+                        realloc(copies, max_copies * sizeof(gc_copies_t));
+                    if (!grow) {
+                        perror("realloc");
+                        rv = EXIT_FAILURE;
+                        goto gc_packs_done;
+                    }
+                    copies = grow;
+                }
+                memcpy(copies[c].name, member.name, NAME_MAX);
+                copies[c].count = 0;
+                copies[c].pack  = 0;
+                num_copies++;
+            }
+            // A name packed twice in one pack is one copy
+            if (copies[c].pack != p + 1) {
+                newer += copies[c].count;
+                copies[c].count++;
+                copies[c].pack = p + 1;
+            } else {
+                newer += copies[c].count - 1;
+            }
+            needed |= newer < conf.keep_versions;
+        }
+
+        int selected = num_filenames == 0;
+        for (int f = 0; f < num_filenames; f++) {
+            selected |= strcmp(filenames[f], finf->filename) == 0;
+        }
+        if (needed || !selected) {
+            continue;
+        }
+        printf("[GC]\tRemoving pack %s, every member is newer elsewhere\n",
+               finf->storename);
+        rv |= gc_remove(servlist, batches, finf, reclaimed, num_deleted);
+        (*num_removed)++;
+        char path[PATH_MAX + NAME_MAX + 8] = {0};
+        snprintf(path, sizeof(path), "%s/pack-%s", state_path,
+                 finf->storename);
+        unlink(path); // The copy kept by pack_manifest
+    }
+
+gc_packs_done:
+    free(packs);
+    free(versions);
+    free(msg);
+    free(manifest);
+    free(copies);
+    return rv;
+}
+
+/**
+ * @brief Queue name for deletion on serv, sending the batch once it is full
+ *
+ */
+int gc_delete(serv_t *serv, gc_batch_t *batch, const char *name,
+              uint64_t *reclaimed) {
+    size_t len = strlen(name);
+    int    rv  = EXIT_SUCCESS;
+    if (batch->len + len + 1 > FTP_PACKET_SIZE) {
+        rv = gc_flush(serv, batch, reclaimed);
+    }
+    memcpy(batch->names + batch->len, name, len);
+    batch->len += len;
+    batch->names[batch->len++] = '\n';
+    return rv;
+}
+
+/**
+ * @brief Send the pending DELETE batch for serv (FTP_CMD_DELETE)
+ *
+ */
+int gc_flush(serv_t *serv, gc_batch_t *batch, uint64_t *reclaimed) {
+    if (!batch->len) {
+        return EXIT_SUCCESS;
+    }
+    // Deleting a full batch takes the server a while, allow for a packet
+    ftp_msg_t msg = {0};
+    ftp_err_t err = serv_request(serv, FTP_CMD_DELETE, batch->names,
+                                 batch->len, FTP_PACKET_SIZE, &msg);
+    batch->len    = 0;
+    if (err != FTP_ERR_NONE || msg.cmd != FTP_CMD_DATA) {
+        fprintf(stderr, "[INFO]\tServer could not delete (%s): %s\n",
+                serv->name, ftp_err_to_str(err));
+        return EXIT_FAILURE;
+    }
+    *reclaimed += strtoull((char *)msg.packet, NULL, 10);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Parses a filename and inserts it into the list
+ *
+ */
+void file_list_insert(char *filename, serv_t *serv) {
+    // Copy the filename
+    char copyname[NAME_MAX];
+    char storename[NAME_MAX];
+    strncpy(copyname, filename, NAME_MAX);
+
+    // Parse the filename:
+    // filename.stime.client_id.num_chunks.chunk_id
+    // Search in reverse
+    char *dot = strrchr(filename, '.');
+    if (!dot)
+        goto file_list_insert_error;
+    *dot               = '\0';
+    char *chunk_id_str = dot + 1;
+    strncpy(storename, filename, NAME_MAX);
+
+    dot = strrchr(filename, '.');
+    if (!dot)
         goto file_list_insert_error;
     *dot                 = '\0';
     char *num_chunks_str = dot + 1;
@@ -662,11 +2791,15 @@ void file_list_insert(char *filename, serv_t *serv) {
     // Parse the num_chunks
     size_t num_chunks = (size_t)atoi(num_chunks_str);
 
-    // Parse the chunk_id
-    int chunk_id = atoi(chunk_id_str);
+    // Parse the chunk_id (or the manifest marker in its place)
+    int is_manifest = strcmp(chunk_id_str, MANIFEST_SUFFIX) == 0;
+    int chunk_id    = atoi(chunk_id_str);
+    if (chunk_id < 0 || chunk_id >= MAX_CHUNKS)
+        goto file_list_insert_error;
 
-    // Insert the file into the file_list
-    file_info_t *info = &file_info[0];
+    // Find the file in the file_list
+    file_info_t *info  = &file_info[0];
+    file_info_t *match = NULL;
     for (size_t i = 0; i < num_files; i++) {
         if (strcmp(info[i].filename, filename) != 0)
             continue;
@@ -674,31 +2807,44 @@ void file_list_insert(char *filename, serv_t *serv) {
             continue;
         if (info[i].client_id != client_id)
             continue;
-        if (info[i].num_chunks != num_chunks)
+        if (info[i].streamed ? num_chunks != 0
+                             : info[i].num_chunks != num_chunks)
             continue;
         // File matches
-        // Update the file chunk info
-        size_t  j = 0;
-        serv_t *n = info[i].chunk_locs[chunk_id][j];
-        while (n) {
-            if (n->id == serv->id)
-                return;
-            n = info[i].chunk_locs[chunk_id][++j];
-        }
-        info[i].chunk_locs[chunk_id][j] = serv;
-        return;
+        match = &info[i];
+        break;
+    }
+    if (!match) {
+        if (num_files == MAX_FILES)
+            goto file_list_insert_error;
+        // Insert a new entry
+        bzero(info + num_files, sizeof(file_info_t));
+        match = &file_info[num_files];
+        strncpy(match->filename, filename, NAME_MAX);
+        strncpy(match->storename, storename, NAME_MAX);
+        match->stime        = stime;
+        match->client_id    = client_id;
+        match->num_chunks   = num_chunks;
+        match->streamed     = num_chunks == 0;
+        match->reproducible = 0;
+        num_files++;
     }
-    // Insert a new entry
-    bzero(info + num_files, sizeof(file_info_t));
-    file_info_t *new = &file_info[num_files];
-    strncpy(new->filename, filename, NAME_MAX);
-    strncpy(new->storename, storename, NAME_MAX);
-    new->stime                   = stime;
-    new->client_id               = client_id;
-    new->num_chunks              = num_chunks;
-    new->reproducible            = 0;
-    new->chunk_locs[chunk_id][0] = serv;
-    num_files++;
+    // Until the manifest is read, a streamed file is as long as it looks
+    if (match->streamed && !is_manifest &&
+        (size_t)chunk_id >= match->num_chunks) {
+        match->num_chunks = chunk_id + 1;
+    }
+
+    // Update the file chunk (or manifest) info
+    serv_t **locs = is_manifest ? match->manifest_locs
+                                : match->chunk_locs[chunk_id];
+    size_t   j    = 0;
+    while (locs[j]) {
+        if (locs[j]->id == serv->id)
+            return;
+        j++;
+    }
+    locs[j] = serv;
     return;
 
 file_list_insert_error:;
@@ -720,7 +2866,9 @@ void file_list_analyze(void) {
     // Iterate through all files
     file_info_t *info = &file_info[0];
     for (size_t i = 0; i < num_files; i++) {
-        info[i].reproducible = 1;
+        // A streamed upload is finished once its manifest is stored
+        info[i].reproducible = !info[i].streamed || !info[i].num_chunks ||
+                               info[i].manifest_locs[0] != NULL;
         // Iterate through all chunks
         for (size_t j = 0; j < info[i].num_chunks; j++) {
             // Servers begin at index 0
@@ -735,6 +2883,33 @@ void file_list_analyze(void) {
     }
 }
 
+/**
+ * @brief Take the chunk count of a streamed upload from its manifest
+ * @details Streamed uploads carry no count in their chunk names (see
+ * put_fd), so the file list only knows the chunks it has seen. Other files
+ * are left alone.
+ *
+ * @return int 0 if every chunk has a replica, -1 otherwise, -2 if the
+ * count is unknown because the manifest cannot be read
+ */
+int file_info_resolve(file_info_t *finf) {
+    if (!finf->streamed || !finf->num_chunks) {
+        return 0;
+    }
+    manifest_t manifest;
+    if (manifest_get(finf, &manifest) != EXIT_SUCCESS ||
+        manifest.num_chunks > MAX_CHUNKS) {
+        return -2;
+    }
+    finf->num_chunks = manifest.num_chunks;
+    for (size_t i = 0; i < finf->num_chunks; i++) {
+        if (!finf->chunk_locs[i][0]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /**
  * @brief Prints the file list
  *
@@ -756,3 +2931,540 @@ void file_list_print(void) {
     print_line(80, '-');
     puts("");
 }
+
+/**
+ * @brief Store the manifest for base_name on each of the given servers
+ * @details With conf.durability every server that can must confirm the
+ * manifest, see serv_level.
+ */
+int manifest_put(serv_t *servs[], int num_servs, char *base_name,
+                 manifest_t *manifest) {
+    int rv = EXIT_SUCCESS;
+    char    buf[FTP_PACKET_SIZE] = {0};
+    ssize_t len = manifest_format(manifest, buf, FTP_PACKET_SIZE);
+    if (len < 0) {
+        fprintf(stderr, "Manifest too large: %s\n", base_name);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_servs; i++) {
+        if (!servs[i]->connected)
+            continue;
+        ftp_durable_t level = serv_level(servs[i]);
+        char          manifest_name[PATH_MAX + 32] = {0};
+        int name_len = snprintf(manifest_name, PATH_MAX, "%s.%s", base_name,
+                                MANIFEST_SUFFIX);
+        if (level != FTP_DURABLE_NONE) {
+            snprintf(manifest_name + name_len, 32, " durable=%s",
+                     ftp_durable_to_str(level));
+        }
+        size_t owed = level != FTP_DURABLE_NONE;
+        pthread_mutex_lock(&servs[i]->lock);
+        ftp_set_cork(servs[i]->fd, 1);
+        ftp_send_msg(servs[i]->fd, FTP_CMD_PUT, manifest_name, -1);
+        ftp_send_msg(servs[i]->fd, FTP_CMD_DATA, buf, len);
+        ftp_send_msg(servs[i]->fd, FTP_CMD_TERM, NULL, 0);
+        ftp_set_cork(servs[i]->fd, 0);
+        if (serv_acks(servs[i], &owed, 0, level)) {
+            fprintf(stderr, "[ERROR]\tManifest of %s not stored %s on %s\n",
+                    base_name, ftp_durable_to_str(level), servs[i]->name);
+            rv = EXIT_FAILURE;
+        }
+        pthread_mutex_unlock(&servs[i]->lock);
+    }
+    return rv;
+}
+
+/**
+ * @brief Fetch and parse the manifest of a file from any server holding it
+ * @details msg receives the raw manifest, e.g. for manifest_find_member.
+ */
+int manifest_fetch(file_info_t *finf, manifest_t *manifest, ftp_msg_t *msg) {
+    char manifest_name[PATH_MAX] = {0};
+    snprintf(manifest_name, PATH_MAX, "%s.%s", finf->storename,
+             MANIFEST_SUFFIX);
+    serv_t *ranked[MAX_SERVERS];
+    size_t  num_ranked =
+        serv_rank(finf->manifest_locs, MAX_SERVERS, HEALTH_SMALL, ranked);
+    for (size_t j = 0; j < num_ranked; j++) {
+        serv_t *serv = ranked[j];
+        pthread_mutex_lock(&serv->lock);
+        ftp_err_t err = serv_request(serv, FTP_CMD_GET, manifest_name, -1,
+                                     HEALTH_SMALL, msg);
+        pthread_mutex_unlock(&serv->lock);
+        if (err != FTP_ERR_NONE)
+            continue;
+        if (manifest_parse((char *)msg->packet, msg->nbytes, manifest) == 0)
+            return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * @brief Fetch and parse the manifest of a file from any server holding it
+ *
+ */
+int manifest_get(file_info_t *finf, manifest_t *manifest) {
+    ftp_msg_t msg = {0};
+    return manifest_fetch(finf, manifest, &msg);
+}
+
+/**
+ * @brief Read one chunk of a file from the first replica that serves it
+ * @details Replicas that are corrupt, missing or unreachable are skipped.
+ *
+ * @return ftp_err_t FTP_ERR_SERVER if no replica could serve the chunk,
+ * another error if the connection state is unknown
+ */
+ftp_err_t chunk_get(file_info_t *finf, size_t chunk_id, ftp_msg_t *msg) {
+    return chunk_get_range(finf, chunk_id, 0, FTP_PACKET_SIZE, msg);
+}
+
+/**
+ * @brief Read len bytes at offset of one chunk, see chunk_get
+ * @details Only the range is transferred. Servers that do not know ranged
+ * GETs send the whole chunk, which is then cut down here. msg->nbytes is
+ * less than len if the chunk ends first.
+ */
+ftp_err_t chunk_get_range(file_info_t *finf, size_t chunk_id, size_t offset,
+                          size_t len, ftp_msg_t *msg) {
+    char chunkpath[PATH_MAX]    = {0};
+    char request[PATH_MAX + 48] = {0};
+    snprintf(chunkpath, PATH_MAX, "%s.%lu", finf->storename, chunk_id);
+    snprintf(request, sizeof(request), "%s %lu %lu", chunkpath, offset, len);
+    int whole = offset == 0 && len >= FTP_PACKET_SIZE;
+
+    // Chunk names never refer to different content, a cached copy is good
+    size_t cached = 0;
+    if (cache_get(&cache, chunkpath, msg->packet, FTP_PACKET_SIZE, &cached) ==
+        0) {
+        size_t start = offset < cached ? offset : cached;
+        size_t n     = len < cached - start ? len : cached - start;
+        memmove(msg->packet, msg->packet + start, n);
+        msg->cmd    = FTP_CMD_DATA;
+        msg->nbytes = n;
+        return FTP_ERR_NONE;
+    }
+
+    // Try the servers which have the chunk, the one expected to answer
+    // first before the others. When every attempt timed out the servers
+    // are tried again, with the longer timeouts the failures earned.
+    size_t  bytes  = len < FTP_PACKET_SIZE ? len : FTP_PACKET_SIZE;
+    int     rounds = 0;
+    serv_t *ranked[MAX_SERVERS];
+chunk_get_range_retry:;
+    int    timed_out = 0;
+    size_t num_ranked =
+        serv_rank(finf->chunk_locs[chunk_id], MAX_SERVERS, bytes, ranked);
+    for (size_t j = 0; j < num_ranked; j++) {
+        serv_t *serv = ranked[j];
+        pthread_mutex_lock(&serv->lock);
+        int       ranged = !whole && serv->ranges && !serv->opens;
+        ftp_err_t err;
+        if (serv->opens) {
+            err = serv_open(serv, chunkpath, msg);
+        } else {
+            err = serv_request(serv, FTP_CMD_GET, ranged ? request : chunkpath,
+                               -1, bytes, msg);
+        }
+        if (ranged && err == FTP_ERR_SERVER) {
+            // Older servers look for a chunk named like the whole request
+            err = serv_request(serv, FTP_CMD_GET, chunkpath, -1,
+                               FTP_PACKET_SIZE, msg);
+            if (err == FTP_ERR_NONE) {
+                printf("[INFO]\tServer does not read ranges (%s)\n",
+                       serv->name);
+                serv->ranges = 0;
+                ranged       = 0;
+            }
+        }
+        pthread_mutex_unlock(&serv->lock);
+        switch (err) {
+        case FTP_ERR_NONE:
+            if (!ranged) {
+                cache_put(&cache, chunkpath, msg->packet, msg->nbytes);
+            }
+            if (!whole && !ranged) {
+                size_t start = offset < msg->nbytes ? offset : msg->nbytes;
+                size_t n = len < msg->nbytes - start ? len : msg->nbytes - start;
+                memmove(msg->packet, msg->packet + start, n);
+                msg->nbytes = n;
+            }
+            return FTP_ERR_NONE;
+        case FTP_ERR_CLOSE:
+            fprintf(stderr, "[INFO]\tServer closed connection (%s)\n",
+                    serv->name);
+            serv->connected = 0;
+            continue;
+        case FTP_ERR_TIMEOUT:
+            fprintf(stderr, "[INFO]\tServer timed out (%s)\n", serv->name);
+            timed_out = 1;
+            continue;
+        case FTP_ERR_CHECKSUM:
+        case FTP_ERR_SERVER:
+            // Corrupt or missing replica, try the next server
+            fprintf(stderr, "[INFO]\tBad chunk %lu from %s (%s)\n", chunk_id,
+                    serv->name, ftp_err_to_str(err));
+            continue;
+        default:
+            fprintf(stderr, "Unknown ftp_recv_msg error: %s\n",
+                    ftp_err_to_str(err));
+            return err;
+        }
+    }
+    if (timed_out && rounds++ < HEALTH_MAX_BACKOFF) {
+        goto chunk_get_range_retry;
+    }
+    return FTP_ERR_SERVER;
+}
+
+/**
+ * @brief Write the whole buffer to fd at offset, retrying short writes
+ * @details Pipes and sockets cannot seek, the buffer is appended instead;
+ * callers writing to them must go in order.
+ */
+int write_all(int fd, off_t offset, const uint8_t *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = pwrite(fd, buf + total, len - total, offset + total);
+        if (n < 0 && errno == ESPIPE) {
+            n = write(fd, buf + total, len - total);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("write");
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Offer conf.compress to serv (FTP_CMD_HELLO)
+ * @details Servers that predate compression answer with an error, the
+ * connection then stays uncompressed.
+ */
+void serv_hello(serv_t *serv) {
+    const char *offer = compress_codec_to_str(conf.compress);
+    serv_timeout(serv, HEALTH_SMALL);
+    ftp_send_msg(serv->fd, FTP_CMD_HELLO, offer, -1);
+    ftp_msg_t msg = {0};
+    ftp_err_t err = ftp_recv_msg(serv->fd, &msg);
+    if (err == FTP_ERR_TIMEOUT || err == FTP_ERR_CLOSE) {
+        // Not resetting here, serv_reset says HELLO itself
+        fprintf(stderr, "[INFO]\tServer did not answer HELLO (%s)\n",
+                serv->name);
+        health_fail(&serv->health);
+        ftp_close(serv->fd);
+        serv->connected = 0;
+        return;
+    }
+    if (err != FTP_ERR_NONE || msg.cmd != FTP_CMD_DATA) {
+        printf("[INFO]\tServer does not compress (%s)\n", serv->name);
+        return;
+    }
+    compress_codec_t codec;
+    if (compress_codec_from_str((char *)msg.packet, &codec) == 0) {
+        ftp_set_codec(serv->fd, codec);
+    }
+}
+
+/**
+ * @brief Ask serv for its capacity and load (FTP_CMD_STAT)
+ * @details Servers without STAT answer with an error and keep unknown (0)
+ * figures, which placement treats as average. Those and servers that do
+ * not report a durability level are never sent "durable=".
+ */
+void serv_stat(serv_t *serv) {
+    // A small request, a fresh round trip sample for every run
+    ftp_msg_t msg = {0};
+    ftp_err_t err =
+        serv_request(serv, FTP_CMD_STAT, NULL, 0, HEALTH_SMALL, &msg);
+    if (err != FTP_ERR_NONE || msg.cmd != FTP_CMD_DATA) {
+        return;
+    }
+    char *saveptr = NULL;
+    for (char *line = strtok_r((char *)msg.packet, "\n", &saveptr); line;
+         line       = strtok_r(NULL, "\n", &saveptr)) {
+        sscanf(line, "free: %" SCNu64, &serv->free_bytes);
+        sscanf(line, "total: %" SCNu64, &serv->total_bytes);
+        sscanf(line, "load: %lf", &serv->load);
+        char level[16] = {0};
+        if (sscanf(line, "durable: %15s", level) == 1) {
+            ftp_durable_from_str(level, &serv->durable);
+        }
+    }
+}
+
+/**
+ * @brief The durability level to ask serv for: conf.durability, unless the
+ * server reported a lower one in its STAT reply
+ */
+ftp_durable_t serv_level(serv_t *serv) {
+    return serv->durable < conf.durability ? serv->durable : conf.durability;
+}
+
+/**
+ * @brief Save what this run learned about each server for the next one
+ *
+ */
+void serv_health_save(serv_t servlist[]) {
+    char path[PATH_MAX + 16];
+    char tmp[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s", state_path, HEALTH_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp%d", path, getpid());
+    FILE *file = fopen(tmp, "w");
+    if (!file) {
+        return;
+    }
+    for (serv_t *serv = servlist; serv; serv = serv->next) {
+        if (serv->health.samples) {
+            health_write(file, serv->name, &serv->health);
+        }
+    }
+    if (fclose(file) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+    }
+}
+
+/**
+ * @brief Size the receive timeout on serv's socket for a reply of bytes
+ * @details Derived from the server's round trip time and throughput, see
+ * health_timeout; TIMEOUT_MS until they are known.
+ *
+ * @return int The timeout in milliseconds
+ */
+int serv_timeout(serv_t *serv, size_t bytes) {
+    int ms = health_timeout(&serv->health, bytes);
+    ftp_set_timeout(serv->fd, ms);
+    return ms ? ms : TIMEOUT_MS;
+}
+
+/**
+ * @brief Socket options for serv: the global ones with the server line's
+ * overrides, buffers sized "bdp" resolved from the health estimates
+ */
+void serv_sockopts(serv_t *serv, ftp_sockopts_t *opts) {
+    *opts = conf.sockopts;
+    mergeSockopts(opts, &serv->sockopts);
+    if (opts->sndbuf == SOCKOPT_BDP) {
+        // Unknown until the first transfers, autotuning covers until then
+        opts->sndbuf = opts->rcvbuf =
+            health_bdp(&serv->health, 2 * FTP_MSG_SIZE);
+    }
+}
+
+/**
+ * @brief Open a new connection to serv, serv->connected tells if it worked
+ *
+ */
+void serv_connect(serv_t *serv) {
+    serv->connected = 0;
+    serv->fd        = socket(serv->path ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (serv->fd < 0) {
+        perror("socket");
+        return;
+    }
+    // Before connect, so the receive buffer sets the window scale
+    ftp_sockopts_t opts;
+    serv_sockopts(serv, &opts);
+    if (ftp_tune_socket(serv->fd, &opts)) {
+        fprintf(stderr, "[WARN]\tSome socket options refused for %s\n",
+                serv->name);
+    }
+    int ret;
+    if (serv->path) {
+        struct sockaddr_un serv_addr = {0};
+        serv_addr.sun_family         = AF_UNIX;
+        strncpy(serv_addr.sun_path, serv->path,
+                sizeof(serv_addr.sun_path) - 1);
+        ret = connect(serv->fd, (struct sockaddr *)&serv_addr,
+                      sizeof(serv_addr));
+    } else {
+        struct sockaddr_in serv_addr;
+        serv_addr.sin_family      = AF_INET;
+        serv_addr.sin_port        = htons(atoi(serv->port));
+        serv_addr.sin_addr.s_addr = inet_addr(serv->ip);
+        ret = connect(serv->fd, (struct sockaddr *)&serv_addr,
+                      sizeof(serv_addr));
+    }
+    if (ret < 0) {
+        ftp_close(serv->fd);
+        return;
+    }
+    serv->connected = 1;
+}
+
+/**
+ * @brief Replace the connection to serv after a request timed out
+ * @details A reply that arrives late would otherwise be taken for the
+ * answer to the next request. Called with serv->lock held.
+ */
+void serv_reset(serv_t *serv) {
+    ftp_close(serv->fd);
+    serv_connect(serv);
+    if (serv->connected && conf.compress != COMPRESS_NONE && !serv->path) {
+        serv_hello(serv);
+    }
+}
+
+/**
+ * @brief Send a request to serv and receive the reply, updating the
+ * server's estimates with how it went
+ * @details The receive timeout is sized for a reply of bytes, see
+ * serv_timeout. After a timeout the connection is replaced. Called with
+ * serv->lock held, unless no other thread uses serv yet.
+ *
+ * @param len Length of arg, -1 for a string
+ * @param bytes Expected size of the reply payload
+ * @return ftp_err_t As ftp_recv_msg
+ */
+ftp_err_t serv_request(serv_t *serv, ftp_cmd_t cmd, const char *arg,
+                       ssize_t len, size_t bytes, ftp_msg_t *msg) {
+    return serv_request_fd(serv, cmd, arg, len, bytes, msg, NULL);
+}
+
+/**
+ * @brief serv_request for replies that may carry a file descriptor
+ *
+ * @param passfd Set to the descriptor received, or -1, see ftp_recv_msg_fd
+ */
+ftp_err_t serv_request_fd(serv_t *serv, ftp_cmd_t cmd, const char *arg,
+                          ssize_t len, size_t bytes, ftp_msg_t *msg,
+                          int *passfd) {
+    serv_timeout(serv, bytes);
+    double start = health_now();
+    ftp_send_msg(serv->fd, cmd, arg, len);
+    ftp_err_t err = ftp_recv_msg_fd(serv->fd, msg, passfd);
+    switch (err) {
+    case FTP_ERR_NONE:
+        health_record(&serv->health, health_now() - start, msg->nbytes);
+        break;
+    case FTP_ERR_SERVER:
+        break; // Answered, just not with what was asked for
+    case FTP_ERR_TIMEOUT:
+        health_fail(&serv->health);
+        serv_reset(serv);
+        break;
+    default:
+        health_fail(&serv->health);
+        break;
+    }
+    return err;
+}
+
+/**
+ * @brief Read a whole chunk from a server on this host (FTP_CMD_OPEN)
+ * @details The server passes an open descriptor of the chunk file and the
+ * chunk is read from it directly, skipping the copies through the socket.
+ * Servers that do not know OPEN are asked with GET instead, and not asked
+ * to OPEN again. Called with serv->lock held.
+ *
+ * @return ftp_err_t FTP_ERR_CHECKSUM if what was read does not match the
+ * stored crc
+ */
+ftp_err_t serv_open(serv_t *serv, const char *name, ftp_msg_t *msg) {
+    int       fd  = -1;
+    ftp_err_t err = serv_request_fd(serv, FTP_CMD_OPEN, name, -1,
+                                    HEALTH_SMALL, msg, &fd);
+    if (err == FTP_ERR_SERVER) {
+        err = serv_request(serv, FTP_CMD_GET, name, -1, FTP_PACKET_SIZE, msg);
+        if (err == FTP_ERR_NONE) {
+            printf("[INFO]\tServer does not pass chunk files (%s)\n",
+                   serv->name);
+            serv->opens = 0;
+        }
+        return err;
+    }
+    if (err != FTP_ERR_NONE) {
+        return err;
+    }
+    size_t       len = 0;
+    unsigned int crc = 0;
+    if (fd < 0 || sscanf((char *)msg->packet, "%lu %X", &len, &crc) != 2 ||
+        len > FTP_PACKET_SIZE) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return FTP_ERR_INVALID;
+    }
+    ssize_t n = pread(fd, msg->packet, len, 0);
+    close(fd);
+    if (n != (ssize_t)len || crc32c(0, msg->packet, len) != crc) {
+        return FTP_ERR_CHECKSUM;
+    }
+    msg->cmd    = FTP_CMD_DATA;
+    msg->nbytes = len;
+    msg->crc    = crc;
+    return FTP_ERR_NONE;
+}
+
+/**
+ * @brief Order the connected servers among locs by when they are expected
+ * to have returned bytes, see health_expected
+ *
+ * @param locs Servers holding a replica, NULL entries are skipped
+ * @param max Entries in locs
+ * @param ranked Output, the fastest server first
+ * @return size_t Number of servers in ranked
+ */
+size_t serv_rank(serv_t *const locs[], size_t max, size_t bytes,
+                 serv_t *ranked[]) {
+    double expected[MAX_SERVERS];
+    size_t n = 0;
+    for (size_t i = 0; i < max && n < MAX_SERVERS; i++) {
+        serv_t *serv = locs[i];
+        if (!serv || !serv->connected)
+            continue;
+        double t = health_expected(&serv->health, bytes);
+        // Insertion sort, equal estimates keep the listing order
+        size_t j = n++;
+        for (; j > 0 && expected[j - 1] > t; j--) {
+            expected[j] = expected[j - 1];
+            ranked[j]   = ranked[j - 1];
+        }
+        expected[j] = t;
+        ranked[j]   = serv;
+    }
+    return n;
+}
+
+/**
+ * @brief Build the placement ring from every configured server
+ * @details Unreachable servers stay on the ring so placement does not
+ * depend on who is up right now. A server gets RING_VNODES virtual nodes
+ * scaled by its configured weight and by its free space relative to the
+ * other servers. The capacity factor is rounded to quarters between 1/4 and
+ * 4 so small changes in free space do not move chunks around.
+ *
+ * @return int 0 on success, -1 on allocation failure
+ */
+int placement_init(serv_t servlist[]) {
+    uint64_t total_free = 0;
+    size_t   reported   = 0;
+    for (serv_t *serv = servlist; serv; serv = serv->next) {
+        if (serv->total_bytes) {
+            total_free += serv->free_bytes;
+            reported++;
+        }
+    }
+    double mean_free = reported ? (double)total_free / reported : 0;
+
+    ring_init(&ring);
+    for (serv_t *serv = servlist; serv; serv = serv->next) {
+        double capacity = 1;
+        if (serv->total_bytes && mean_free > 0) {
+            capacity = (double)serv->free_bytes / mean_free;
+            capacity = capacity < 0.25 ? 0.25 : capacity > 4 ? 4 : capacity;
+            capacity = (int)(capacity * 4 + 0.5) / 4.0;
+        }
+        size_t vnodes = RING_VNODES * serv->weight * capacity;
+        if (ring_add(&ring, serv->name, serv - servlist,
+                     vnodes ? vnodes : 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
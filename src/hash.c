@@ -0,0 +1,419 @@
+/**
+ * @file hash.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Pluggable hash functions for naming, placement and checksums
+ * @version 0.1
+ * @date 2023-05-13
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "hash.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define ROTR32(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+#define MIN(X, Y)    (((X) < (Y)) ? (X) : (Y))
+
+static uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v; // Little endian hosts only (x86-64, aarch64)
+}
+
+static uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/* -------------------------------------------------------------------------
+ * XXH64
+ * ---------------------------------------------------------------------- */
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = ROTL64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(xxh64_state_t *s) {
+    memset(s, 0, sizeof(*s));
+    s->acc[0] = XXH_P1 + XXH_P2;
+    s->acc[1] = XXH_P2;
+    s->acc[2] = 0;
+    s->acc[3] = -XXH_P1;
+}
+
+static void xxh64_update(xxh64_state_t *s, const uint8_t *p, size_t len) {
+    s->total_len += len;
+    if (s->buf_len) {
+        size_t take = MIN(len, 32 - s->buf_len);
+        memcpy(s->buf + s->buf_len, p, take);
+        s->buf_len += take;
+        p += take;
+        len -= take;
+        if (s->buf_len < 32)
+            return;
+        for (int i = 0; i < 4; i++)
+            s->acc[i] = xxh64_round(s->acc[i], load64(s->buf + i * 8));
+        s->buf_len = 0;
+    }
+    while (len >= 32) {
+        for (int i = 0; i < 4; i++)
+            s->acc[i] = xxh64_round(s->acc[i], load64(p + i * 8));
+        p += 32;
+        len -= 32;
+    }
+    memcpy(s->buf, p, len);
+    s->buf_len = len;
+}
+
+static uint64_t xxh64_final(const xxh64_state_t *s) {
+    uint64_t h;
+    if (s->total_len >= 32) {
+        h = ROTL64(s->acc[0], 1) + ROTL64(s->acc[1], 7) +
+            ROTL64(s->acc[2], 12) + ROTL64(s->acc[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh64_merge(h, s->acc[i]);
+    } else {
+        h = s->acc[2] + XXH_P5;
+    }
+    h += s->total_len;
+
+    const uint8_t *p   = s->buf;
+    size_t         len = s->buf_len;
+    while (len >= 8) {
+        h ^= xxh64_round(0, load64(p));
+        h = ROTL64(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)load32(p) * XXH_P1;
+        h = ROTL64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        h ^= (*p++) * XXH_P5;
+        h = ROTL64(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* -------------------------------------------------------------------------
+ * BLAKE3 (unkeyed hash mode, 256 bit output)
+ * ---------------------------------------------------------------------- */
+
+#define B3_CHUNK_LEN   1024
+#define B3_BLOCK_LEN   64
+#define B3_CHUNK_START (1 << 0)
+#define B3_CHUNK_END   (1 << 1)
+#define B3_PARENT      (1 << 2)
+#define B3_ROOT        (1 << 3)
+
+static const uint32_t B3_IV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372,
+                                  0xA54FF53A, 0x510E527F, 0x9B05688C,
+                                  0x1F83D9AB, 0x5BE0CD19};
+
+static const uint8_t B3_PERM[16] = {2,  6, 3,  10, 7,  0,  4,  13,
+                                    1, 11, 12, 5,  9, 14, 15, 8};
+
+#define B3_G(a, b, c, d, mx, my)                                              \
+    do {                                                                      \
+        v[a] = v[a] + v[b] + (mx);                                            \
+        v[d] = ROTR32(v[d] ^ v[a], 16);                                       \
+        v[c] = v[c] + v[d];                                                   \
+        v[b] = ROTR32(v[b] ^ v[c], 12);                                       \
+        v[a] = v[a] + v[b] + (my);                                            \
+        v[d] = ROTR32(v[d] ^ v[a], 8);                                        \
+        v[c] = v[c] + v[d];                                                   \
+        v[b] = ROTR32(v[b] ^ v[c], 7);                                        \
+    } while (0)
+
+/**
+ * @brief BLAKE3 compression function, writes the 16 word output state
+ */
+static void b3_compress(const uint32_t cv[8], const uint8_t block[64],
+                        uint8_t block_len, uint64_t counter, uint8_t flags,
+                        uint32_t out[16]) {
+    uint32_t m[16], t[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = load32(block + i * 4);
+    uint32_t v[16] = {cv[0],
+                      cv[1],
+                      cv[2],
+                      cv[3],
+                      cv[4],
+                      cv[5],
+                      cv[6],
+                      cv[7],
+                      B3_IV[0],
+                      B3_IV[1],
+                      B3_IV[2],
+                      B3_IV[3],
+                      (uint32_t)counter,
+                      (uint32_t)(counter >> 32),
+                      block_len,
+                      flags};
+    for (int r = 0; r < 7; r++) {
+        B3_G(0, 4, 8, 12, m[0], m[1]);
+        B3_G(1, 5, 9, 13, m[2], m[3]);
+        B3_G(2, 6, 10, 14, m[4], m[5]);
+        B3_G(3, 7, 11, 15, m[6], m[7]);
+        B3_G(0, 5, 10, 15, m[8], m[9]);
+        B3_G(1, 6, 11, 12, m[10], m[11]);
+        B3_G(2, 7, 8, 13, m[12], m[13]);
+        B3_G(3, 4, 9, 14, m[14], m[15]);
+        for (int i = 0; i < 16; i++)
+            t[i] = m[B3_PERM[i]];
+        memcpy(m, t, sizeof(m));
+    }
+    for (int i = 0; i < 8; i++) {
+        out[i]     = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ cv[i];
+    }
+}
+
+static void b3_parent_cv(const uint32_t left[8], const uint32_t right[8],
+                         uint8_t flags, uint32_t out_cv[8]) {
+    uint8_t  block[64];
+    uint32_t out[16];
+    memcpy(block, left, 32);
+    memcpy(block + 32, right, 32);
+    b3_compress(B3_IV, block, 64, 0, B3_PARENT | flags, out);
+    memcpy(out_cv, out, 32);
+}
+
+static void b3_chunk_reset(blake3_state_t *s, uint64_t counter) {
+    memcpy(s->cv, B3_IV, sizeof(s->cv));
+    s->chunk_counter     = counter;
+    s->block_len         = 0;
+    s->blocks_compressed = 0;
+    memset(s->block, 0, sizeof(s->block));
+}
+
+static size_t b3_chunk_len(const blake3_state_t *s) {
+    return (size_t)s->blocks_compressed * B3_BLOCK_LEN + s->block_len;
+}
+
+static uint8_t b3_start_flag(const blake3_state_t *s) {
+    return s->blocks_compressed == 0 ? B3_CHUNK_START : 0;
+}
+
+static void blake3_init(blake3_state_t *s) {
+    b3_chunk_reset(s, 0);
+    s->cv_stack_len = 0;
+}
+
+static void blake3_update(blake3_state_t *s, const uint8_t *p, size_t len) {
+    while (len) {
+        if (b3_chunk_len(s) == B3_CHUNK_LEN) {
+            // Finish the full chunk and merge completed subtrees
+            uint32_t out[16], cv[8];
+            b3_compress(s->cv, s->block, s->block_len, s->chunk_counter,
+                        b3_start_flag(s) | B3_CHUNK_END, out);
+            memcpy(cv, out, 32);
+            uint64_t total = s->chunk_counter + 1;
+            while ((total & 1) == 0) {
+                b3_parent_cv(s->cv_stack[--s->cv_stack_len], cv, 0, cv);
+                total >>= 1;
+            }
+            memcpy(s->cv_stack[s->cv_stack_len++], cv, 32);
+            b3_chunk_reset(s, s->chunk_counter + 1);
+        }
+        if (s->block_len == B3_BLOCK_LEN) {
+            uint32_t out[16];
+            b3_compress(s->cv, s->block, B3_BLOCK_LEN, s->chunk_counter,
+                        b3_start_flag(s), out);
+            memcpy(s->cv, out, 32);
+            s->blocks_compressed++;
+            s->block_len = 0;
+            memset(s->block, 0, sizeof(s->block));
+        }
+        size_t want = MIN((size_t)(B3_BLOCK_LEN - s->block_len), len);
+        // Never compress the last block of a chunk until more input arrives
+        want = MIN(want, B3_CHUNK_LEN - b3_chunk_len(s));
+        memcpy(s->block + s->block_len, p, want);
+        s->block_len += want;
+        p += want;
+        len -= want;
+    }
+}
+
+static void blake3_final(const blake3_state_t *s, uint8_t out[32]) {
+    // Output node of the current chunk
+    uint32_t cv[8], block_words[16], o[16];
+    uint8_t  block[64];
+    uint8_t  block_len = s->block_len;
+    uint64_t counter   = s->chunk_counter;
+    uint8_t  flags     = b3_start_flag(s) | B3_CHUNK_END;
+    memcpy(cv, s->cv, 32);
+    memcpy(block, s->block, 64);
+
+    for (int i = s->cv_stack_len; i > 0; i--) {
+        b3_compress(cv, block, block_len, counter, flags, o);
+        memcpy(block_words, s->cv_stack[i - 1], 32);
+        memcpy(block_words + 8, o, 32);
+        memcpy(block, block_words, 64);
+        memcpy(cv, B3_IV, 32);
+        block_len = B3_BLOCK_LEN;
+        counter   = 0;
+        flags     = B3_PARENT;
+    }
+    b3_compress(cv, block, block_len, counter, flags | B3_ROOT, o);
+    memcpy(out, o, 32);
+}
+
+/* -------------------------------------------------------------------------
+ * Public interface
+ * ---------------------------------------------------------------------- */
+
+size_t hash_len(hash_algo_t algo) {
+    switch (algo) {
+    case HASH_MD5:
+        return 16;
+    case HASH_XXH64:
+        return 8;
+    case HASH_BLAKE3:
+        return 32;
+    default:
+        return 0;
+    }
+}
+
+void hash_init(hash_ctx_t *ctx, hash_algo_t algo) {
+    ctx->algo = algo;
+    switch (algo) {
+    case HASH_MD5:
+        md5Init(&ctx->u.md5);
+        break;
+    case HASH_XXH64:
+        xxh64_init(&ctx->u.xxh64);
+        break;
+    case HASH_BLAKE3:
+        blake3_init(&ctx->u.blake3);
+        break;
+    }
+}
+
+void hash_update(hash_ctx_t *ctx, const void *buf, size_t len) {
+    switch (ctx->algo) {
+    case HASH_MD5:
+        md5Update(&ctx->u.md5, (uint8_t *)buf, len);
+        break;
+    case HASH_XXH64:
+        xxh64_update(&ctx->u.xxh64, buf, len);
+        break;
+    case HASH_BLAKE3:
+        blake3_update(&ctx->u.blake3, buf, len);
+        break;
+    }
+}
+
+void hash_final(hash_ctx_t *ctx, uint8_t *out) {
+    switch (ctx->algo) {
+    case HASH_MD5:
+        md5Finalize(&ctx->u.md5);
+        memcpy(out, ctx->u.md5.digest, 16);
+        break;
+    case HASH_XXH64: {
+        // Canonical (big endian) representation
+        uint64_t h = xxh64_final(&ctx->u.xxh64);
+        for (int i = 0; i < 8; i++)
+            out[i] = h >> (56 - 8 * i);
+        break;
+    }
+    case HASH_BLAKE3:
+        blake3_final(&ctx->u.blake3, out);
+        break;
+    }
+}
+
+size_t hash_buf(hash_algo_t algo, const void *buf, size_t len, uint8_t *out) {
+    hash_ctx_t ctx;
+    hash_init(&ctx, algo);
+    hash_update(&ctx, buf, len);
+    hash_final(&ctx, out);
+    return hash_len(algo);
+}
+
+size_t hash_fd(hash_algo_t algo, int fd, uint8_t *out) {
+    hash_ctx_t ctx;
+    uint8_t    buf[65536];
+    hash_init(&ctx, algo);
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return 0;
+        }
+        hash_update(&ctx, buf, n);
+    }
+    hash_final(&ctx, out);
+    return hash_len(algo);
+}
+
+void hash_to_hex(const uint8_t *digest, size_t len, char *hex) {
+    for (size_t i = 0; i < len; i++) {
+        sprintf(hex + (i * 2), "%02x", digest[i]);
+    }
+    hex[len * 2] = '\0';
+}
+
+void hash_to_key(hash_algo_t algo, const uint8_t *digest, char *key) {
+    char hex[HASH_HEX_LEN];
+    hash_to_hex(digest, hash_len(algo), hex);
+    snprintf(key, HASH_KEY_LEN, "%s-%s", hash_algo_to_str(algo), hex);
+}
+
+const char *hash_algo_to_str(hash_algo_t algo) {
+    switch (algo) {
+    case HASH_MD5:
+        return "md5";
+    case HASH_XXH64:
+        return "xxh64";
+    case HASH_BLAKE3:
+        return "blake3";
+    default:
+        return "invalid";
+    }
+}
+
+int hash_algo_from_str(const char *str, hash_algo_t *algo) {
+    if (!str || !algo)
+        return -1;
+    if (strcmp(str, "md5") == 0) {
+        *algo = HASH_MD5;
+    } else if (strcmp(str, "xxh64") == 0) {
+        *algo = HASH_XXH64;
+    } else if (strcmp(str, "blake3") == 0) {
+        *algo = HASH_BLAKE3;
+    } else {
+        return -1;
+    }
+    return 0;
+}
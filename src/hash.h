@@ -0,0 +1,114 @@
+/**
+ * @file hash.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Pluggable hash functions for naming, placement and checksums
+ * @details Three algorithms are available:
+ *      md5     legacy, kept so existing clusters keep working
+ *      xxh64   fast non-cryptographic hash (64 bit digest)
+ *      blake3  fast cryptographic hash (256 bit digest)
+ * The algorithm is chosen per cluster with the `hash` option in dfc.conf and
+ * recorded in each file's manifest so readers verify with the same one.
+ * Both new algorithms are portable C: XXH64 (not XXH3) and the reference
+ * BLAKE3 tree hashed on one thread, without SIMD kernels. Chunks are hashed
+ * in parallel by the put pipeline instead.
+ * @version 0.1
+ * @date 2023-05-13
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "md5.h"
+
+#define HASH_MAX_LEN 32 // Largest digest in bytes (blake3)
+#define HASH_HEX_LEN (HASH_MAX_LEN * 2 + 1)
+#define HASH_KEY_LEN (8 + HASH_HEX_LEN) // "<algo>-<hex>"
+
+typedef enum {
+    HASH_MD5,
+    HASH_XXH64,
+    HASH_BLAKE3,
+} hash_algo_t;
+
+typedef struct {
+    uint64_t acc[4];
+    uint64_t total_len;
+    uint8_t  buf[32];
+    size_t   buf_len;
+} xxh64_state_t;
+
+typedef struct {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t  block[64];
+    uint8_t  block_len;
+    uint8_t  blocks_compressed;
+    uint32_t cv_stack[54][8];
+    uint8_t  cv_stack_len;
+} blake3_state_t;
+
+typedef struct {
+    hash_algo_t algo;
+    union {
+        MD5Context     md5;
+        xxh64_state_t  xxh64;
+        blake3_state_t blake3;
+    } u;
+} hash_ctx_t;
+
+/**
+ * @brief Digest length in bytes for the algorithm
+ *
+ */
+size_t hash_len(hash_algo_t algo);
+
+/**
+ * @brief Streaming interface: init, update any number of times, final
+ *
+ * @param out Receives hash_len(algo) bytes
+ */
+void hash_init(hash_ctx_t *ctx, hash_algo_t algo);
+void hash_update(hash_ctx_t *ctx, const void *buf, size_t len);
+void hash_final(hash_ctx_t *ctx, uint8_t *out);
+
+/**
+ * @brief Hash a buffer in one call
+ *
+ * @return size_t Number of bytes written to out
+ */
+size_t hash_buf(hash_algo_t algo, const void *buf, size_t len, uint8_t *out);
+
+/**
+ * @brief Hash the remaining contents of a file descriptor
+ *
+ * @return size_t Number of bytes written to out, 0 on read error
+ */
+size_t hash_fd(hash_algo_t algo, int fd, uint8_t *out);
+
+/**
+ * @brief Write the lowercase hex form of a digest (hex needs 2*len+1 bytes)
+ *
+ */
+void hash_to_hex(const uint8_t *digest, size_t len, char *hex);
+
+/**
+ * @brief Write the content address "<algo>-<hex>" of a digest
+ * @details Used as the storage key of deduplicated chunks on the servers.
+ * key needs HASH_KEY_LEN bytes.
+ */
+void hash_to_key(hash_algo_t algo, const uint8_t *digest, char *key);
+
+/**
+ * @brief Convert between hash_algo_t and its config/manifest name
+ *
+ * @return int 0 on success, -1 if the name is unknown
+ */
+const char *hash_algo_to_str(hash_algo_t algo);
+int         hash_algo_from_str(const char *str, hash_algo_t *algo);
+
+#endif // HASH_H
@@ -0,0 +1,179 @@
+/**
+ * @file health.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Running estimates of a server's latency, throughput and errors
+ * @version 0.1
+ * @date 2023-05-19
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "health.h"
+
+#include <math.h>
+#include <string.h>
+
+/**
+ * @brief Let the error rate decay for the time since the last sample.
+ * Called with the lock held.
+ */
+static void health_age(health_t *health, time_t now) {
+    if (health->updated && now > health->updated) {
+        health->errors *=
+            pow(0.5, (double)(now - health->updated) / HEALTH_HALF_LIFE);
+    }
+    health->updated = now;
+}
+
+void health_init(health_t *health) {
+    memset(health, 0, sizeof(*health));
+    pthread_mutex_init(&health->lock, NULL);
+}
+
+double health_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void health_record(health_t *health, double seconds, size_t bytes) {
+    pthread_mutex_lock(&health->lock);
+    health_age(health, time(NULL));
+    if (bytes <= HEALTH_SMALL || !health->rtt) {
+        if (!health->rtt) {
+            health->rtt    = seconds;
+            health->rttvar = seconds / 2;
+        } else {
+            double dev     = fabs(seconds - health->rtt);
+            health->rttvar = (1 - HEALTH_BETA) * health->rttvar +
+                             HEALTH_BETA * dev;
+            health->rtt = (1 - HEALTH_ALPHA) * health->rtt +
+                          HEALTH_ALPHA * seconds;
+        }
+    }
+    if (bytes > HEALTH_SMALL) {
+        // What is left after the round trip is spent moving the payload
+        double transfer = seconds - health->rtt;
+        if (transfer < health->rtt / 10) {
+            transfer = health->rtt / 10;
+        }
+        double bw   = transfer > 0 ? bytes / transfer : 0;
+        health->bw  = health->bw ? (1 - HEALTH_ALPHA) * health->bw +
+                                       HEALTH_ALPHA * bw
+                                 : bw;
+    }
+    health->errors *= 1 - HEALTH_ALPHA;
+    health->backoff = 0;
+    health->samples++;
+    pthread_mutex_unlock(&health->lock);
+}
+
+void health_fail(health_t *health) {
+    pthread_mutex_lock(&health->lock);
+    health_age(health, time(NULL));
+    health->errors = (1 - HEALTH_ALPHA) * health->errors + HEALTH_ALPHA;
+    if (health->backoff < HEALTH_MAX_BACKOFF) {
+        health->backoff++;
+    }
+    health->samples++;
+    pthread_mutex_unlock(&health->lock);
+}
+
+double health_expected(health_t *health, size_t bytes) {
+    pthread_mutex_lock(&health->lock);
+    double seconds = health->rtt;
+    if (health->bw) {
+        seconds += bytes / health->bw;
+    }
+    double errors = health->errors;
+    if (health->updated) {
+        time_t now = time(NULL);
+        if (now > health->updated) {
+            errors *= pow(0.5, (double)(now - health->updated) /
+                                   HEALTH_HALF_LIFE);
+        }
+    }
+    pthread_mutex_unlock(&health->lock);
+    if (errors > HEALTH_MAX_ERR) {
+        errors = HEALTH_MAX_ERR;
+    }
+    // Each attempt fails with probability errors, count the retries
+    return seconds / (1 - errors);
+}
+
+size_t health_bdp(health_t *health, size_t min) {
+    pthread_mutex_lock(&health->lock);
+    double bytes = health->bw * (health->rtt + HEALTH_K * health->rttvar);
+    pthread_mutex_unlock(&health->lock);
+    if (bytes <= 0) {
+        return 0;
+    }
+    if (bytes > HEALTH_MAX_BDP) {
+        return HEALTH_MAX_BDP;
+    }
+    return bytes < min ? min : bytes;
+}
+
+int health_timeout(health_t *health, size_t bytes) {
+    pthread_mutex_lock(&health->lock);
+    double seconds = health->rtt + HEALTH_K * health->rttvar;
+    int    known   = health->rtt && (bytes <= HEALTH_SMALL || health->bw);
+    if (bytes > HEALTH_SMALL && health->bw) {
+        seconds += HEALTH_SLACK * bytes / health->bw;
+    }
+    int backoff = health->backoff;
+    pthread_mutex_unlock(&health->lock);
+    if (!known) {
+        return 0;
+    }
+    double ms = seconds * 1000;
+    if (ms < HEALTH_MIN_TIMEOUT) {
+        ms = HEALTH_MIN_TIMEOUT;
+    }
+    ms *= 1 << backoff;
+    return ms > HEALTH_MAX_TIMEOUT ? HEALTH_MAX_TIMEOUT : (int)ms;
+}
+
+int health_load(health_t *health, const char *path, const char *name) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[NAME_MAX + 256];
+    int  rv = -1;
+    while (rv < 0 && fgets(line, sizeof(line), file)) {
+        char          saved[NAME_MAX + 1];
+        health_t      read    = {0};
+        unsigned long samples = 0;
+        long          updated = 0;
+        if (sscanf(line, "%255s %lf %lf %lf %lf %lu %ld", saved, &read.rtt,
+                   &read.rttvar, &read.bw, &read.errors, &samples,
+                   &updated) != 7 ||
+            strcmp(saved, name) != 0) {
+            continue;
+        }
+        pthread_mutex_lock(&health->lock);
+        health->rtt     = read.rtt;
+        health->rttvar  = read.rttvar;
+        health->bw      = read.bw;
+        health->errors  = read.errors;
+        health->samples = samples;
+        health->updated = updated;
+        pthread_mutex_unlock(&health->lock);
+        rv = 0;
+    }
+    fclose(file);
+    return rv;
+}
+
+void health_write(FILE *file, const char *name, health_t *health) {
+    pthread_mutex_lock(&health->lock);
+    fprintf(file, "%s %.6f %.6f %.0f %.4f %lu %ld\n", name, health->rtt,
+            health->rttvar, health->bw, health->errors,
+            (unsigned long)health->samples, (long)health->updated);
+    pthread_mutex_unlock(&health->lock);
+}
+
+void health_destroy(health_t *health) {
+    pthread_mutex_destroy(&health->lock);
+}
@@ -0,0 +1,127 @@
+/**
+ * @file health.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Running estimates of a server's latency, throughput and errors
+ * @details Every request a client makes to a server is one sample: replies
+ * up to HEALTH_SMALL bytes measure the round trip time, larger ones the
+ * throughput left after subtracting it. Estimates are exponentially
+ * weighted moving averages, the round trip time and its mean deviation
+ * updated as in TCP's RTO calculation (RFC 6298). The error rate is the
+ * moving average of failed (timed out, dropped or corrupt) requests and
+ * decays with a half life of HEALTH_HALF_LIFE while no request is made, so
+ * a server that failed once gets another chance later.
+ * Timeouts follow the same estimates: the round trip time plus HEALTH_K
+ * deviations, plus HEALTH_SLACK times the expected transfer time, doubled
+ * after every failure until a request succeeds again.
+ * @version 0.1
+ * @date 2023-05-19
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define HEALTH_ALPHA     0.125 // Weight of a new rtt, throughput or error
+#define HEALTH_BETA      0.25  // Weight of a new rtt deviation
+#define HEALTH_SMALL     4096  // Bytes up to which a reply measures rtt only
+#define HEALTH_HALF_LIFE 600   // Seconds for an idle error rate to halve
+#define HEALTH_MAX_ERR   0.9   // Error rate cap when estimating retries
+
+#define HEALTH_K           4    // Deviations of rtt a reply may be late by
+#define HEALTH_SLACK       2    // Multiple of the expected transfer time
+#define HEALTH_MIN_TIMEOUT 100  // Milliseconds
+#define HEALTH_MAX_TIMEOUT 60000
+#define HEALTH_MAX_BACKOFF 6 // Failures after which timeouts stop doubling
+#define HEALTH_MAX_BDP     (16 << 20) // Bytes, socket buffer size cap
+
+typedef struct {
+    double          rtt;     // Seconds, 0 until measured
+    double          rttvar;  // Seconds, mean deviation of rtt
+    double          bw;      // Bytes per second, 0 until measured
+    double          errors;  // Fraction of recent requests that failed
+    uint64_t        samples; // Requests measured so far
+    time_t          updated; // Wall clock time of the last sample
+    int             backoff; // Failures since the last success
+    pthread_mutex_t lock;
+} health_t;
+
+/**
+ * @brief Set up estimates for a server nothing is known about
+ *
+ */
+void health_init(health_t *health);
+
+/**
+ * @brief Monotonic clock in seconds, for timing requests
+ *
+ */
+double health_now(void);
+
+/**
+ * @brief Account for a request that succeeded
+ *
+ * @param seconds Time from sending the request to the complete reply
+ * @param bytes Payload bytes received (or sent)
+ */
+void health_record(health_t *health, double seconds, size_t bytes);
+
+/**
+ * @brief Account for a request that failed
+ *
+ */
+void health_fail(health_t *health);
+
+/**
+ * @brief Expected seconds until a reply of bytes is complete, counting the
+ * retries the error rate predicts
+ * @details Servers that were never measured are expected to answer at
+ * once, so they are tried and measured.
+ */
+double health_expected(health_t *health, size_t bytes);
+
+/**
+ * @brief How long to wait for a reply of bytes, see ftp_set_timeout
+ *
+ * @return int Milliseconds, 0 while there is too little to go on
+ */
+int health_timeout(health_t *health, size_t bytes);
+
+/**
+ * @brief Bytes in flight needed to keep the path to the server busy
+ * @details Throughput times rtt plus its deviation, at most HEALTH_MAX_BDP
+ * and at least min.
+ *
+ * @return size_t 0 while throughput or rtt is unknown
+ */
+size_t health_bdp(health_t *health, size_t min);
+
+/**
+ * @brief Restore the estimates saved for name by health_write
+ *
+ * @param path File of "<name> <rtt> <rttvar> <bw> <errors> <samples>
+ * <updated>" lines
+ * @return int 0 on success, -1 if nothing is saved for name
+ */
+int health_load(health_t *health, const char *path, const char *name);
+
+/**
+ * @brief Write the estimates for name as one line
+ *
+ */
+void health_write(FILE *file, const char *name, health_t *health);
+
+/**
+ * @brief Release the estimates
+ *
+ */
+void health_destroy(health_t *health);
+
+#endif // HEALTH_H
@@ -0,0 +1,203 @@
+/**
+ * @file hotcache.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief In memory cache of popular chunks for the dfs server
+ * @version 0.1
+ * @date 2023-05-18
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "hotcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief FNV-1a, the low bits pick the shard and the rest the bucket
+ */
+static uint64_t hotcache_hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*key) {
+        h ^= (uint8_t)*key++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t hotcache_cost(const hotcache_entry_t *entry) {
+    return sizeof(*entry) + strlen(entry->key) + 1 + entry->len;
+}
+
+static void list_unlink(hotcache_list_t *list, hotcache_entry_t *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    list->bytes -= hotcache_cost(entry);
+}
+
+static void list_push(hotcache_list_t *list, hotcache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = list->head;
+    if (list->head) {
+        list->head->prev = entry;
+    } else {
+        list->tail = entry;
+    }
+    list->head = entry;
+    list->bytes += hotcache_cost(entry);
+}
+
+static hotcache_entry_t **hotcache_slot(hotcache_shard_t *shard, uint64_t h,
+                                        const char *key) {
+    hotcache_entry_t **slot =
+        &shard->buckets[(h / HOTCACHE_SHARDS) % HOTCACHE_BUCKETS];
+    while (*slot && strcmp((*slot)->key, key) != 0) {
+        slot = &(*slot)->chain;
+    }
+    return slot;
+}
+
+/**
+ * @brief Unlink an entry from its bucket and segment and free it
+ */
+static void hotcache_drop(hotcache_shard_t *shard, hotcache_entry_t *entry) {
+    hotcache_entry_t **slot =
+        hotcache_slot(shard, hotcache_hash(entry->key), entry->key);
+    *slot = entry->chain;
+    list_unlink(entry->promoted ? &shard->protect : &shard->probation, entry);
+    free(entry->key);
+    free(entry->buf);
+    free(entry);
+}
+
+/**
+ * @brief Demote protected overflow, then evict from probation until the
+ * shard fits its capacity
+ */
+static void hotcache_trim(hotcache_shard_t *shard) {
+    size_t protect_cap = shard->cap / 100 * HOTCACHE_PROTECTED;
+    while (shard->protect.bytes > protect_cap) {
+        hotcache_entry_t *entry = shard->protect.tail;
+        list_unlink(&shard->protect, entry);
+        entry->promoted = 0;
+        list_push(&shard->probation, entry);
+    }
+    while (shard->probation.bytes + shard->protect.bytes > shard->cap) {
+        hotcache_entry_t *victim =
+            shard->probation.tail ? shard->probation.tail : shard->protect.tail;
+        hotcache_drop(shard, victim);
+    }
+}
+
+void hotcache_init(hotcache_t *cache, size_t bytes) {
+    memset(cache, 0, sizeof(*cache));
+    for (int i = 0; i < HOTCACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].cap = bytes / HOTCACHE_SHARDS;
+    }
+}
+
+int hotcache_get(hotcache_t *cache, const char *key, uint8_t *buf, size_t cap,
+                 size_t *len, uint32_t *crc) {
+    uint64_t          h     = hotcache_hash(key);
+    hotcache_shard_t *shard = &cache->shards[h % HOTCACHE_SHARDS];
+    int               rv    = -1;
+    pthread_mutex_lock(&shard->lock);
+    hotcache_entry_t *entry = *hotcache_slot(shard, h, key);
+    if (entry && entry->len <= cap) {
+        memcpy(buf, entry->buf, entry->len);
+        *len = entry->len;
+        *crc = entry->crc;
+        rv   = 0;
+        // A second read earns a place in the protected segment
+        list_unlink(entry->promoted ? &shard->protect : &shard->probation,
+                    entry);
+        entry->promoted = 1;
+        list_push(&shard->protect, entry);
+        hotcache_trim(shard);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return rv;
+}
+
+uint64_t hotcache_version(hotcache_t *cache, const char *key) {
+    hotcache_shard_t *shard =
+        &cache->shards[hotcache_hash(key) % HOTCACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    uint64_t version = shard->removed;
+    pthread_mutex_unlock(&shard->lock);
+    return version;
+}
+
+void hotcache_put(hotcache_t *cache, const char *key, const uint8_t *buf,
+                  size_t len, uint32_t crc, uint64_t version) {
+    uint64_t          h     = hotcache_hash(key);
+    hotcache_shard_t *shard = &cache->shards[h % HOTCACHE_SHARDS];
+    if (len > shard->cap / 4) {
+        return;
+    }
+    hotcache_entry_t *entry = calloc(1, sizeof(*entry));
+    if (!entry || !(entry->key = strdup(key)) ||
+        !(entry->buf = malloc(len ? len : 1))) {
+        if (entry) {
+            free(entry->key);
+        }
+        free(entry);
+        return;
+    }
+    memcpy(entry->buf, buf, len);
+    entry->len = len;
+    entry->crc = crc;
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->removed != version) {
+        pthread_mutex_unlock(&shard->lock);
+        free(entry->key);
+        free(entry->buf);
+        free(entry);
+        return;
+    }
+    hotcache_entry_t **slot = hotcache_slot(shard, h, key);
+    if (*slot) {
+        hotcache_drop(shard, *slot);
+        slot = hotcache_slot(shard, h, key);
+    }
+    *slot = entry;
+    list_push(&shard->probation, entry);
+    hotcache_trim(shard);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void hotcache_remove(hotcache_t *cache, const char *key) {
+    uint64_t          h     = hotcache_hash(key);
+    hotcache_shard_t *shard = &cache->shards[h % HOTCACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    hotcache_entry_t *entry = *hotcache_slot(shard, h, key);
+    if (entry) {
+        hotcache_drop(shard, entry);
+    }
+    shard->removed++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void hotcache_destroy(hotcache_t *cache) {
+    for (int i = 0; i < HOTCACHE_SHARDS; i++) {
+        hotcache_shard_t *shard = &cache->shards[i];
+        while (shard->probation.head) {
+            hotcache_drop(shard, shard->probation.head);
+        }
+        while (shard->protect.head) {
+            hotcache_drop(shard, shard->protect.head);
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
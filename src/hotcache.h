@@ -0,0 +1,113 @@
+/**
+ * @file hotcache.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief In memory cache of popular chunks for the dfs server
+ * @details A segmented LRU: chunks enter a probationary segment and only
+ * move to the protected segment when they are read again, so a scan over
+ * cold data (a repair, a one-off GET of a large file) can only push out
+ * other chunks that were read once. The protected segment holds up to
+ * HOTCACHE_PROTECTED percent of the capacity; chunks that fall out of it
+ * get another chance in the probationary segment before being evicted.
+ * Keys are spread over HOTCACHE_SHARDS independently locked shards so
+ * worker threads serving different chunks rarely wait on each other.
+ * @version 0.1
+ * @date 2023-05-18
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef HOTCACHE_H
+#define HOTCACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HOTCACHE_SHARDS    16
+#define HOTCACHE_BUCKETS   1024 // Hash buckets per shard
+#define HOTCACHE_PROTECTED 80   // Percent of a shard for chunks read twice
+
+// Smallest cache that takes chunks of len bytes, see hotcache_put
+#define HOTCACHE_MIN_BYTES(len) ((size_t)(len) * 4 * HOTCACHE_SHARDS)
+
+typedef struct hotcache_entry hotcache_entry_t;
+struct hotcache_entry {
+    char             *key;
+    uint8_t          *buf;
+    size_t            len;
+    uint32_t          crc;
+    int               promoted; // In the protected segment
+    hotcache_entry_t *chain;    // Next entry in the hash bucket
+    hotcache_entry_t *prev;     // Towards the most recently used
+    hotcache_entry_t *next;     // Towards the least recently used
+};
+
+typedef struct {
+    hotcache_entry_t *head; // Most recently used
+    hotcache_entry_t *tail; // Least recently used
+    size_t            bytes;
+} hotcache_list_t;
+
+typedef struct {
+    pthread_mutex_t   lock;
+    hotcache_entry_t *buckets[HOTCACHE_BUCKETS];
+    hotcache_list_t   probation;
+    hotcache_list_t   protect;
+    size_t            cap;     // Bytes
+    uint64_t          removed; // hotcache_remove calls, see hotcache_version
+} hotcache_shard_t;
+
+typedef struct {
+    hotcache_shard_t shards[HOTCACHE_SHARDS];
+} hotcache_t;
+
+/**
+ * @brief Set up an empty cache holding up to bytes of chunks
+ * @details Each shard gets bytes / HOTCACHE_SHARDS, so chunks of a given
+ * length are only cached from HOTCACHE_MIN_BYTES(len) on: 4 MiB for full
+ * 64 KiB chunks.
+ */
+void hotcache_init(hotcache_t *cache, size_t bytes);
+
+/**
+ * @brief Copy a cached chunk into buf
+ *
+ * @param cap Capacity of buf
+ * @param len Set to the chunk length
+ * @param crc Set to the chunk's CRC32C
+ * @return int 0 on a hit, -1 on a miss (or if buf is too small)
+ */
+int hotcache_get(hotcache_t *cache, const char *key, uint8_t *buf, size_t cap,
+                 size_t *len, uint32_t *crc);
+
+/**
+ * @brief Snapshot taken before reading a chunk that may be added afterwards
+ * @details Changes with every hotcache_remove of a key sharing the shard.
+ */
+uint64_t hotcache_version(hotcache_t *cache, const char *key);
+
+/**
+ * @brief Add or replace a chunk, evicting others to make room
+ * @details Chunks larger than a quarter of a shard are not cached. Nor is
+ * the chunk if a key of its shard was removed since version was taken: it
+ * may have been read before a change that the remove stood for, and would
+ * otherwise be served after it.
+ *
+ * @param version hotcache_version from before the chunk was read
+ */
+void hotcache_put(hotcache_t *cache, const char *key, const uint8_t *buf,
+                  size_t len, uint32_t crc, uint64_t version);
+
+/**
+ * @brief Forget a chunk, e.g. when it is overwritten or deleted
+ *
+ */
+void hotcache_remove(hotcache_t *cache, const char *key);
+
+/**
+ * @brief Free every cached chunk
+ *
+ */
+void hotcache_destroy(hotcache_t *cache);
+
+#endif // HOTCACHE_H
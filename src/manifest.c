@@ -0,0 +1,197 @@
+/**
+ * @file manifest.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief File manifests stored next to the chunks of each PUT
+ * @version 0.1
+ * @date 2023-05-13
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "manifest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+ssize_t manifest_format(const manifest_t *m, char *buf, size_t cap) {
+    char checksum[HASH_HEX_LEN];
+    hash_to_hex(m->checksum, hash_len(m->hash_algo), checksum);
+    int n = snprintf(buf, cap,
+                     "filename: %s\n"
+                     "size: %ld\n"
+                     "num_chunks: %lu\n"
+                     "hash_algo: %s\n"
+                     "checksum: %s\n",
+                     m->filename, m->size, m->num_chunks,
+                     hash_algo_to_str(m->hash_algo), checksum);
+    if (n < 0 || (size_t)n >= cap) {
+        return -1;
+    }
+    if (m->chunk_size) {
+        n += snprintf(buf + n, cap - n, "chunk_size: %lu\n", m->chunk_size);
+    } else if (m->num_chunks) {
+        n += snprintf(buf + n, cap - n, "chunks:");
+        for (size_t i = 0; i < m->num_chunks && (size_t)n < cap; i++) {
+            n += snprintf(buf + n, cap - n, " %u", m->chunk_lens[i]);
+        }
+        if ((size_t)n < cap) {
+            n += snprintf(buf + n, cap - n, "\n");
+        }
+    }
+    if ((size_t)n >= cap) {
+        return -1;
+    }
+    if (m->members) {
+        if ((size_t)n + m->members_len >= cap) {
+            return -1;
+        }
+        memcpy(buf + n, m->members, m->members_len);
+        n += m->members_len;
+        buf[n] = '\0';
+    }
+    return n;
+}
+
+/**
+ * @brief Decode a hex digest into bytes
+ */
+static int hex_decode(const char *hex, uint8_t *out, size_t len) {
+    if (strlen(hex) != len * 2)
+        return -1;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return -1;
+        out[i] = byte;
+    }
+    return 0;
+}
+
+int manifest_parse(const char *buf, size_t len, manifest_t *m) {
+    char copy[len + 1];
+    memcpy(copy, buf, len);
+    copy[len] = '\0';
+    memset(m, 0, sizeof(*m));
+
+    // Member lines come last, keep them so the manifest can be copied as is
+    char *member = strstr(copy, "member: ");
+    while (member && member != copy && member[-1] != '\n') {
+        member = strstr(member + 1, "member: ");
+    }
+    if (member) {
+        m->members     = buf + (member - copy);
+        m->members_len = len - (member - copy);
+    }
+
+    char checksum[HASH_HEX_LEN] = {0};
+    int  have_algo              = 0;
+    char *saveptr               = NULL;
+    for (char *line = strtok_r(copy, "\n", &saveptr); line;
+         line       = strtok_r(NULL, "\n", &saveptr)) {
+        char *value = strstr(line, ": ");
+        if (!value)
+            continue;
+        *value = '\0';
+        value += 2;
+        if (strcmp(line, "filename") == 0) {
+            strncpy(m->filename, value, NAME_MAX - 1);
+        } else if (strcmp(line, "size") == 0) {
+            m->size = strtol(value, NULL, 10);
+        } else if (strcmp(line, "num_chunks") == 0) {
+            m->num_chunks = strtoul(value, NULL, 10);
+        } else if (strcmp(line, "hash_algo") == 0) {
+            have_algo = hash_algo_from_str(value, &m->hash_algo) == 0;
+        } else if (strcmp(line, "checksum") == 0) {
+            strncpy(checksum, value, HASH_HEX_LEN - 1);
+        } else if (strcmp(line, "chunk_size") == 0) {
+            m->chunk_size = strtoul(value, NULL, 10);
+        } else if (strcmp(line, "chunks") == 0) {
+            char *end = value;
+            for (size_t i = 0; i < MAX_CHUNKS && *end; i++) {
+                m->chunk_lens[i] = strtoul(end, &end, 10);
+            }
+        }
+    }
+    if (!have_algo) {
+        return -1;
+    }
+    return hex_decode(checksum, m->checksum, hash_len(m->hash_algo));
+}
+
+int manifest_chunk_offsets(const manifest_t *m, off_t offs[]) {
+    if (m->num_chunks > MAX_CHUNKS) {
+        return -1;
+    }
+    offs[0] = 0;
+    for (size_t i = 0; i < m->num_chunks; i++) {
+        if (m->chunk_size) {
+            off_t next  = offs[i] + m->chunk_size;
+            offs[i + 1] = next < m->size ? next : m->size;
+        } else if (m->chunk_lens[i]) {
+            offs[i + 1] = offs[i] + m->chunk_lens[i];
+        } else {
+            return -1; // No layout recorded
+        }
+    }
+    return offs[m->num_chunks] == m->size ? 0 : -1;
+}
+
+ssize_t manifest_format_member(const manifest_member_t *member,
+                               hash_algo_t algo, char *buf, size_t cap) {
+    char checksum[HASH_HEX_LEN];
+    hash_to_hex(member->checksum, hash_len(algo), checksum);
+    int n = snprintf(buf, cap, "member: %ld %lu %s %s\n", member->offset,
+                     member->len, checksum, member->name);
+    if (n < 0 || (size_t)n >= cap) {
+        return -1;
+    }
+    return n;
+}
+
+int manifest_next_member(const char *buf, size_t len, hash_algo_t algo,
+                         size_t *pos, manifest_member_t *member) {
+    while (*pos < len) {
+        const char *line     = buf + *pos;
+        const char *newline  = memchr(line, '\n', len - *pos);
+        size_t      line_len = newline ? (size_t)(newline - line) : len - *pos;
+        *pos += line_len + (newline != NULL);
+        char copy[NAME_MAX + HASH_HEX_LEN + 64];
+        if (line_len < 8 || line_len >= sizeof(copy) ||
+            strncmp(line, "member: ", 8) != 0)
+            continue;
+        memcpy(copy, line, line_len);
+        copy[line_len] = '\0';
+
+        long          offset;
+        unsigned long mlen;
+        char          checksum[HASH_HEX_LEN] = {0};
+        int           name_at                = 0;
+        if (sscanf(copy + 8, "%ld %lu %64s %n", &offset, &mlen, checksum,
+                   &name_at) != 3 ||
+            !name_at || !copy[8 + name_at])
+            continue;
+        if (hex_decode(checksum, member->checksum, hash_len(algo)) < 0)
+            continue;
+        memset(member->name, 0, NAME_MAX);
+        strncpy(member->name, copy + 8 + name_at, NAME_MAX - 1);
+        member->offset = offset;
+        member->len    = mlen;
+        return 0;
+    }
+    return -1;
+}
+
+int manifest_find_member(const char *buf, size_t len, hash_algo_t algo,
+                         const char *name, manifest_member_t *member) {
+    int               found = -1;
+    size_t            pos   = 0;
+    manifest_member_t next;
+    while (manifest_next_member(buf, len, algo, &pos, &next) == 0) {
+        if (strcmp(next.name, name) == 0) {
+            *member = next;
+            found   = 0;
+        }
+    }
+    return found;
+}
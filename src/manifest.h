@@ -0,0 +1,106 @@
+/**
+ * @file manifest.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief File manifests stored next to the chunks of each PUT
+ * @details A manifest is a small text object stored on the servers as
+ * filename.stime.client_id.num_chunks.manifest, i.e. in the slot the chunk_id
+ * occupies for chunk files. It holds one "key: value" pair per line, in the
+ * same format as the tests/manifest tool produces.
+ * The manifest of a pack (many small files stored as one object) also holds
+ * one "member: <offset> <length> <checksum> <name>" line per packed file.
+ * The chunk layout is recorded as "chunk_size: <n>" for fixed size chunks or
+ * "chunks: <len> <len> ..." for content defined ones, so a byte range can be
+ * mapped to the chunks covering it.
+ * @version 0.1
+ * @date 2023-05-13
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <linux/limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "hash.h"
+
+#define MANIFEST_SUFFIX "manifest"
+
+typedef struct {
+    char        filename[NAME_MAX];
+    off_t       size;
+    size_t      num_chunks;
+    hash_algo_t hash_algo;
+    uint8_t     checksum[HASH_MAX_LEN]; // Digest of the whole file
+    size_t      chunk_size;  // Fixed size chunks, 0 if content defined
+    uint32_t    chunk_lens[MAX_CHUNKS]; // Content defined chunk lengths
+    const char *members;     // Member lines appended verbatim, may be NULL
+    size_t      members_len; // (manifest_parse points into its buf)
+} manifest_t;
+
+typedef struct {
+    char    name[NAME_MAX];
+    off_t   offset; // Within the pack
+    size_t  len;
+    uint8_t checksum[HASH_MAX_LEN]; // Digest of the member alone
+} manifest_member_t;
+
+/**
+ * @brief Serialize a manifest into buf
+ *
+ * @return ssize_t Number of bytes written, -1 if buf is too small
+ */
+ssize_t manifest_format(const manifest_t *m, char *buf, size_t cap);
+
+/**
+ * @brief Parse a manifest produced by manifest_format
+ * @details Unknown keys are ignored so newer clients can add fields.
+ *
+ * @return int 0 on success, -1 if a required field is missing or invalid
+ */
+int manifest_parse(const char *buf, size_t len, manifest_t *m);
+
+/**
+ * @brief Work out where each chunk starts
+ * @details offs receives num_chunks + 1 offsets; chunk i spans
+ * [offs[i], offs[i + 1]).
+ *
+ * @return int 0 on success, -1 if the manifest predates chunk layouts or
+ * the layout does not add up to the file size
+ */
+int manifest_chunk_offsets(const manifest_t *m, off_t offs[]);
+
+/**
+ * @brief Serialize one member line of a pack manifest into buf
+ *
+ * @return ssize_t Number of bytes written, -1 if buf is too small
+ */
+ssize_t manifest_format_member(const manifest_member_t *member,
+                               hash_algo_t algo, char *buf, size_t cap);
+
+/**
+ * @brief Read the next member line of a pack manifest
+ * @details Lines that are not member lines, or not valid ones, are skipped.
+ *
+ * @param pos Where to continue in buf, 0 to start, updated
+ * @param algo Hash algorithm of the manifest (manifest_t::hash_algo)
+ * @return int 0 if a member was read, -1 at the end of buf
+ */
+int manifest_next_member(const char *buf, size_t len, hash_algo_t algo,
+                         size_t *pos, manifest_member_t *member);
+
+/**
+ * @brief Look up a packed file by name in a pack manifest
+ * @details When a name was packed more than once the last entry wins.
+ *
+ * @param algo Hash algorithm of the manifest (manifest_t::hash_algo)
+ * @return int 0 if found, -1 otherwise
+ */
+int manifest_find_member(const char *buf, size_t len, hash_algo_t algo,
+                         const char *name, manifest_member_t *member);
+
+#endif // MANIFEST_H
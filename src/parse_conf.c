@@ -4,33 +4,279 @@
  */
 
 #include <linux/limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 
+#include "cdc.h"
 #include "common.h"
+#include "compress.h"
+#include "hash.h"
+#include "health.h"
+#include "transfer.h"
 
 #define MAX_SERVERS 16
 #define CONFIG_PATH "~/dfc.conf"
+#define SOCKOPT_UNSET -1 // Per server option inherits the global one
+#define SOCKOPT_BDP   -2 // Buffer sized from the server's health estimates
 
 typedef struct serv_t serv_t;
 struct serv_t {
-    char   *name;
-    char   *ip;
-    char   *port;
-    int     id;
-    int     fd;
-    int     connected;
-    serv_t *next;
+    char           *name;
+    char           *ip;
+    char           *port;
+    char           *path;        // AF_UNIX socket ("unix:<path>"), or NULL
+    int             id;
+    int             fd;
+    int             connected;
+    int             cas;         // Server accepts HAVE/LINK (dedup)
+    int             ranges;      // Server accepts ranged GET
+    int             opens;       // Server hands out chunk files (OPEN)
+    ftp_durable_t   durable;     // Highest level STAT reports, see serv_level
+    double          weight;      // Share of chunks (dfc.conf, default 1)
+    uint64_t        free_bytes;  // Last STAT report, 0 when unknown
+    uint64_t        total_bytes; // Last STAT report, 0 when unknown
+    double          load;        // Last STAT report, load average per CPU
+    pthread_mutex_t lock;        // Serialises requests on fd between threads
+    health_t        health;      // Latency, throughput and errors seen
+    ftp_sockopts_t  sockopts;    // <key>=<value> overrides, or SOCKOPT_UNSET
+    serv_t         *next;
 };
 
+/**
+ * @brief Cluster wide client options, set by "<option> <value>" lines
+ */
+typedef enum {
+    CHUNKING_FIXED, // FTP_PACKET_SIZE chunks
+    CHUNKING_CDC,   // Content defined chunks
+} chunking_t;
+
+typedef struct {
+    hash_algo_t      hash;                // hash <md5|xxh64|blake3>
+    chunking_t       chunking;            // chunking <fixed|cdc> [min avg max]
+    cdc_params_t     cdc;
+    compress_codec_t compress;            // compress <none|lz4|zstd>
+    ftp_durable_t    durability;          // durability <none|buffered|sync>
+    double           repair_rate;         // repair_rate <MiB/s>, 0 = unlimited
+    size_t           repair_jobs;         // repair_jobs <n> chunks in flight
+    size_t           keep_versions;       // keep_versions <n> per file for gc
+    size_t           pack_threshold;      // pack_threshold <bytes>, 0 disables
+    size_t           transfer_jobs;       // transfer_jobs <n> files in flight
+    size_t           cache_size;          // cache_size <MiB>, 0 disables
+    size_t           readahead;           // readahead <chunks> per file read
+    char             cache_dir[PATH_MAX]; // cache_dir <path>, ~ for $HOME
+    char             state_dir[PATH_MAX]; // state_dir <path>, ~ for $HOME
+    ftp_sockopts_t   sockopts;            // socket_<key> <value>
+} conf_t;
+
+conf_t conf = {
+    .hash           = HASH_MD5,
+    .chunking       = CHUNKING_FIXED,
+    .compress       = COMPRESS_NONE,
+    .durability     = FTP_DURABLE_NONE,
+    .repair_rate    = 0,
+    .repair_jobs    = 4,
+    .keep_versions  = 2,
+    .pack_threshold = 0,
+    .transfer_jobs  = 4,
+    .cache_size     = 0,
+    .readahead      = 16,
+    .cache_dir      = "~/.dfc_cache",
+    .state_dir      = "~/.dfc",
+    .sockopts       = {.nodelay = 1},
+};
+
+/**
+ * @brief Expand a leading ~ in a configured path to $HOME
+ *
+ */
+void confPath(const char *path, char out[PATH_MAX]) {
+    if (path[0] == '~') {
+        snprintf(out, PATH_MAX, "%s%s", getenv("HOME"), path + 1);
+    } else {
+        snprintf(out, PATH_MAX, "%s", path);
+    }
+}
+
+/**
+ * @brief Parse one socket option, shared by "socket_<key> <value>" lines and
+ * "<key>=<value>" tokens on server lines
+ * @details Keys are nodelay (0 or 1), keepalive (idle seconds, 0 is off),
+ * buf (bytes for both directions, or "bdp"), notsent_lowat (bytes) and
+ * busy_poll (microseconds).
+ *
+ * @return int 0 on success, -1 if the key is not recognized
+ */
+int parseSockopt(const char *key, const char *value, ftp_sockopts_t *opts) {
+    int number = strtol(value, NULL, 10);
+    if (strcmp(key, "nodelay") == 0) {
+        opts->nodelay = number;
+    } else if (strcmp(key, "keepalive") == 0) {
+        opts->keepalive = number;
+    } else if (strcmp(key, "buf") == 0) {
+        if (strcmp(value, "bdp") == 0) {
+            number = SOCKOPT_BDP;
+        }
+        opts->sndbuf = opts->rcvbuf = number;
+    } else if (strcmp(key, "notsent_lowat") == 0) {
+        opts->notsent_lowat = number;
+    } else if (strcmp(key, "busy_poll") == 0) {
+        opts->busy_poll = number;
+    } else {
+        fprintf(stderr, "Warning: Unknown socket option '%s'\n", key);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Apply the options of over that are not SOCKOPT_UNSET to opts
+ *
+ */
+void mergeSockopts(ftp_sockopts_t *opts, const ftp_sockopts_t *over) {
+    if (over->nodelay != SOCKOPT_UNSET)
+        opts->nodelay = over->nodelay;
+    if (over->keepalive != SOCKOPT_UNSET)
+        opts->keepalive = over->keepalive;
+    if (over->sndbuf != SOCKOPT_UNSET)
+        opts->sndbuf = over->sndbuf;
+    if (over->rcvbuf != SOCKOPT_UNSET)
+        opts->rcvbuf = over->rcvbuf;
+    if (over->notsent_lowat != SOCKOPT_UNSET)
+        opts->notsent_lowat = over->notsent_lowat;
+    if (over->busy_poll != SOCKOPT_UNSET)
+        opts->busy_poll = over->busy_poll;
+}
+
+/**
+ * @brief Parse a single "<option> <value>" line into conf
+ *
+ * @return int 0 on success, -1 if the option or value is not recognized
+ */
+int parseOption(char *key, char *value) {
+    if (key[0] == '#') {
+        return 0;
+    }
+    if (value == NULL) {
+        fprintf(stderr, "Warning: Missing value for option '%s'\n", key);
+        return -1;
+    }
+    if (strcmp(key, "hash") == 0) {
+        if (hash_algo_from_str(value, &conf.hash) < 0) {
+            fprintf(stderr, "Warning: Unknown hash algorithm '%s'\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(key, "chunking") == 0) {
+        if (strcmp(value, "fixed") == 0) {
+            conf.chunking = CHUNKING_FIXED;
+            return 0;
+        }
+        if (strcmp(value, "cdc") != 0) {
+            fprintf(stderr, "Warning: Unknown chunking '%s'\n", value);
+            return -1;
+        }
+        // Optional sizes follow on the same line; a chunk must fit a packet
+        char  *min     = strtok(NULL, " ");
+        char  *avg     = strtok(NULL, " ");
+        char  *max     = strtok(NULL, " ");
+        size_t max_len = max ? strtoul(max, NULL, 10) : CDC_MAX_DEFAULT;
+        if (max_len > FTP_PACKET_SIZE) {
+            max_len = FTP_PACKET_SIZE;
+        }
+        if (cdc_init(&conf.cdc, min ? strtoul(min, NULL, 10) : CDC_MIN_DEFAULT,
+                     avg ? strtoul(avg, NULL, 10) : CDC_AVG_DEFAULT,
+                     max_len) < 0) {
+            fprintf(stderr, "Warning: Invalid cdc chunk sizes\n");
+            return -1;
+        }
+        conf.chunking = CHUNKING_CDC;
+        return 0;
+    }
+    if (strcmp(key, "compress") == 0) {
+        if (compress_codec_from_str(value, &conf.compress) < 0) {
+            fprintf(stderr, "Warning: Unknown codec '%s'\n", value);
+            return -1;
+        }
+        if (!compress_supported(conf.compress)) {
+            fprintf(stderr, "Warning: Codec '%s' not built in, using none\n",
+                    value);
+            conf.compress = COMPRESS_NONE;
+        }
+        return 0;
+    }
+    if (strcmp(key, "durability") == 0) {
+        if (ftp_durable_from_str(value, &conf.durability) < 0) {
+            fprintf(stderr, "Warning: Unknown durability '%s'\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(key, "repair_rate") == 0) {
+        conf.repair_rate = strtod(value, NULL);
+        return 0;
+    }
+    if (strcmp(key, "repair_jobs") == 0) {
+        conf.repair_jobs = strtoul(value, NULL, 10);
+        return 0;
+    }
+    if (strcmp(key, "keep_versions") == 0) {
+        conf.keep_versions = strtoul(value, NULL, 10);
+        if (conf.keep_versions < 1) {
+            fprintf(stderr, "Warning: keep_versions must be at least 1\n");
+            conf.keep_versions = 1;
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(key, "pack_threshold") == 0) {
+        conf.pack_threshold = strtoul(value, NULL, 10);
+        return 0;
+    }
+    if (strcmp(key, "cache_size") == 0) {
+        conf.cache_size = strtoul(value, NULL, 10);
+        return 0;
+    }
+    if (strcmp(key, "readahead") == 0) {
+        conf.readahead = strtoul(value, NULL, 10);
+        return 0;
+    }
+    if (strcmp(key, "cache_dir") == 0) {
+        strncpy(conf.cache_dir, value, PATH_MAX - 1);
+        return 0;
+    }
+    if (strcmp(key, "state_dir") == 0) {
+        strncpy(conf.state_dir, value, PATH_MAX - 1);
+        return 0;
+    }
+    if (strncmp(key, "socket_", 7) == 0) {
+        return parseSockopt(key + 7, value, &conf.sockopts);
+    }
+    if (strcmp(key, "transfer_jobs") == 0) {
+        conf.transfer_jobs = strtoul(value, NULL, 10);
+        if (conf.transfer_jobs < 1) {
+            fprintf(stderr, "Warning: transfer_jobs must be at least 1\n");
+            conf.transfer_jobs = 1;
+            return -1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "Warning: Unknown config option '%s'\n", key);
+    return -1;
+}
+
 /**
  * @brief Parse the configuration file
  * @details The configuration file is a text file with the following format:
- * server <server_name> <server_ip>:<server_port> [# comment]\n+
+ * server <server_name> <server_ip>:<server_port> [weight] [<key>=<value>...]
+ * [# comment]\n+
  * The function will parse the file and populate the servlist array with the
- * server information.
+ * server information; <key>=<value> tokens override the global socket
+ * options for that server (see parseSockopt). Any other "<option> <value>"
+ * line sets a field of the global conf (see parseOption).
  *
  * @param path File path to config
  * @return int Number of servers parsed
@@ -51,8 +297,13 @@ int parseConfig(char *path, serv_t servlist[]) {
         // Remove the newline character
         line[strcspn(line, "\n")] = 0;
         // Split the line into tokens
-        char *token = strtok(line, " ");
-        int   i     = 0;
+        char *token   = strtok(line, " ");
+        int   i       = 0;
+        int   comment = 0;
+        if (token != NULL && strcmp(token, "server") != 0) {
+            parseOption(token, strtok(NULL, " "));
+            goto nextline;
+        }
         while (token != NULL) {
             switch (i) {
             case 0:
@@ -61,16 +312,45 @@ int parseConfig(char *path, serv_t servlist[]) {
                 }
                 break;
             case 1:
-                servlist->name = strdup(token);
-                break;
-            case 2:
-                token        = strtok(token, ":");
-                servlist->ip = strdup(token);
+                servlist->name   = strdup(token);
+                servlist->weight = 1;
+                servlist->sockopts = (ftp_sockopts_t){
+                    .nodelay       = SOCKOPT_UNSET,
+                    .keepalive     = SOCKOPT_UNSET,
+                    .sndbuf        = SOCKOPT_UNSET,
+                    .rcvbuf        = SOCKOPT_UNSET,
+                    .notsent_lowat = SOCKOPT_UNSET,
+                    .busy_poll     = SOCKOPT_UNSET,
+                };
                 break;
-            case 3:
-                servlist->port = strdup(token);
+            case 2: {
+                // Not strtok, which would lose its place in the line
+                char *port = strchr(token, ':');
+                if (port == NULL) {
+                    fprintf(stderr, "Warning: Expected <ip>:<port> for %s\n",
+                            servlist->name);
+                    goto nextline;
+                }
+                *port++        = 0;
+                servlist->ip   = strdup(token);
+                servlist->port = strdup(port);
+                i++; // The port was token 3
                 break;
+            }
             default:
+                if (token[0] == '#' || comment) {
+                    comment = 1;
+                } else if (strchr(token, '=')) {
+                    char *value = strchr(token, '=');
+                    *value++    = 0;
+                    parseSockopt(token, value, &servlist->sockopts);
+                } else if (i == 4) {
+                    char *end        = NULL;
+                    servlist->weight = strtod(token, &end);
+                    if (end == token || *end != 0) {
+                        servlist->weight = 0; // Warned about below
+                    }
+                }
                 break;
             }
             token = strtok(NULL, " ");
@@ -80,9 +360,26 @@ int parseConfig(char *path, serv_t servlist[]) {
             goto nextline;
         }
         // Fill out the rest of the serv_t values:
-        servlist->fd        = -1;
-        servlist->fd        = -1;
-        servlist->connected = 0;
+        servlist->fd          = -1;
+        servlist->connected   = 0;
+        servlist->cas         = 1;
+        servlist->ranges      = 1;
+        servlist->path        = NULL;
+        servlist->opens       = 0;
+        servlist->durable     = FTP_DURABLE_NONE;
+        servlist->free_bytes  = 0;
+        servlist->total_bytes = 0;
+        servlist->load        = 0;
+        if (strcmp(servlist->ip, "unix") == 0) {
+            // A server on this host, reached through a socket file
+            servlist->path  = servlist->port;
+            servlist->opens = 1;
+        }
+        if (servlist->weight <= 0) {
+            fprintf(stderr, "Warning: Invalid weight for %s, using 1\n",
+                    servlist->name);
+            servlist->weight = 1;
+        }
         if (old != NULL) {
             old->next = servlist;
         }
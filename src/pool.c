@@ -0,0 +1,99 @@
+/**
+ * @file pool.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Fixed size worker thread pool
+ * @version 0.1
+ * @date 2023-05-14
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "pool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static void *pool_worker(void *arg) {
+    pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->count == 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+        }
+        if (pool->count == 0 && pool->shutdown) {
+            break;
+        }
+        pool_job_t job = pool->queue[pool->head];
+        pool->head     = (pool->head + 1) % POOL_QUEUE_LEN;
+        pool->count--;
+        pool->active++;
+        // Wake a submitter that may be waiting for queue space
+        pthread_cond_broadcast(&pool->job_done);
+        pthread_mutex_unlock(&pool->lock);
+
+        job.fn(job.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+        pthread_cond_broadcast(&pool->job_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int pool_init(pool_t *pool, size_t num_threads) {
+    memset(pool, 0, sizeof(*pool));
+    if (num_threads == 0) {
+        long ncpu   = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = ncpu > 0 ? (size_t)ncpu : 1;
+    }
+    if (num_threads > POOL_MAX_THREADS) {
+        num_threads = POOL_MAX_THREADS;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+    for (size_t i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        pool->num_threads++;
+    }
+    return pool->num_threads ? 0 : -1;
+}
+
+void pool_submit(pool_t *pool, pool_fn_t fn, void *arg) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == POOL_QUEUE_LEN) {
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    }
+    size_t tail           = (pool->head + pool->count) % POOL_QUEUE_LEN;
+    pool->queue[tail].fn  = fn;
+    pool->queue[tail].arg = arg;
+    pool->count++;
+    pthread_cond_signal(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count || pool->active) {
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_cond_destroy(&pool->job_done);
+}
@@ -0,0 +1,69 @@
+/**
+ * @file pool.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Fixed size worker thread pool
+ * @details Jobs are plain function pointers with an argument. The submitter
+ * owns the argument memory and must keep it alive until pool_wait returns.
+ * @version 0.1
+ * @date 2023-05-14
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define POOL_MAX_THREADS 16
+#define POOL_QUEUE_LEN   256
+
+typedef void (*pool_fn_t)(void *arg);
+
+typedef struct {
+    pool_fn_t fn;
+    void     *arg;
+} pool_job_t;
+
+typedef struct {
+    pthread_t       threads[POOL_MAX_THREADS];
+    size_t          num_threads;
+    pool_job_t      queue[POOL_QUEUE_LEN];
+    size_t          head;
+    size_t          count;
+    size_t          active; // Jobs dequeued but not yet finished
+    int             shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t  job_ready;
+    pthread_cond_t  job_done;
+} pool_t;
+
+/**
+ * @brief Start a pool with num_threads workers
+ * @details num_threads == 0 selects one worker per online CPU. The count is
+ * capped at POOL_MAX_THREADS.
+ *
+ * @return int 0 on success, -1 if no thread could be started
+ */
+int pool_init(pool_t *pool, size_t num_threads);
+
+/**
+ * @brief Queue a job, blocking while the queue is full
+ *
+ */
+void pool_submit(pool_t *pool, pool_fn_t fn, void *arg);
+
+/**
+ * @brief Block until every submitted job has finished
+ *
+ */
+void pool_wait(pool_t *pool);
+
+/**
+ * @brief Finish outstanding jobs and join the workers
+ *
+ */
+void pool_destroy(pool_t *pool);
+
+#endif // POOL_H
@@ -0,0 +1,121 @@
+/**
+ * @file prefetch.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Read-ahead of chunks for consumers reading a file front to back
+ * @version 0.1
+ * @date 2023-05-19
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "prefetch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static prefetch_slot_t *prefetch_slot(prefetch_t *prefetch, size_t index) {
+    return &prefetch->slots[index % (prefetch->max_window + 1)];
+}
+
+/**
+ * @brief Pool job: fetch the chunk of a slot
+ */
+static void prefetch_job(void *arg) {
+    prefetch_slot_t *slot     = arg;
+    prefetch_t      *prefetch = slot->prefetch;
+    ftp_err_t        err =
+        prefetch->fetch(prefetch->arg, slot->index, &slot->msg);
+    pthread_mutex_lock(&prefetch->lock);
+    slot->err  = err;
+    slot->done = 1;
+    pthread_cond_broadcast(&prefetch->done);
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+/**
+ * @brief Request every chunk up to window chunks past index
+ * @details The slots reused hold chunks before index, which the consumer
+ * is done with.
+ */
+static void prefetch_fill(prefetch_t *prefetch, size_t index) {
+    size_t end = index + 1 + prefetch->window;
+    if (end > prefetch->count) {
+        end = prefetch->count;
+    }
+    for (; prefetch->next < end; prefetch->next++) {
+        prefetch_slot_t *slot = prefetch_slot(prefetch, prefetch->next);
+        slot->index           = prefetch->next;
+        slot->done            = 0;
+        pool_submit(&prefetch->pool, prefetch_job, slot);
+    }
+}
+
+int prefetch_init(prefetch_t *prefetch, prefetch_fn_t fetch, void *arg,
+                  size_t count, size_t max_window) {
+    memset(prefetch, 0, sizeof(*prefetch));
+    prefetch->fetch      = fetch;
+    prefetch->arg        = arg;
+    prefetch->count      = count;
+    prefetch->max_window = max_window;
+    prefetch->window =
+        max_window < PREFETCH_MIN_WINDOW ? max_window : PREFETCH_MIN_WINDOW;
+    prefetch->slots = calloc(max_window + 1, sizeof(prefetch_slot_t));
+    if (!prefetch->slots) {
+        return -1;
+    }
+    if (pool_init(&prefetch->pool, max_window ? max_window : 1) < 0) {
+        free(prefetch->slots);
+        return -1;
+    }
+    for (size_t i = 0; i <= max_window; i++) {
+        prefetch->slots[i].prefetch = prefetch;
+    }
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->done, NULL);
+    return 0;
+}
+
+ftp_err_t prefetch_get(prefetch_t *prefetch, size_t index, ftp_msg_t **msg) {
+    if (index != prefetch->expect) {
+        // Not the next chunk: drop what was fetched ahead. The first
+        // request may start anywhere.
+        pool_wait(&prefetch->pool);
+        if (prefetch->expect) {
+            prefetch->window = 0;
+        }
+        prefetch->next = index;
+    } else if (prefetch->window < PREFETCH_MIN_WINDOW) {
+        prefetch->window = prefetch->max_window < PREFETCH_MIN_WINDOW
+                               ? prefetch->max_window
+                               : PREFETCH_MIN_WINDOW;
+    }
+    prefetch_fill(prefetch, index);
+
+    prefetch_slot_t *slot = prefetch_slot(prefetch, index);
+    pthread_mutex_lock(&prefetch->lock);
+    int waited = !slot->done;
+    while (!slot->done) {
+        pthread_cond_wait(&prefetch->done, &prefetch->lock);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+
+    // Chunks arrive slower than they are consumed, have more in flight
+    if (waited && prefetch->window && prefetch->window < prefetch->max_window) {
+        prefetch->window *= 2;
+        if (prefetch->window > prefetch->max_window) {
+            prefetch->window = prefetch->max_window;
+        }
+        prefetch_fill(prefetch, index);
+    }
+    prefetch->expect = index + 1;
+    *msg             = &slot->msg;
+    return slot->err;
+}
+
+void prefetch_destroy(prefetch_t *prefetch) {
+    pool_wait(&prefetch->pool);
+    pool_destroy(&prefetch->pool);
+    pthread_cond_destroy(&prefetch->done);
+    pthread_mutex_destroy(&prefetch->lock);
+    free(prefetch->slots);
+}
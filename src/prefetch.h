@@ -0,0 +1,83 @@
+/**
+ * @file prefetch.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Read-ahead of chunks for consumers reading a file front to back
+ * @details A consumer asks for chunks by index. While it asks for each
+ * chunk after the previous one, the following chunks are fetched ahead of
+ * it by worker threads. The window starts at PREFETCH_MIN_WINDOW chunks
+ * and doubles every time the consumer has to wait for a chunk, up to the
+ * maximum given at setup, which also bounds the memory used (one packet
+ * per chunk of the window, plus the one being consumed). Any other access
+ * pattern drops the read-ahead and fetches only what is asked for until
+ * the consumer reads sequentially again.
+ * @version 0.1
+ * @date 2023-05-19
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "pool.h"
+#include "transfer.h"
+
+#define PREFETCH_MIN_WINDOW 1
+
+/**
+ * @brief Fetch chunk index into msg, called from the worker threads
+ *
+ */
+typedef ftp_err_t (*prefetch_fn_t)(void *arg, size_t index, ftp_msg_t *msg);
+
+typedef struct prefetch prefetch_t;
+
+typedef struct {
+    prefetch_t *prefetch;
+    size_t      index;
+    int         done; // The fetch finished, err is set
+    ftp_err_t   err;
+    ftp_msg_t   msg;
+} prefetch_slot_t;
+
+struct prefetch {
+    prefetch_fn_t    fetch;
+    void            *arg;
+    size_t           count;      // Chunks there are
+    size_t           max_window; // Chunks fetched ahead at most
+    size_t           window;     // Chunks fetched ahead now
+    size_t           next;       // Next chunk to request
+    size_t           expect;     // Chunk a sequential reader asks for next
+    prefetch_slot_t *slots;      // Chunk i waits in slot i % (max_window + 1)
+    pool_t           pool;
+    pthread_mutex_t  lock;
+    pthread_cond_t   done;
+};
+
+/**
+ * @brief Set up read-ahead over chunks [0, count)
+ * @details max_window == 0 fetches every chunk only when it is asked for.
+ *
+ * @return int 0 on success, -1 if memory or threads are short
+ */
+int prefetch_init(prefetch_t *prefetch, prefetch_fn_t fetch, void *arg,
+                  size_t count, size_t max_window);
+
+/**
+ * @brief Wait for chunk index, requesting the chunks after it
+ *
+ * @param msg Set to the chunk, valid until the next call
+ * @return ftp_err_t The error of fetch for this chunk
+ */
+ftp_err_t prefetch_get(prefetch_t *prefetch, size_t index, ftp_msg_t **msg);
+
+/**
+ * @brief Wait for the requests in flight and release the read-ahead
+ *
+ */
+void prefetch_destroy(prefetch_t *prefetch);
+
+#endif // PREFETCH_H
@@ -0,0 +1,99 @@
+/**
+ * @file ring.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Consistent hashing ring for chunk placement
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+static int ring_point_cmp(const void *a, const void *b) {
+    const ring_point_t *pa = a;
+    const ring_point_t *pb = b;
+    if (pa->point != pb->point) {
+        return pa->point < pb->point ? -1 : 1;
+    }
+    // Ties are astronomically rare, but must still order identically
+    return pa->node - pb->node;
+}
+
+void ring_init(ring_t *ring) {
+    ring->points    = NULL;
+    ring->count     = 0;
+    ring->num_nodes = 0;
+}
+
+int ring_add(ring_t *ring, const char *name, int node, size_t vnodes) {
+    ring_point_t *points =
+        realloc(ring->points, (ring->count + vnodes) * sizeof(ring_point_t));
+    if (!points) {
+        return -1;
+    }
+    ring->points = points;
+    for (size_t i = 0; i < vnodes; i++) {
+        char    label[256];
+        uint8_t digest[HASH_MAX_LEN];
+        int     len = snprintf(label, sizeof(label), "%s#%lu", name, i);
+        hash_buf(HASH_XXH64, label, len, digest);
+        ring->points[ring->count].point = ring_key(digest);
+        ring->points[ring->count].node  = node;
+        ring->count++;
+    }
+    if (node >= ring->num_nodes) {
+        ring->num_nodes = node + 1;
+    }
+    qsort(ring->points, ring->count, sizeof(ring_point_t), ring_point_cmp);
+    return 0;
+}
+
+size_t ring_lookup(const ring_t *ring, uint64_t key, int nodes[], size_t max) {
+    if (!ring->count) {
+        return 0;
+    }
+    // First point at or after key
+    size_t lo = 0;
+    size_t hi = ring->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].point < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t found = 0;
+    for (size_t i = 0; i < ring->count && found < max; i++) {
+        int    node = ring->points[(lo + i) % ring->count].node;
+        size_t j    = 0;
+        while (j < found && nodes[j] != node) {
+            j++;
+        }
+        if (j == found) {
+            nodes[found++] = node;
+        }
+    }
+    return found;
+}
+
+uint64_t ring_key(const uint8_t *digest) {
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++) {
+        key = (key << 8) | digest[i];
+    }
+    return key;
+}
+
+void ring_free(ring_t *ring) {
+    free(ring->points);
+    ring_init(ring);
+}
@@ -0,0 +1,80 @@
+/**
+ * @file ring.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Consistent hashing ring for chunk placement
+ * @details Every server owns a number of virtual nodes, points on a 64 bit
+ * ring derived from its name in dfc.conf. A chunk is stored on the first
+ * distinct servers found walking clockwise from its content digest. Adding
+ * or removing a server only moves the chunks between its points and their
+ * predecessors (about 1/N of the data), and a server that is briefly
+ * unreachable is skipped without changing the placement of any chunk it
+ * does not hold.
+ * @version 0.1
+ * @date 2023-05-16
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_VNODES 256 // Virtual nodes per server
+
+typedef struct {
+    uint64_t point;
+    int      node;
+} ring_point_t;
+
+typedef struct {
+    ring_point_t *points; // Sorted by point
+    size_t        count;
+    int           num_nodes; // Highest node index + 1
+} ring_t;
+
+/**
+ * @brief Start an empty ring
+ *
+ */
+void ring_init(ring_t *ring);
+
+/**
+ * @brief Add vnodes points for a server
+ * @details Points depend only on the name, so every client builds the same
+ * ring from the same dfc.conf regardless of server order or reachability.
+ *
+ * @param name Server name (serv_t::name)
+ * @param node Index the caller uses for this server, returned by lookups
+ * @param vnodes Number of virtual nodes
+ * @return int 0 on success, -1 on allocation failure
+ */
+int ring_add(ring_t *ring, const char *name, int node, size_t vnodes);
+
+/**
+ * @brief List distinct servers in placement order for a key
+ * @details The caller takes the first entries that are usable; with
+ * max >= num_nodes the list holds every server, so placement can fail over
+ * past unreachable ones deterministically.
+ *
+ * @param key Position on the ring, see ring_key
+ * @param nodes Output, node indices in preference order
+ * @param max Capacity of nodes
+ * @return size_t Number of nodes written
+ */
+size_t ring_lookup(const ring_t *ring, uint64_t key, int nodes[], size_t max);
+
+/**
+ * @brief Ring position of a content digest (its first 8 bytes)
+ *
+ */
+uint64_t ring_key(const uint8_t *digest);
+
+/**
+ * @brief Release the ring's memory
+ *
+ */
+void ring_free(ring_t *ring);
+
+#endif // RING_H
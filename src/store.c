@@ -0,0 +1,706 @@
+/**
+ * @file store.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Server side chunk storage for the DFS
+ * @version 0.1
+ * @date 2023-05-12
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#define _GNU_SOURCE // syncfs
+
+#include "store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "crc32c.h"
+#include "hotcache.h"
+
+static hotcache_t *store_cache = NULL; // Popular chunks, see store_cache_init
+static pthread_mutex_t store_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Group commit, see store_commit. Commits are numbered in the order they
+// are asked for; a flush covers every commit asked for before it started.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    uint64_t        asked;    // Commits asked for
+    uint64_t        flushed;  // Commits covered by a successful flush
+    uint64_t        failed;   // Commits covered by a failed flush, at most
+    int             flushing; // A caller is flushing for everyone
+} store_sync = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0,
+                0};
+
+/**
+ * @brief Forget the cached copy of a chunk that just changed
+ * @details Called after the rename, link or unlink: a store_get that read
+ * the old file before then is kept from caching it by hotcache_version.
+ */
+static void store_cache_forget(const char *root, const char *name) {
+    if (store_cache) {
+        char path[PATH_MAX] = {0};
+        snprintf(path, PATH_MAX, "%s/%s", root, name);
+        hotcache_remove(store_cache, path);
+    }
+}
+
+/**
+ * @brief Reject keys and chunk names that could escape their directory
+ */
+static int store_key_valid(const char *key) {
+    return key && *key && !strchr(key, '/') && key[0] != '.';
+}
+
+/**
+ * @brief Write the whole buffer to fd, retrying short writes
+ */
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = write(fd, buf + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read up to cap bytes from fd, retrying short reads
+ */
+static ssize_t read_all(int fd, uint8_t *buf, size_t cap) {
+    size_t total = 0;
+    while (total < cap) {
+        ssize_t n = read(fd, buf + total, cap - total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+/**
+ * @brief Write buf to path atomically (temporary file + rename)
+ *
+ * @param crc_path If not NULL, the checksum is attached to the temporary
+ * file as STORE_CRC_XATTR, or written to crc_path first where the file
+ * system has no user attributes
+ */
+static store_err_t store_write_file(const char *path, const uint8_t *buf,
+                                    size_t len, uint32_t crc,
+                                    const char *crc_path) {
+    char tmp[PATH_MAX] = {0};
+    // Unique per call, workers may store the same .cas key at once
+    snprintf(tmp, PATH_MAX, "%s.XXXXXX.part", path);
+    int fd = mkstemps(tmp, 5);
+    if (fd < 0) {
+        perror("mkstemps");
+        return STORE_ERR_IO;
+    }
+    fchmod(fd, 0644); // mkstemps creates 0600
+    if (write_all(fd, buf, len) < 0) {
+        perror("write");
+        close(fd);
+        remove(tmp);
+        return STORE_ERR_IO;
+    }
+    char crc_str[16] = {0};
+    int  crc_len     = snprintf(crc_str, sizeof(crc_str), "%08X\n", crc);
+    int  tagged      = crc_path && fsetxattr(fd, STORE_CRC_XATTR, crc_str,
+                                             crc_len, 0) == 0;
+    close(fd);
+    if (crc_path && !tagged) {
+        store_err_t err =
+            store_write_file(crc_path, (uint8_t *)crc_str, crc_len, 0, NULL);
+        if (err != STORE_ERR_NONE) {
+            remove(tmp);
+            return err;
+        }
+    }
+    if (rename(tmp, path) < 0) {
+        perror("rename");
+        remove(tmp);
+        return STORE_ERR_IO;
+    }
+    if (tagged) {
+        unlink(crc_path); // Left by an earlier version of the chunk
+    }
+    return STORE_ERR_NONE;
+}
+
+/**
+ * @brief Read the checksum recorded for the chunk open at fd
+ *
+ * @return int 1 if one was recorded, 0 for a legacy chunk without one, -1
+ * if it cannot be read
+ */
+static int store_crc_load(int fd, const char *root, const char *name,
+                          uint32_t *crc) {
+    char         str[16] = {0};
+    unsigned int stored  = 0;
+    ssize_t      n = fgetxattr(fd, STORE_CRC_XATTR, str, sizeof(str) - 1);
+    if (n > 0) {
+        if (sscanf(str, "%X", &stored) != 1) {
+            return -1;
+        }
+        *crc = stored;
+        return 1;
+    }
+    char path[PATH_MAX] = {0};
+    snprintf(path, PATH_MAX, "%s/%s/%s", root, STORE_CRC_DIR, name);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    int ok = fscanf(fp, "%X", &stored) == 1;
+    fclose(fp);
+    if (!ok) {
+        return -1;
+    }
+    *crc = stored;
+    return 1;
+}
+
+/**
+ * @brief Hard link src to a new temporary name beside dst
+ * @details The name ends in ".part" like store_write_file's, so LIST and
+ * store_sweep skip it until it is renamed over dst.
+ *
+ * @param tmp Output, the temporary name (PATH_MAX)
+ * @return STORE_ERR_NOENT if src does not exist
+ */
+static store_err_t store_link_tmp(const char *src, const char *dst,
+                                  char *tmp) {
+    // Unique among the links in progress, each thread makes one at a time
+    snprintf(tmp, PATH_MAX, "%s.%d-%lX.part", dst, getpid(),
+             (unsigned long)pthread_self());
+    int rv = link(src, tmp);
+    if (rv < 0 && errno == EEXIST) {
+        unlink(tmp); // Left behind by a crash
+        rv = link(src, tmp);
+    }
+    if (rv < 0) {
+        if (errno == ENOENT) {
+            return STORE_ERR_NOENT;
+        }
+        perror("link");
+        return STORE_ERR_IO;
+    }
+    return STORE_ERR_NONE;
+}
+
+/**
+ * @brief Open the change log for appending, starting a new epoch if it is
+ * missing or too long. Called with store_log_lock held.
+ *
+ * @param epoch Output, the log's epoch
+ * @return int Open descriptor, -1 on error
+ */
+static int store_log_open(const char *root, char epoch[STORE_EPOCH_LEN]) {
+    char path[PATH_MAX] = {0};
+    snprintf(path, PATH_MAX, "%s/%s", root, STORE_LOG);
+    int fd = open(path, O_RDWR | O_APPEND);
+    if (fd >= 0) {
+        struct stat st;
+        char        header[STORE_EPOCH_LEN + 8] = {0};
+        if (fstat(fd, &st) == 0 && st.st_size < STORE_LOG_MAX &&
+            pread(fd, header, sizeof(header) - 1, 0) > 0 &&
+            sscanf(header, "epoch %16s", epoch) == 1) {
+            return fd;
+        }
+        close(fd);
+        unlink(path);
+    }
+    fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+    snprintf(epoch, STORE_EPOCH_LEN, "%08lX%08X",
+             (unsigned long)time(NULL) & 0xFFFFFFFF,
+             (unsigned int)(getpid() ^ rand()));
+    char header[STORE_EPOCH_LEN + 8] = {0};
+    int  len = snprintf(header, sizeof(header), "epoch %s\n", epoch);
+    if (write_all(fd, (uint8_t *)header, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Record that name was added ('+') or removed ('-')
+ */
+static void store_log(const char *root, char op, const char *name) {
+    if (name[0] == '.') {
+        return; // Bookkeeping, not visible to LIST
+    }
+    char    line[NAME_MAX + 8] = {0};
+    int     len = snprintf(line, sizeof(line), "%c %s\n", op, name);
+    char    epoch[STORE_EPOCH_LEN];
+    pthread_mutex_lock(&store_log_lock);
+    int fd = store_log_open(root, epoch);
+    if (fd >= 0) {
+        write_all(fd, (uint8_t *)line, len);
+        close(fd);
+    }
+    pthread_mutex_unlock(&store_log_lock);
+}
+
+void store_cache_init(size_t bytes) {
+    if (!bytes || store_cache) {
+        return;
+    }
+    if (bytes < HOTCACHE_MIN_BYTES(FTP_PACKET_SIZE)) {
+        fprintf(stderr,
+                "[WARN]\tHot chunk cache of %lu bytes only holds chunks up "
+                "to %lu bytes\n",
+                bytes, bytes / HOTCACHE_MIN_BYTES(1));
+    }
+    store_cache = malloc(sizeof(hotcache_t));
+    if (store_cache) {
+        hotcache_init(store_cache, bytes);
+    }
+}
+
+/**
+ * @brief store_put for names already checked, including .cas/<key>
+ */
+static store_err_t store_put_name(const char *root, const char *name,
+                                  const uint8_t *buf, size_t len,
+                                  uint32_t crc) {
+    char path[PATH_MAX]     = {0};
+    char crc_path[PATH_MAX] = {0};
+
+    // Used where the checksum cannot be attached to the chunk
+    snprintf(crc_path, PATH_MAX, "%s/%s", root, STORE_CRC_DIR);
+    mkdir(crc_path, 0777);
+    snprintf(crc_path, PATH_MAX, "%s/%s/%s", root, STORE_CRC_DIR,
+             STORE_CAS_DIR);
+    mkdir(crc_path, 0777);
+    snprintf(crc_path, PATH_MAX, "%s/%s/%s", root, STORE_CRC_DIR, name);
+
+    snprintf(path, PATH_MAX, "%s/%s", root, name);
+    store_err_t err = store_write_file(path, buf, len, crc, crc_path);
+    store_cache_forget(root, name);
+    if (err == STORE_ERR_NONE) {
+        store_log(root, '+', name);
+    }
+    return err;
+}
+
+/**
+ * @brief Flush the file system holding root, data and metadata alike
+ */
+static int store_flush(const char *root) {
+    int fd = open(root, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    int rv = syncfs(fd);
+    if (rv < 0) {
+        perror("syncfs");
+    }
+    close(fd);
+    return rv;
+}
+
+store_err_t store_commit(const char *root) {
+    if (!root) {
+        return STORE_ERR_ARGS;
+    }
+    pthread_mutex_lock(&store_sync.lock);
+    uint64_t ticket = ++store_sync.asked;
+    while (store_sync.flushed < ticket && store_sync.failed < ticket) {
+        if (store_sync.flushing) {
+            pthread_cond_wait(&store_sync.done, &store_sync.lock);
+            continue;
+        }
+        // Flush for every commit asked for so far, ours included
+        uint64_t upto       = store_sync.asked;
+        store_sync.flushing = 1;
+        pthread_mutex_unlock(&store_sync.lock);
+        int rv = store_flush(root);
+        pthread_mutex_lock(&store_sync.lock);
+        store_sync.flushing = 0;
+        if (rv == 0) {
+            store_sync.flushed = upto;
+        } else {
+            store_sync.failed = upto;
+        }
+        pthread_cond_broadcast(&store_sync.done);
+    }
+    // A later failed flush may hide that ours succeeded, err on the safe side
+    store_err_t err =
+        store_sync.failed >= ticket ? STORE_ERR_IO : STORE_ERR_NONE;
+    pthread_mutex_unlock(&store_sync.lock);
+    return err;
+}
+
+store_err_t store_put(const char *root, const char *name, const uint8_t *buf,
+                      size_t len, uint32_t crc) {
+    if (!root || !store_key_valid(name) || (!buf && len)) {
+        return STORE_ERR_ARGS;
+    }
+    return store_put_name(root, name, buf, len, crc);
+}
+
+store_err_t store_get(const char *root, const char *name, uint8_t *buf,
+                      size_t cap, size_t *len, uint32_t *crc) {
+    if (!root || !store_key_valid(name) || !buf || !len || !crc) {
+        return STORE_ERR_ARGS;
+    }
+    char     path[PATH_MAX] = {0};
+    uint64_t version        = 0;
+    snprintf(path, PATH_MAX, "%s/%s", root, name);
+    if (store_cache) {
+        if (hotcache_get(store_cache, path, buf, cap, len, crc) == 0) {
+            return STORE_ERR_NONE; // Verified when it was read from disk
+        }
+        version = hotcache_version(store_cache, path);
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? STORE_ERR_NOENT : STORE_ERR_IO;
+    }
+    ssize_t  n        = read_all(fd, buf, cap);
+    uint32_t stored   = 0;
+    int      recorded = n < 0 ? 0 : store_crc_load(fd, root, name, &stored);
+    close(fd);
+    if (n < 0) {
+        perror("read");
+        return STORE_ERR_IO;
+    }
+    *len = n;
+
+    uint32_t actual = crc32c(0, buf, n);
+    if (recorded < 0 || (recorded && stored != actual)) {
+        fprintf(stderr, "[WARN]\tChunk failed checksum: %s (%08X != %08X)\n",
+                name, actual, stored);
+        return STORE_ERR_CORRUPT;
+    }
+    *crc = actual; // Legacy chunks have none recorded
+
+    if (store_cache) {
+        snprintf(path, PATH_MAX, "%s/%s", root, name);
+        hotcache_put(store_cache, path, buf, n, *crc, version);
+    }
+    return STORE_ERR_NONE;
+}
+
+store_err_t store_get_range(const char *root, const char *name, size_t offset,
+                            size_t length, uint8_t *buf, size_t cap,
+                            size_t *len, uint32_t *crc) {
+    store_err_t err = store_get(root, name, buf, cap, len, crc);
+    if (err != STORE_ERR_NONE) {
+        return err;
+    }
+    if (offset > *len) {
+        offset = *len;
+    }
+    if (length > *len - offset) {
+        length = *len - offset;
+    }
+    memmove(buf, buf + offset, length);
+    *len = length;
+    *crc = crc32c(0, buf, length);
+    return STORE_ERR_NONE;
+}
+
+store_err_t store_open(const char *root, const char *name, int *fd,
+                       size_t *len, uint32_t *crc) {
+    if (!root || !store_key_valid(name) || !fd || !len || !crc) {
+        return STORE_ERR_ARGS;
+    }
+    char path[PATH_MAX] = {0};
+    snprintf(path, PATH_MAX, "%s/%s", root, name);
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0) {
+        return errno == ENOENT ? STORE_ERR_NOENT : STORE_ERR_IO;
+    }
+    struct stat st;
+    if (fstat(*fd, &st) < 0) {
+        close(*fd);
+        return STORE_ERR_IO;
+    }
+    *len = st.st_size;
+
+    if (store_crc_load(*fd, root, name, crc) > 0) {
+        return STORE_ERR_NONE;
+    }
+    // Legacy chunk without a recorded checksum
+    uint8_t *buf = malloc(*len ? *len : 1);
+    ssize_t  n   = buf ? pread(*fd, buf, *len, 0) : -1;
+    if (n != (ssize_t)*len) {
+        free(buf);
+        close(*fd);
+        return STORE_ERR_IO;
+    }
+    *crc = crc32c(0, buf, n);
+    free(buf);
+    return STORE_ERR_NONE;
+}
+
+store_err_t store_have(const char *root, const char *key) {
+    if (!root || !store_key_valid(key)) {
+        return STORE_ERR_ARGS;
+    }
+    char path[PATH_MAX] = {0};
+    snprintf(path, PATH_MAX, "%s/%s/%s", root, STORE_CAS_DIR, key);
+    return access(path, F_OK) == 0 ? STORE_ERR_NONE : STORE_ERR_NOENT;
+}
+
+store_err_t store_put_cas(const char *root, const char *name, const char *key,
+                          const uint8_t *buf, size_t len, uint32_t crc) {
+    if (!root || !store_key_valid(name) || !store_key_valid(key) ||
+        (!buf && len)) {
+        return STORE_ERR_ARGS;
+    }
+    if (store_have(root, key) != STORE_ERR_NONE) {
+        // The content lives in .cas/<key>, its crc in .crc/<key>
+        char cas_dir[PATH_MAX] = {0};
+        snprintf(cas_dir, PATH_MAX, "%s/%s", root, STORE_CAS_DIR);
+        mkdir(cas_dir, 0777);
+        char cas_name[PATH_MAX] = {0};
+        snprintf(cas_name, PATH_MAX, "%s/%s", STORE_CAS_DIR, key);
+        store_err_t err = store_put_name(root, cas_name, buf, len, crc);
+        if (err != STORE_ERR_NONE) {
+            return err;
+        }
+    }
+    return store_link(root, name, key);
+}
+
+store_err_t store_link(const char *root, const char *name, const char *key) {
+    if (!root || !store_key_valid(name) || !store_key_valid(key)) {
+        return STORE_ERR_ARGS;
+    }
+    char src[PATH_MAX]     = {0};
+    char dst[PATH_MAX]     = {0};
+    char crc_src[PATH_MAX] = {0};
+    char crc_dst[PATH_MAX] = {0};
+    char tmp[PATH_MAX]     = {0};
+    char crc_tmp[PATH_MAX] = {0};
+    snprintf(src, PATH_MAX, "%s/%s/%s", root, STORE_CAS_DIR, key);
+    snprintf(dst, PATH_MAX, "%s/%s", root, name);
+    snprintf(crc_src, PATH_MAX, "%s/%s/%s/%s", root, STORE_CRC_DIR,
+             STORE_CAS_DIR, key);
+    snprintf(crc_dst, PATH_MAX, "%s/%s/%s", root, STORE_CRC_DIR, name);
+
+    // Link both under temporary names first, so missing content leaves
+    // whatever is stored under name untouched. The link shares the
+    // content's STORE_CRC_XATTR; only content stored without one has a
+    // checksum file to link.
+    store_err_t err = store_link_tmp(src, dst, tmp);
+    if (err != STORE_ERR_NONE) {
+        return err;
+    }
+    err = store_link_tmp(crc_src, crc_dst, crc_tmp);
+    if (err == STORE_ERR_IO) {
+        unlink(tmp);
+        return err;
+    }
+    // Checksum first so the chunk never appears without one
+    if (err == STORE_ERR_NONE && rename(crc_tmp, crc_dst) < 0) {
+        perror("rename");
+        unlink(crc_tmp);
+        unlink(tmp);
+        return STORE_ERR_IO;
+    }
+    if (err == STORE_ERR_NOENT) {
+        unlink(crc_dst); // Left by the chunk being replaced
+    }
+    if (rename(tmp, dst) < 0) {
+        perror("rename");
+        unlink(tmp);
+        return STORE_ERR_IO;
+    }
+    store_cache_forget(root, name);
+    store_log(root, '+', name);
+    return STORE_ERR_NONE;
+}
+
+store_err_t store_delete(const char *root, const char *name,
+                         uint64_t *reclaimed) {
+    if (!root || !store_key_valid(name) || !reclaimed) {
+        return STORE_ERR_ARGS;
+    }
+    char        path[PATH_MAX] = {0};
+    struct stat st;
+    snprintf(path, PATH_MAX, "%s/%s", root, name);
+    if (lstat(path, &st) < 0) {
+        return errno == ENOENT ? STORE_ERR_NOENT : STORE_ERR_IO;
+    }
+    if (unlink(path) < 0) {
+        perror("unlink");
+        return STORE_ERR_IO;
+    }
+    store_cache_forget(root, name);
+    if (st.st_nlink == 1) {
+        *reclaimed += st.st_size;
+    }
+    snprintf(path, PATH_MAX, "%s/%s/%s", root, STORE_CRC_DIR, name);
+    unlink(path);
+    store_log(root, '-', name);
+    return STORE_ERR_NONE;
+}
+
+store_err_t store_sweep(const char *root, uint64_t *reclaimed) {
+    if (!root || !reclaimed) {
+        return STORE_ERR_ARGS;
+    }
+    char cas_dir[PATH_MAX] = {0};
+    snprintf(cas_dir, PATH_MAX, "%s/%s", root, STORE_CAS_DIR);
+    DIR *dir = opendir(cas_dir);
+    if (!dir) {
+        return errno == ENOENT ? STORE_ERR_NONE : STORE_ERR_IO;
+    }
+    time_t         now = time(NULL);
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        // Keys have no dots, which also skips ".", ".." and partial writes
+        if (strchr(ent->d_name, '.')) {
+            continue;
+        }
+        char        path[PATH_MAX] = {0};
+        struct stat st;
+        snprintf(path, PATH_MAX, "%s/%s/%s", root, STORE_CAS_DIR,
+                 ent->d_name);
+        // Linking or unlinking a name updates ctime
+        if (lstat(path, &st) < 0 || st.st_nlink > 1 ||
+            now - st.st_ctime < STORE_SWEEP_GRACE) {
+            continue;
+        }
+        if (unlink(path) == 0) {
+            *reclaimed += st.st_size;
+        }
+        snprintf(path, PATH_MAX, "%s/%s/%s/%s", root, STORE_CRC_DIR,
+                 STORE_CAS_DIR, ent->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    return STORE_ERR_NONE;
+}
+
+store_err_t store_list(const char *root, const char *epoch, uint64_t seq,
+                       FILE *out) {
+    if (!root || !out) {
+        return STORE_ERR_ARGS;
+    }
+    // The log length is taken first, anything changed later is repeated
+    // in the next reply
+    char        current[STORE_EPOCH_LEN] = {0};
+    struct stat st;
+    pthread_mutex_lock(&store_log_lock);
+    int fd = store_log_open(root, current);
+    pthread_mutex_unlock(&store_log_lock);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return STORE_ERR_IO;
+    }
+    uint64_t end = st.st_size;
+
+    if (epoch && strcmp(epoch, current) == 0 && seq <= end) {
+        fprintf(out, "changes %s %" PRIu64 "\n", current, end);
+        uint8_t buf[4096];
+        while (seq < end) {
+            size_t  want = end - seq < sizeof(buf) ? end - seq : sizeof(buf);
+            ssize_t n    = pread(fd, buf, want, seq);
+            if (n <= 0) {
+                close(fd);
+                return STORE_ERR_IO;
+            }
+            fwrite(buf, 1, n, out);
+            seq += n;
+        }
+        close(fd);
+        return STORE_ERR_NONE;
+    }
+    close(fd);
+
+    DIR *dir = opendir(root);
+    if (!dir) {
+        return STORE_ERR_IO;
+    }
+    fprintf(out, "snapshot %s %" PRIu64 "\n", current, end);
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        // Partial writes end in ".part", bookkeeping starts with '.'
+        size_t len = strlen(ent->d_name);
+        if (ent->d_name[0] == '.' ||
+            (len > 5 && strcmp(ent->d_name + len - 5, ".part") == 0)) {
+            continue;
+        }
+        fprintf(out, "%s\n", ent->d_name);
+    }
+    closedir(dir);
+    return STORE_ERR_NONE;
+}
+
+store_err_t store_stat(const char *root, store_stat_t *stat) {
+    struct statvfs vfs;
+    if (!root || !stat) {
+        return STORE_ERR_ARGS;
+    }
+    if (statvfs(root, &vfs) < 0) {
+        return STORE_ERR_IO;
+    }
+    stat->free_bytes  = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+    stat->total_bytes = (uint64_t)vfs.f_blocks * vfs.f_frsize;
+
+    double avg  = 0;
+    long   cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    getloadavg(&avg, 1);
+    stat->load = avg / (cpus > 0 ? cpus : 1);
+    return STORE_ERR_NONE;
+}
+
+int store_stat_format(const store_stat_t *stat, char *buf, size_t cap) {
+    // Every store can commit, see store_commit
+    return snprintf(buf, cap,
+                    "free: %" PRIu64 "\ntotal: %" PRIu64
+                    "\nload: %.2f\ndurable: sync\n",
+                    stat->free_bytes, stat->total_bytes, stat->load);
+}
+
+const char *store_err_to_str(store_err_t err) {
+    switch (err) {
+    case STORE_ERR_NONE:
+        return "NONE";
+    case STORE_ERR_ARGS:
+        return "ARGS";
+    case STORE_ERR_IO:
+        return "IO";
+    case STORE_ERR_NOENT:
+        return "NOENT";
+    case STORE_ERR_CORRUPT:
+        return "CORRUPT";
+    default:
+        return "UNKNOWN";
+    }
+}
@@ -0,0 +1,245 @@
+/**
+ * @file store.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Server side chunk storage for the DFS
+ * @details The dfs server keeps every chunk as a plain file named after the
+ * chunk (so that `ls -l` remains the LIST response), plus bookkeeping in
+ * hidden subdirectories of the server root which LIST does not show:
+ *      <root>/<chunk_name>         chunk payload
+ *      <root>/.cas/<key>           deduplicated content, keyed by digest
+ *      <root>/.changes             log of names added and removed
+ * The CRC32C of a payload (8 hex digits) is kept in the file's
+ * STORE_CRC_XATTR attribute, so the rename that publishes a chunk
+ * publishes its checksum too. On file systems without user attributes it
+ * is kept beside the chunk instead, written before the chunk is renamed:
+ *      <root>/.crc/<chunk_name>    CRC32C of the payload
+ *      <root>/.crc/.cas/<key>      CRC32C of the deduplicated content
+ * Chunk names that refer to deduplicated content are hard links to the
+ * .cas entry, so identical chunks occupy disk space once and a chunk file
+ * is removed like any other. Names and keys given to any of the functions
+ * below must not contain '/' or start with '.', so a request can never
+ * reach outside root or into the bookkeeping; others get STORE_ERR_ARGS.
+ * @version 0.1
+ * @date 2023-05-12
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define STORE_CRC_XATTR   "user.crc32c"
+#define STORE_CRC_DIR     ".crc"
+#define STORE_CAS_DIR     ".cas"
+#define STORE_SWEEP_GRACE 60 // Seconds unreferenced content is kept for
+#define STORE_LOG         ".changes"
+#define STORE_LOG_MAX     (4 << 20) // Bytes before the log starts over
+#define STORE_EPOCH_LEN   17        // Hex digits + NUL
+
+typedef struct {
+    uint64_t free_bytes;  // Available to the server process
+    uint64_t total_bytes; // Size of the file system holding root
+    double   load;        // 1 minute load average per online CPU
+} store_stat_t;
+
+typedef enum {
+    STORE_ERR_NONE,
+    STORE_ERR_ARGS,
+    STORE_ERR_IO,
+    STORE_ERR_NOENT,
+    STORE_ERR_CORRUPT,
+} store_err_t;
+
+/**
+ * @brief Keep up to bytes of recently read chunks in memory
+ * @details Called once at server start up, before any worker thread; with
+ * bytes == 0 (or without a call) every read goes to disk. store_get serves
+ * cached chunks without touching the file system, writes and deletes
+ * through this module keep the cache consistent. See hotcache.h.
+ *
+ * A chunk is only cached if it fits a quarter of one of the
+ * HOTCACHE_SHARDS shards, so full chunks (FTP_PACKET_SIZE) need at least
+ * HOTCACHE_MIN_BYTES(FTP_PACKET_SIZE), 4 MiB; a smaller cache only holds
+ * the short last chunks of files, and a warning says so.
+ */
+void store_cache_init(size_t bytes);
+
+/**
+ * @brief Write a chunk and its checksum to the store
+ * @details The payload is written to a temporary file and renamed into place
+ * so a reader never observes a partially written chunk. The crc is the one
+ * received with the FTP_CMD_DATA packet, which ftp_recv_msg has already
+ * verified against the payload. On return the chunk is in the file system
+ * cache (FTP_DURABLE_BUFFERED), see store_commit for FTP_DURABLE_SYNC.
+ *
+ * @param root Server root directory
+ * @param name Chunk name (filename.stime.client_id.num_chunks.chunk_id)
+ * @param buf Chunk payload
+ * @param len Length of buf
+ * @param crc CRC32C of buf
+ * @return store_err_t
+ */
+store_err_t store_put(const char *root, const char *name, const uint8_t *buf,
+                      size_t len, uint32_t crc);
+
+/**
+ * @brief Wait until everything stored so far is on stable storage
+ * @details For PUT and LINK with "durable=sync", called after the write
+ * and before the answer. Calls from concurrent workers are grouped: the
+ * first caller flushes the whole file system holding root (syncfs) while
+ * later ones wait and are covered by that flush if their write finished
+ * before it started, otherwise by the next one, which a single caller
+ * runs for all of them. Under load every flush therefore makes many
+ * chunks durable at once. Meant for a server with one root.
+ *
+ * @return STORE_ERR_IO if the flush covering this call (or, rarely, a later
+ * one) failed; the chunk must then not be acknowledged as durable
+ */
+store_err_t store_commit(const char *root);
+
+/**
+ * @brief Read a chunk and verify it against its stored checksum
+ * @details On success *crc holds the stored checksum, which the server
+ * passes to ftp_send_msg_crc so the client verifies the chunk end to end.
+ * Chunks written before checksums existed have their crc computed on read.
+ *
+ * @param root Server root directory
+ * @param name Chunk name
+ * @param buf Output buffer
+ * @param cap Capacity of buf
+ * @param len Set to the number of bytes read
+ * @param crc Set to the stored crc
+ * @return STORE_ERR_CORRUPT if the payload does not match the stored crc, in
+ * which case the server should answer FTP_CMD_ERROR so the client fails over
+ * to another replica.
+ */
+store_err_t store_get(const char *root, const char *name, uint8_t *buf,
+                      size_t cap, size_t *len, uint32_t *crc);
+
+/**
+ * @brief Read part of a chunk for "GET <name> <offset> <length>"
+ * @details The whole chunk is verified against its stored checksum first,
+ * then the requested bytes are moved to the start of buf and *crc is
+ * recomputed over them. A range past the end of the chunk is cut short.
+ *
+ * @param buf Output buffer, must hold the whole chunk
+ * @return store_err_t As store_get
+ */
+store_err_t store_get_range(const char *root, const char *name, size_t offset,
+                            size_t length, uint8_t *buf, size_t cap,
+                            size_t *len, uint32_t *crc);
+
+/**
+ * @brief Open a chunk for FTP_CMD_OPEN, which hands the descriptor to a
+ * client on the same host
+ * @details The client reads and verifies the chunk itself, so only the
+ * stored checksum is looked up here (computed for legacy chunks without
+ * one). The caller closes *fd.
+ *
+ * @param fd Set to a read only descriptor of the chunk file
+ * @param len Set to the chunk length
+ * @param crc Set to the stored crc
+ * @return store_err_t
+ */
+store_err_t store_open(const char *root, const char *name, int *fd,
+                       size_t *len, uint32_t *crc);
+
+/**
+ * @brief Check whether content with the given key is stored (FTP_CMD_HAVE)
+ *
+ * @param key Content key as produced by hash_to_key
+ * @return STORE_ERR_NONE if present, STORE_ERR_NOENT otherwise
+ */
+store_err_t store_have(const char *root, const char *key);
+
+/**
+ * @brief Store a chunk under its content key and link name to it
+ * @details Used for "PUT <name> <key>". If the content is already present
+ * only the link is created.
+ *
+ * @return store_err_t
+ */
+store_err_t store_put_cas(const char *root, const char *name, const char *key,
+                          const uint8_t *buf, size_t len, uint32_t crc);
+
+/**
+ * @brief Make name refer to already stored content (FTP_CMD_LINK)
+ * @details The content and its checksum are linked under temporary names
+ * and renamed over name, so a reader sees either the old chunk or the new.
+ *
+ * @return STORE_ERR_NOENT if no content is stored under key (for instance
+ * swept since HAVE), in which case a chunk stored under name is kept
+ */
+store_err_t store_link(const char *root, const char *name, const char *key);
+
+/**
+ * @brief Remove a chunk or manifest and its checksum (FTP_CMD_DELETE)
+ * @details Content shared through .cas stays until store_sweep finds that
+ * no chunk name links to it any more.
+ *
+ * @param reclaimed Incremented by the number of bytes freed
+ * @return STORE_ERR_NOENT if name is not stored
+ */
+store_err_t store_delete(const char *root, const char *name,
+                         uint64_t *reclaimed);
+
+/**
+ * @brief Remove deduplicated content that no chunk name links to
+ * @details Meant to run after a batch of deletes. Content that lost its
+ * last name less than STORE_SWEEP_GRACE seconds ago is kept, so a client
+ * that was just told HAVE can still LINK it.
+ *
+ * @param reclaimed Incremented by the number of bytes freed
+ * @return store_err_t
+ */
+store_err_t store_sweep(const char *root, uint64_t *reclaimed);
+
+/**
+ * @brief Write the reply to "LIST [<epoch> <seq>]" to out
+ * @details Every name stored, linked or deleted through this module is
+ * appended to the change log as "+ <name>" or "- <name>"; the sequence
+ * number is the log's length and the epoch identifies the log, which
+ * starts over under a new epoch when it exceeds STORE_LOG_MAX. If epoch
+ * matches and seq is within the log, the reply is
+ *      changes <epoch> <seq>\n
+ * followed by the log entries after the given seq, otherwise
+ *      snapshot <epoch> <seq>\n
+ * followed by every stored name, one per line. The sequence number in the
+ * header is what the client sends next time. Names changed while a
+ * snapshot is taken appear again in the next changes reply, applying them
+ * twice is harmless.
+ *
+ * @param epoch Epoch the client last saw, NULL or "" for a snapshot
+ * @return store_err_t
+ */
+store_err_t store_list(const char *root, const char *epoch, uint64_t seq,
+                       FILE *out);
+
+/**
+ * @brief Report capacity and load for FTP_CMD_STAT
+ *
+ * @return STORE_ERR_IO if the file system cannot be queried
+ */
+store_err_t store_stat(const char *root, store_stat_t *stat);
+
+/**
+ * @brief Format a STAT reply as "free: <n>\ntotal: <n>\nload: <f>\n"
+ * followed by "durable: sync\n"
+ * @details The last line tells clients the server answers PUT and LINK
+ * with "durable=<level>" up to sync; they leave the token off otherwise.
+ *
+ * @return int Length written (snprintf semantics)
+ */
+int store_stat_format(const store_stat_t *stat, char *buf, size_t cap);
+
+/**
+ * @brief Return a string representation of the store_err_t
+ *
+ */
+const char *store_err_to_str(store_err_t err);
+
+#endif // STORE_H
@@ -0,0 +1,51 @@
+/**
+ * @file throttle.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Token bucket bandwidth limiter shared between threads
+ * @version 0.1
+ * @date 2023-05-17
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#include "throttle.h"
+
+void throttle_init(throttle_t *throttle, double rate) {
+    throttle->rate   = rate;
+    throttle->tokens = rate;
+    clock_gettime(CLOCK_MONOTONIC, &throttle->last);
+    pthread_mutex_init(&throttle->lock, NULL);
+}
+
+void throttle_take(throttle_t *throttle, size_t bytes) {
+    if (throttle->rate <= 0) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&throttle->lock);
+    double elapsed = (now.tv_sec - throttle->last.tv_sec) +
+                     (now.tv_nsec - throttle->last.tv_nsec) / 1e9;
+    throttle->last = now;
+    throttle->tokens += elapsed * throttle->rate;
+    if (throttle->tokens > throttle->rate) {
+        throttle->tokens = throttle->rate; // At most one second of burst
+    }
+    throttle->tokens -= bytes;
+    double debt = throttle->tokens < 0 ? -throttle->tokens : 0;
+    pthread_mutex_unlock(&throttle->lock);
+
+    if (debt > 0) {
+        double          wait = debt / throttle->rate;
+        struct timespec ts   = {
+              .tv_sec  = (time_t)wait,
+              .tv_nsec = (long)((wait - (time_t)wait) * 1e9),
+        };
+        nanosleep(&ts, NULL);
+    }
+}
+
+void throttle_destroy(throttle_t *throttle) {
+    pthread_mutex_destroy(&throttle->lock);
+}
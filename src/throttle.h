@@ -0,0 +1,47 @@
+/**
+ * @file throttle.h
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Token bucket bandwidth limiter shared between threads
+ * @details Callers take tokens for the bytes they are about to send and
+ * sleep off any debt outside the lock, so concurrent senders queue up
+ * behind each other and the combined rate stays at the limit. Up to one
+ * second of unused rate may be spent as a burst.
+ * @version 0.1
+ * @date 2023-05-17
+ *
+ * @copyright Copyright (c) 2023
+ */
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+typedef struct {
+    double          rate;   // Bytes per second, 0 for unlimited
+    double          tokens; // Negative while senders are in debt
+    struct timespec last;   // Last refill
+    pthread_mutex_t lock;
+} throttle_t;
+
+/**
+ * @brief Set up a limiter for rate bytes per second (0 = unlimited)
+ *
+ */
+void throttle_init(throttle_t *throttle, double rate);
+
+/**
+ * @brief Account for bytes, sleeping until they fit the rate
+ *
+ */
+void throttle_take(throttle_t *throttle, size_t bytes);
+
+/**
+ * @brief Release the limiter
+ *
+ */
+void throttle_destroy(throttle_t *throttle);
+
+#endif // THROTTLE_H
@@ -10,16 +10,25 @@
 
 #include "transfer.h"
 
+#include "crc32c.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 
+static compress_codec_t ftp_codecs[FTP_MAX_FDS]   = {0};
+static int              ftp_timeouts[FTP_MAX_FDS] = {0}; // ms, 0 = TIMEOUT_MS
+
 /* For Reference:
 
 #define FTP_CMD_GET    ((uint8_t)0x01)
@@ -151,16 +160,147 @@ ftp_err_t ftp_recv_data(int infd, int outfd) {
  * bit)
  */
 ftp_err_t ftp_send_msg(int outfd, ftp_cmd_t cmd, const char *arg, ssize_t len) {
-    ftp_msg_t msg = {0};
-    msg.cmd       = cmd;
+    if (len == -1) {
+        len = strlen(arg);
+    }
     if (len > FTP_PACKET_SIZE) {
         return FTP_ERR_ARGS;
     }
+    return ftp_send_msg_crc(outfd, cmd, arg, len, crc32c(0, arg, len));
+}
+
+/**
+ * @brief send() that attaches passfd to the bytes sent, see ftp_send_msg_fd
+ */
+static ssize_t ftp_send_fd(int outfd, const uint8_t *buf, size_t len,
+                           int passfd) {
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr hdr = {0};
+    hdr.msg_iov        = &iov;
+    hdr.msg_iovlen     = 1;
+    hdr.msg_control    = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+    return sendmsg(outfd, &hdr, 0);
+}
+
+/**
+ * @brief recv() that picks up a descriptor sent with ftp_send_fd
+ */
+static ssize_t ftp_recv_fd(int infd, uint8_t *buf, size_t len, int *passfd) {
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr hdr = {0};
+    hdr.msg_iov        = &iov;
+    hdr.msg_iovlen     = 1;
+    hdr.msg_control    = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+    ssize_t ret        = recvmsg(infd, &hdr, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); ret > 0 && cmsg;
+         cmsg                 = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        if (*passfd >= 0) {
+            close(*passfd); // Only one descriptor per packet
+        }
+        *passfd = fd;
+    }
+    return ret;
+}
+
+/**
+ * @brief Send a message whose payload is still in the caller's buffer
+ * @details The header, the payload and the zero padding up to
+ * FTP_MSG_SIZE are gathered by the kernel, so the payload (e.g. a mapped
+ * file) is never copied into an ftp_msg_t.
+ */
+static ftp_err_t ftp_send_iov(int outfd, const ftp_msg_t *msg,
+                              const void *payload, size_t len) {
+    static const uint8_t zeros[sizeof(ftp_msg_t)];
+    size_t               hdr    = offsetof(ftp_msg_t, packet);
+    struct iovec         iov[3] = {
+        {(void *)msg, hdr},
+        {(void *)payload, len},
+        {(void *)zeros, FTP_MSG_SIZE - hdr - len},
+    };
+    struct iovec *next = iov;
+    int           left = 3;
+    while (left) {
+        ssize_t ret = writev(outfd, next, left);
+        if (ret < 0) {
+            return FTP_ERR_SOCKET;
+        }
+        if (ret == 0) {
+            return FTP_ERR_CLOSE;
+        }
+        // Skip what was sent, resuming inside a partly sent part
+        while (left && (size_t)ret >= next->iov_len) {
+            ret -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left) {
+            next->iov_base = (uint8_t *)next->iov_base + ret;
+            next->iov_len -= ret;
+        }
+    }
+    return FTP_ERR_NONE;
+}
+
+/**
+ * @brief Build and send a command packet, attaching passfd unless it is -1
+ */
+static ftp_err_t ftp_send_msg_pass(int outfd, ftp_cmd_t cmd, const char *arg,
+                                   ssize_t len, uint32_t crc, int passfd) {
+    // Only the header is cleared, the payload is filled in or sent from arg
+    ftp_msg_t msg;
+    memset(&msg, 0, offsetof(ftp_msg_t, packet));
+    msg.cmd = cmd;
     if (len == -1) {
         len = strlen(arg);
     }
-    memcpy(msg.packet, arg, len);
-    msg.nbytes = len;
+    if (len > FTP_PACKET_SIZE) {
+        return FTP_ERR_ARGS;
+    }
+    msg.crc = crc;
+
+    // Compress DATA payloads that are likely to shrink
+    compress_codec_t codec  = COMPRESS_NONE;
+    size_t           nbytes = 0;
+    if (cmd == FTP_CMD_DATA && outfd >= 0 && outfd < FTP_MAX_FDS) {
+        codec = ftp_codecs[outfd];
+    }
+    if (codec != COMPRESS_NONE && compress_probe((const uint8_t *)arg, len)) {
+        nbytes = compress_buf(codec, (const uint8_t *)arg, len, msg.packet,
+                              len - 1);
+    }
+    if (nbytes) {
+        msg.codec  = codec;
+        msg.nbytes = nbytes;
+    } else if (passfd < 0) {
+        msg.nbytes = len;
+        return ftp_send_iov(outfd, &msg, arg, len);
+    } else {
+        memcpy(msg.packet, arg, len);
+        msg.nbytes = len;
+    }
+    // Don't send what was on the stack after the payload
+    memset(msg.packet + msg.nbytes, 0, sizeof(msg.packet) - msg.nbytes);
 
 #ifdef DEBUG_TRANSFER
     puts("DEBUG: Sending message");
@@ -170,8 +310,13 @@ ftp_err_t ftp_send_msg(int outfd, ftp_cmd_t cmd, const char *arg, ssize_t len) {
     // Send the message
     size_t bytes_sent = 0;
     while (bytes_sent < FTP_MSG_SIZE) {
-        ssize_t ret =
-            send(outfd, &msg + bytes_sent, FTP_MSG_SIZE - bytes_sent, 0);
+        ssize_t ret;
+        if (passfd >= 0 && bytes_sent == 0) {
+            ret = ftp_send_fd(outfd, (uint8_t *)&msg, FTP_MSG_SIZE, passfd);
+        } else {
+            ret = send(outfd, (uint8_t *)&msg + bytes_sent,
+                       FTP_MSG_SIZE - bytes_sent, 0);
+        }
         if (ret < 0) {
             return FTP_ERR_SOCKET;
         }
@@ -186,49 +331,251 @@ ftp_err_t ftp_send_msg(int outfd, ftp_cmd_t cmd, const char *arg, ssize_t len) {
     return FTP_ERR_NONE;
 }
 
+/**
+ * @brief Send a single command packet with a caller supplied checksum
+ */
+ftp_err_t ftp_send_msg_crc(int outfd, ftp_cmd_t cmd, const char *arg,
+                           ssize_t len, uint32_t crc) {
+    return ftp_send_msg_pass(outfd, cmd, arg, len, crc, -1);
+}
+
+ftp_err_t ftp_send_msg_fd(int outfd, ftp_cmd_t cmd, const char *arg,
+                          ssize_t len, int passfd) {
+    if (len == -1) {
+        len = strlen(arg);
+    }
+    if (len > FTP_PACKET_SIZE || passfd < 0) {
+        return FTP_ERR_ARGS;
+    }
+    return ftp_send_msg_pass(outfd, cmd, arg, len, crc32c(0, arg, len),
+                             passfd);
+}
+
 /**
  * @brief Recieve a single command packet, useful for establishing a link
  * (ACK)
  */
 ftp_err_t ftp_recv_msg(int infd, ftp_msg_t *msg) {
+    return ftp_recv_msg_fd(infd, msg, NULL);
+}
+
+ftp_err_t ftp_recv_msg_fd(int infd, ftp_msg_t *msg, int *passfd) {
     if (infd <= 0 || msg == NULL) {
         return FTP_ERR_ARGS;
     }
     bzero(msg, FTP_MSG_SIZE);
-    size_t bytes_recv = 0;
+    if (passfd) {
+        *passfd = -1;
+    }
+    int timeout = TIMEOUT_MS;
+    if (infd < FTP_MAX_FDS && ftp_timeouts[infd]) {
+        timeout = ftp_timeouts[infd];
+    }
+    ftp_err_t err        = FTP_ERR_NONE;
+    size_t    bytes_recv = 0;
     while (bytes_recv < FTP_MSG_SIZE) {
         struct pollfd fds = {0};
         fds.fd            = infd;
         fds.events        = POLLIN;
-        int ret_poll      = poll(&fds, 1, TIMEOUT_MS);
+        int ret_poll      = poll(&fds, 1, timeout);
         if (ret_poll < 0) {
-            return FTP_ERR_POLL;
+            err = FTP_ERR_POLL;
+            goto ftp_recv_msg_end;
         } else if (ret_poll == 0) {
-            return FTP_ERR_TIMEOUT;
+            err = FTP_ERR_TIMEOUT;
+            goto ftp_recv_msg_end;
         }
         uint8_t *msg_       = (uint8_t *)msg + bytes_recv;
         size_t   bytes_left = FTP_MSG_SIZE - bytes_recv;
-        ssize_t  ret        = recv(infd, msg_, bytes_left, 0);
+        ssize_t  ret        = passfd
+                                  ? ftp_recv_fd(infd, msg_, bytes_left, passfd)
+                                  : recv(infd, msg_, bytes_left, 0);
         if (ret < 0) {
             perror("Error recieving message");
-            return FTP_ERR_SOCKET;
+            err = FTP_ERR_SOCKET;
+            goto ftp_recv_msg_end;
         }
         if (ret == 0) {
-            return FTP_ERR_CLOSE;
+            err = FTP_ERR_CLOSE;
+            goto ftp_recv_msg_end;
         }
 #ifdef DEBUG_TRANSFER
         printf("DEBUG: Recieved %ld bytes\n", ret);
 #endif
         bytes_recv += ret;
     }
+    err = ftp_msg_check(msg);
+
+ftp_recv_msg_end:
+    if (err != FTP_ERR_NONE && passfd && *passfd >= 0) {
+        close(*passfd);
+        *passfd = -1;
+    }
+    return err;
+}
+
+ftp_err_t ftp_msg_check(ftp_msg_t *msg) {
     if (msg->cmd == FTP_CMD_ERROR) {
         return FTP_ERR_SERVER;
     }
-    // printf("DEBUG: Recieved message (%lu):\n", bytes_recv);
+    if (msg->nbytes > FTP_PACKET_SIZE) {
+        return FTP_ERR_INVALID;
+    }
+    if (msg->codec != COMPRESS_NONE) {
+        uint8_t raw[FTP_PACKET_SIZE];
+        ssize_t n = decompress_buf(msg->codec, msg->packet, msg->nbytes, raw,
+                                   FTP_PACKET_SIZE);
+        if (n < 0) {
+            return FTP_ERR_CHECKSUM;
+        }
+        memcpy(msg->packet, raw, n);
+        msg->nbytes = n;
+        msg->codec  = COMPRESS_NONE;
+    }
+    if (crc32c(0, msg->packet, msg->nbytes) != msg->crc) {
+        return FTP_ERR_CHECKSUM;
+    }
     // ftp_msg_print(stdout, msg);
     return FTP_ERR_NONE;
 }
 
+/**
+ * @brief Compress DATA packets sent on fd with codec from now on
+ */
+void ftp_set_codec(int fd, compress_codec_t codec) {
+    if (fd >= 0 && fd < FTP_MAX_FDS && compress_supported(codec)) {
+        ftp_codecs[fd] = codec;
+    }
+}
+
+void ftp_set_timeout(int fd, int ms) {
+    if (fd >= 0 && fd < FTP_MAX_FDS) {
+        ftp_timeouts[fd] = ms > 0 ? ms : 0;
+    }
+}
+
+int ftp_close(int fd) {
+    ftp_set_codec(fd, COMPRESS_NONE);
+    ftp_set_timeout(fd, 0);
+    return close(fd);
+}
+
+/**
+ * @brief setsockopt for an int value, counting refusals
+ */
+static int ftp_setsockopt(int fd, int level, int name, int value) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        return 1;
+    }
+    return 0;
+}
+
+int ftp_tune_socket(int fd, const ftp_sockopts_t *opts) {
+    struct sockaddr_storage addr;
+    socklen_t               addr_len = sizeof(addr);
+    int                     tcp      = 0;
+    if (getsockname(fd, (struct sockaddr *)&addr, &addr_len) == 0) {
+        tcp = addr.ss_family == AF_INET || addr.ss_family == AF_INET6;
+    }
+    int failed = 0;
+    if (opts->sndbuf > 0) {
+        failed += ftp_setsockopt(fd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf);
+    }
+    if (opts->rcvbuf > 0) {
+        failed += ftp_setsockopt(fd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf);
+    }
+    if (opts->busy_poll > 0) {
+        failed += ftp_setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll);
+    }
+    if (!tcp) {
+        return failed;
+    }
+    if (opts->nodelay > 0) {
+        failed += ftp_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+    if (opts->notsent_lowat > 0) {
+        failed += ftp_setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                                 opts->notsent_lowat);
+    }
+    if (opts->keepalive > 0) {
+        // Give up on a silent peer after three unanswered probes
+        int idle     = opts->keepalive;
+        int interval = idle / 3 ? idle / 3 : 1;
+        failed += ftp_setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+        failed += ftp_setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, idle);
+        failed += ftp_setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, interval);
+        failed += ftp_setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, 3);
+    }
+    return failed;
+}
+
+void ftp_set_cork(int fd, int on) {
+    // Fails harmlessly on AF_UNIX sockets
+    ftp_setsockopt(fd, IPPROTO_TCP, TCP_CORK, on);
+}
+
+/**
+ * @brief Pick the first codec of a HELLO offer this build supports
+ */
+compress_codec_t ftp_codec_negotiate(const char *offer) {
+    char copy[FTP_PACKET_SIZE + 1] = {0};
+    strncpy(copy, offer, FTP_PACKET_SIZE);
+    char *saveptr = NULL;
+    for (char *name = strtok_r(copy, " ", &saveptr); name;
+         name       = strtok_r(NULL, " ", &saveptr)) {
+        compress_codec_t codec;
+        if (compress_codec_from_str(name, &codec) == 0 &&
+            compress_supported(codec)) {
+            return codec;
+        }
+    }
+    return COMPRESS_NONE;
+}
+
+/**
+ * @brief Remove a trailing "durable=<level>" from a PUT or LINK argument
+ */
+ftp_durable_t ftp_durable_parse(char *arg) {
+    char *token = strrchr(arg, ' ');
+    if (!token || strncmp(token + 1, "durable=", 8) != 0) {
+        return FTP_DURABLE_NONE;
+    }
+    ftp_durable_t level;
+    if (ftp_durable_from_str(token + 9, &level) < 0) {
+        return FTP_DURABLE_NONE;
+    }
+    *token = '\0';
+    return level;
+}
+
+int ftp_durable_from_str(const char *str, ftp_durable_t *level) {
+    if (!str || !level)
+        return -1;
+    if (strcmp(str, "none") == 0) {
+        *level = FTP_DURABLE_NONE;
+    } else if (strcmp(str, "buffered") == 0) {
+        *level = FTP_DURABLE_BUFFERED;
+    } else if (strcmp(str, "sync") == 0) {
+        *level = FTP_DURABLE_SYNC;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *ftp_durable_to_str(ftp_durable_t level) {
+    switch (level) {
+    case FTP_DURABLE_NONE:
+        return "none";
+    case FTP_DURABLE_BUFFERED:
+        return "buffered";
+    case FTP_DURABLE_SYNC:
+        return "sync";
+    default:
+        return "unknown";
+    }
+}
+
 /**
  * @brief Return a string representation of the ftp_cmd_t
  *
@@ -247,6 +594,18 @@ const char *ftp_cmd_to_str(ftp_cmd_t cmd) {
         return "DATA";
     case FTP_CMD_TERM:
         return "TERM";
+    case FTP_CMD_HAVE:
+        return "HAVE";
+    case FTP_CMD_LINK:
+        return "LINK";
+    case FTP_CMD_HELLO:
+        return "HELLO";
+    case FTP_CMD_STAT:
+        return "STAT";
+    case FTP_CMD_DELETE:
+        return "DELETE";
+    case FTP_CMD_OPEN:
+        return "OPEN";
     default:
         return "INVALID";
     }
@@ -272,6 +631,10 @@ const char *ftp_err_to_str(ftp_err_t err) {
         return "INVALID";
     case FTP_ERR_SERVER:
         return "SERVER";
+    case FTP_ERR_CLOSE:
+        return "CLOSE";
+    case FTP_ERR_CHECKSUM:
+        return "CHECKSUM";
     default:
         return "UNKNOWN";
     }
@@ -284,7 +647,9 @@ const char *ftp_err_to_str(ftp_err_t err) {
 void ftp_msg_print(FILE *stream, ftp_msg_t *msg) {
     fprintf(stream, "ftp_msg_t {\n");
     fprintf(stream, "\tcmd: %s\n", ftp_cmd_to_str(msg->cmd));
+    fprintf(stream, "\tcodec: %s\n", compress_codec_to_str(msg->codec));
     fprintf(stream, "\tnbytes: %d\n", msg->nbytes);
+    fprintf(stream, "\tcrc: %08X\n", msg->crc);
     if (msg->packet[FTP_PACKET_SIZE] != '\0') {
         fprintf(stderr,
                 "WARNING: packet is not null terminated (corruption)\n");
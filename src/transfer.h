@@ -17,9 +17,11 @@
 #include <sys/socket.h>
 
 #include "common.h"
+#include "compress.h"
 
 // #define FTP_PACKET_SIZE 1024
 #define FTP_MSG_SIZE sizeof(ftp_msg_t)
+#define FTP_MAX_FDS  1024 // Sockets above this never use compression
 
 /**
  * Client oriented command naming convention
@@ -28,23 +30,85 @@
  *      PUT <filename>: move <filename> file from cleint to server.
  *      DELETE <filename>: delete <filename> file from server fs.
  *      LS : list the contents of the server filesystem.
+ *      HAVE <key>\n...: ask which content keys the server already stores,
+ *          answered by a DATA packet with one '1' (have) or '0' per key.
+ *      LINK <chunk_name> <key>: store chunk_name as the already stored
+ *          content with the given key, without resending the data.
+ *      HELLO <codec> ...: offer compression codecs in order of preference,
+ *          answered by a DATA packet naming the codec the server picked
+ *          (see ftp_codec_negotiate). Both ends then compress DATA packets
+ *          on that connection with it.
+ *      STAT: report the server's capacity and load, answered by a DATA
+ *          packet of "key: value" lines (see store_stat_format), and the
+ *          highest level it accepts in "durable=<level>" ("durable: sync").
+ *      DELETE <name>\n<name>...: remove the named chunk and manifest files,
+ *          answered by a DATA packet with the number of bytes reclaimed.
+ *      OPEN <name>: on AF_UNIX connections only, answered by a DATA packet
+ *          "<length> <crc>" (crc in hex) carrying an open descriptor of the
+ *          chunk file (SCM_RIGHTS), which the client reads itself.
  *      // Internal flow commands
  *      ERROR <message>: Stop any ongoing partial transaction.
+ *
+ * PUT may carry the content key after the chunk name ("PUT <name> <key>")
+ * so the server can deduplicate the data it receives. GET may carry a byte
+ * range ("GET <name> <offset> <length>") to receive only part of a chunk,
+ * see store_get_range. LIST may carry the position of the client's last
+ * listing ("LIST <epoch> <seq>") to receive only what changed since, see
+ * store_list.
+ *
+ * PUT and LINK may end with "durable=<level>" (see ftp_durable_t) to be
+ * acknowledged: after the TERM of a PUT, or after a LINK, the server
+ * answers TERM once the chunk has reached the requested level, or ERROR if
+ * it could not be stored. Without the token neither is answered. A "sync"
+ * answer also covers everything the server stored before (see
+ * store_commit), so a client sending several chunks only needs "sync" on
+ * the last of them. A server that does not report a "durable" line in its
+ * STAT reply does not know the token and is never sent it.
  */
-#define FTP_CMD_GET   ((uint8_t)0x01)
-#define FTP_CMD_PUT   ((uint8_t)0x02)
-#define FTP_CMD_LIST  ((uint8_t)0x04)
-#define FTP_CMD_DATA  ((uint8_t)0x05)
-#define FTP_CMD_TERM  ((uint8_t)0x06)
-#define FTP_CMD_ERROR ((uint8_t)0x07)
+#define FTP_CMD_GET    ((uint8_t)0x01)
+#define FTP_CMD_PUT    ((uint8_t)0x02)
+#define FTP_CMD_LIST   ((uint8_t)0x04)
+#define FTP_CMD_DATA   ((uint8_t)0x05)
+#define FTP_CMD_TERM   ((uint8_t)0x06)
+#define FTP_CMD_ERROR  ((uint8_t)0x07)
+#define FTP_CMD_HAVE   ((uint8_t)0x08)
+#define FTP_CMD_LINK   ((uint8_t)0x09)
+#define FTP_CMD_HELLO  ((uint8_t)0x0A)
+#define FTP_CMD_STAT   ((uint8_t)0x0B)
+#define FTP_CMD_DELETE ((uint8_t)0x0C)
+#define FTP_CMD_OPEN   ((uint8_t)0x0D)
 typedef uint8_t ftp_cmd_t;
 
 typedef struct {
-    ftp_cmd_t cmd;
-    uint32_t  nbytes;
+    ftp_cmd_t        cmd;
+    compress_codec_t codec; // Encoding of packet, COMPRESS_NONE once received
+    uint32_t         nbytes;
+    uint32_t         crc; // CRC32C of the uncompressed payload
     uint8_t   packet[FTP_PACKET_SIZE + 1]; // +1 for null terminator
 } ftp_msg_t;
 
+/**
+ * @brief Socket options for a connection, see ftp_tune_socket. 0 leaves the
+ * kernel default; -1 is used by configuration for "not set here".
+ */
+typedef struct {
+    int nodelay;       // TCP_NODELAY, send small packets without delay
+    int keepalive;     // SO_KEEPALIVE, seconds idle before probing
+    int sndbuf;        // SO_SNDBUF bytes, otherwise autotuned
+    int rcvbuf;        // SO_RCVBUF bytes, otherwise autotuned
+    int notsent_lowat; // TCP_NOTSENT_LOWAT bytes queued unsent at most
+    int busy_poll;     // SO_BUSY_POLL microseconds spent polling the device
+} ftp_sockopts_t;
+
+/**
+ * @brief How stored a PUT or LINK must be before the server answers it
+ */
+typedef enum {
+    FTP_DURABLE_NONE,     // Not answered, as without the token
+    FTP_DURABLE_BUFFERED, // Written to the server's file system cache
+    FTP_DURABLE_SYNC,     // On stable storage, survives a crash
+} ftp_durable_t;
+
 typedef enum {
     FTP_ERR_NONE,
     FTP_ERR_ARGS,
@@ -54,6 +118,7 @@ typedef enum {
     FTP_ERR_INVALID,
     FTP_ERR_SERVER,
     FTP_ERR_CLOSE,
+    FTP_ERR_CHECKSUM,
 } ftp_err_t;
 
 /**
@@ -98,14 +163,127 @@ ftp_err_t ftp_recv_data(int infd, int outfd);
  */
 ftp_err_t ftp_send_msg(int outfd, ftp_cmd_t cmd, const char *arg, ssize_t len);
 
+/**
+ * @brief Send a single command packet carrying a precomputed checksum.
+ * @details Used by the server to return a chunk together with the crc that
+ * was recorded when the chunk was stored, so corruption at rest is detected
+ * by the receiver rather than being re-checksummed and passed along.
+ *
+ * @param crc CRC32C of the first *len* bytes of *arg*, as stored.
+ */
+ftp_err_t ftp_send_msg_crc(int outfd, ftp_cmd_t cmd, const char *arg,
+                           ssize_t len, uint32_t crc);
+
+/**
+ * @brief Send a single command packet together with a file descriptor
+ * @details outfd must be an AF_UNIX socket. The receiver gets its own
+ * descriptor for the same open file from ftp_recv_msg_fd; the caller may
+ * close passfd once this returns.
+ */
+ftp_err_t ftp_send_msg_fd(int outfd, ftp_cmd_t cmd, const char *arg,
+                          ssize_t len, int passfd);
+
 /**
  * @brief Recieve a single command packet
  *
  * @param infd File descriptor to read from
  * @param msg Pointer to a message struct to fill
+ * @return FTP_ERR_CHECKSUM if the payload does not match msg->crc
  */
 ftp_err_t ftp_recv_msg(int infd, ftp_msg_t *msg);
 
+/**
+ * @brief Recieve a single command packet and the descriptor sent along
+ * with it by ftp_send_msg_fd
+ *
+ * @param passfd Set to the received descriptor (the caller closes it), or
+ * -1 if the packet carried none
+ */
+ftp_err_t ftp_recv_msg_fd(int infd, ftp_msg_t *msg, int *passfd);
+
+/**
+ * @brief Validate and decode a message whose FTP_MSG_SIZE bytes have all
+ * been received, for callers that read sockets themselves (e.g. to wait on
+ * several at once). ftp_recv_msg ends with this.
+ *
+ * @return FTP_ERR_SERVER for FTP_CMD_ERROR, FTP_ERR_CHECKSUM if the payload
+ * does not match msg->crc
+ */
+ftp_err_t ftp_msg_check(ftp_msg_t *msg);
+
+/**
+ * @brief Compress DATA packets sent on fd with codec from now on
+ * @details Packets are only compressed when compress_probe expects a gain
+ * and the result is smaller than the original. Receiving is independent of
+ * this setting, every packet carries its own codec.
+ */
+void ftp_set_codec(int fd, compress_codec_t codec);
+
+/**
+ * @brief Set how long ftp_recv_msg on fd waits for the next bytes of a
+ * message before giving up with FTP_ERR_TIMEOUT
+ * @details The wait applies to the start of the reply and to every pause
+ * within it, so a slow transfer that keeps making progress is not cut off.
+ *
+ * @param ms Milliseconds, 0 for TIMEOUT_MS
+ */
+void ftp_set_timeout(int fd, int ms);
+
+/**
+ * @brief Close a connection and forget its codec and timeout
+ * @details The settings are kept per descriptor number, so a connection
+ * closed with plain close() would pass them on to the next one given the
+ * same number.
+ *
+ * @return int The result of close
+ */
+int ftp_close(int fd);
+
+/**
+ * @brief Apply socket options to a connected (or listening) socket
+ * @details Used the same way by dfc and dfs. TCP options are skipped on
+ * AF_UNIX sockets. SO_BUSY_POLL may need CAP_NET_ADMIN.
+ *
+ * @return int Number of options the kernel refused
+ */
+int ftp_tune_socket(int fd, const ftp_sockopts_t *opts);
+
+/**
+ * @brief Hold back partial segments while a request is sent as several
+ * packets (TCP_CORK), releasing them when on is 0
+ *
+ */
+void ftp_set_cork(int fd, int on);
+
+/**
+ * @brief Pick the first codec of a HELLO offer this build supports
+ *
+ * @param offer Space separated codec names
+ * @return compress_codec_t COMPRESS_NONE if nothing matches
+ */
+compress_codec_t ftp_codec_negotiate(const char *offer);
+
+/**
+ * @brief Remove a trailing "durable=<level>" from a PUT or LINK argument
+ *
+ * @param arg Argument as received, the token is cut off in place
+ * @return ftp_durable_t FTP_DURABLE_NONE if arg has no (valid) token
+ */
+ftp_durable_t ftp_durable_parse(char *arg);
+
+/**
+ * @brief Parse a durability level name ("none", "buffered" or "sync")
+ *
+ * @return int 0 on success, -1 if str names no level
+ */
+int ftp_durable_from_str(const char *str, ftp_durable_t *level);
+
+/**
+ * @brief Return a string representation of the ftp_durable_t
+ *
+ */
+const char *ftp_durable_to_str(ftp_durable_t level);
+
 /**
  * @brief Return a string representation of the ftp_cmd_t
  *
@@ -0,0 +1,138 @@
+/**
+ * @file cache.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test the client's chunk cache and its size accounting
+ * @details The size the cache keeps must match what is in its directory
+ * after entries are replaced, found damaged and evicted; otherwise it
+ * evicts too early or grows without bound.
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <dirent.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+#define CHUNK_LEN 1000
+#define HDR_LEN   4 // CRC32C before each payload
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+/**
+ * @brief Bytes in the entries of dir, as a fresh scan counts them
+ */
+static uint64_t disk_size(const char *dir) {
+    uint64_t       total = 0;
+    DIR           *d     = opendir(dir);
+    struct dirent *ent;
+    while (d && (ent = readdir(d))) {
+        char        path[PATH_MAX + NAME_MAX + 2];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (ent->d_name[0] != '.' && stat(path, &st) == 0) {
+            total += st.st_size;
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    return total;
+}
+
+static void test_accounting(const char *dir) {
+    cache_t cache;
+    CHECK(cache_init(&cache, dir, 1 << 20) == 0);
+    uint8_t chunk[CHUNK_LEN];
+    uint8_t out[CHUNK_LEN];
+    size_t  len = 0;
+    memset(chunk, 'a', sizeof(chunk));
+
+    CHECK(cache_get(&cache, "f.1.2.3.0", out, sizeof(out), &len) < 0);
+    cache_put(&cache, "f.1.2.3.0", chunk, sizeof(chunk));
+    CHECK(cache_get(&cache, "f.1.2.3.0", out, sizeof(out), &len) == 0);
+    CHECK(len == sizeof(chunk) && memcmp(out, chunk, len) == 0);
+    CHECK(cache.size == HDR_LEN + CHUNK_LEN);
+
+    // Replacing an entry counts it once
+    cache_put(&cache, "f.1.2.3.0", chunk, sizeof(chunk) / 2);
+    CHECK(cache.size == HDR_LEN + CHUNK_LEN / 2);
+    CHECK(cache.size == disk_size(dir));
+
+    // A damaged entry is dropped along with its size
+    cache_put(&cache, "f.1.2.3.1", chunk, sizeof(chunk));
+    char path[PATH_MAX + NAME_MAX + 2];
+    snprintf(path, sizeof(path), "%s/f.1.2.3.1", dir);
+    FILE *file = fopen(path, "r+");
+    CHECK(file != NULL);
+    if (file) {
+        fseek(file, HDR_LEN, SEEK_SET);
+        fputc('b', file);
+        fclose(file);
+    }
+    CHECK(cache_get(&cache, "f.1.2.3.1", out, sizeof(out), &len) < 0);
+    CHECK(cache.size == disk_size(dir));
+    cache_destroy(&cache);
+}
+
+static void test_eviction(const char *dir) {
+    cache_t  cache;
+    uint64_t cap = 20 * (HDR_LEN + CHUNK_LEN);
+    CHECK(cache_init(&cache, dir, cap) == 0);
+    uint8_t chunk[CHUNK_LEN];
+    memset(chunk, 'c', sizeof(chunk));
+    char name[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "g.1.2.3.%d", i);
+        cache_put(&cache, name, chunk, sizeof(chunk));
+        CHECK(cache.size <= cap);
+    }
+    CHECK(cache.size == disk_size(dir));
+    uint8_t out[CHUNK_LEN];
+    size_t  len = 0;
+    CHECK(cache_get(&cache, name, out, sizeof(out), &len) == 0);
+    cache_destroy(&cache);
+
+    // Disabled, nothing is kept
+    CHECK(cache_init(&cache, dir, 0) == 0);
+    cache_put(&cache, "h.1.2.3.0", chunk, sizeof(chunk));
+    CHECK(cache_get(&cache, "h.1.2.3.0", out, sizeof(out), &len) < 0);
+    cache_destroy(&cache);
+}
+
+int main(void) {
+    char root[] = "/tmp/dfs-cache-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    char dir[64];
+    snprintf(dir, sizeof(dir), "%s/a", root);
+    test_accounting(dir);
+    snprintf(dir, sizeof(dir), "%s/b", root);
+    test_eviction(dir);
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Could not remove %s\n", root);
+    }
+    printf("%s: %s\n", __FILE__, failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+/**
+ * @file catalog.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test the server's change log listing and the client's catalog
+ * @details Chunks are put and deleted through the store, then listed from a
+ * position in the change log and replayed into a catalog, as dfc does.
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <inttypes.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "crc32c.h"
+#include "store.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+static int has(catalog_t *catalog, const char *name) {
+    catalog_sort(catalog);
+    for (size_t i = 0; i < catalog->num_names; i++) {
+        if (strcmp(catalog->names[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void put(const char *root, const char *name) {
+    uint8_t chunk[64];
+    memset(chunk, name[0], sizeof(chunk));
+    CHECK(store_put(root, name, chunk, sizeof(chunk),
+                    crc32c(0, chunk, sizeof(chunk))) == STORE_ERR_NONE);
+}
+
+/**
+ * @brief List from epoch and seq into buf, returning the reply's kind
+ */
+static char list(const char *root, const char *epoch, uint64_t seq,
+                 char *buf, size_t cap) {
+    FILE *out = fmemopen(buf, cap, "w");
+    CHECK(out != NULL);
+    CHECK(store_list(root, epoch, seq, out) == STORE_ERR_NONE);
+    fclose(out);
+    return buf[0];
+}
+
+/**
+ * @brief Replay a LIST reply into catalog the way list_recv_line does
+ */
+static void replay(catalog_t *catalog, char *reply) {
+    char  kind[16] = {0};
+    char *line     = strtok(reply, "\n");
+    CHECK(line && sscanf(line, "%15s %16s %" SCNu64, kind, catalog->epoch,
+                         &catalog->seq) == 3);
+    if (strcmp(kind, "snapshot") == 0) {
+        catalog_clear(catalog);
+    }
+    while ((line = strtok(NULL, "\n"))) {
+        if (strcmp(kind, "snapshot") == 0) {
+            CHECK(catalog_add(catalog, line) == 0);
+        } else {
+            CHECK(line[1] == ' ');
+            CHECK(catalog_apply(catalog, line[0], line + 2) == 0);
+        }
+    }
+    CHECK(catalog_sort(catalog) == 0);
+}
+
+static void test_apply(void) {
+    catalog_t catalog;
+    catalog_init(&catalog);
+    catalog_add(&catalog, "c");
+    catalog_add(&catalog, "a");
+    catalog_add(&catalog, "c");
+    CHECK(catalog_apply(&catalog, '+', "b") == 0);
+    CHECK(catalog_apply(&catalog, '-', "a") == 0);
+    CHECK(catalog_apply(&catalog, '-', "x") == 0); // Never there
+    CHECK(catalog_apply(&catalog, '+', "d") == 0);
+    CHECK(catalog_apply(&catalog, '-', "d") == 0);
+    CHECK(catalog_apply(&catalog, '-', "c") == 0);
+    CHECK(catalog_apply(&catalog, '+', "c") == 0);
+    CHECK(catalog_apply(&catalog, '*', "e") < 0);
+    CHECK(catalog_sort(&catalog) == 0);
+    CHECK(catalog.num_names == 2 && strcmp(catalog.names[0], "b") == 0 &&
+          strcmp(catalog.names[1], "c") == 0);
+    catalog_free(&catalog);
+}
+
+static void test_list(const char *root) {
+    static char buf[1 << 16];
+    catalog_t   catalog;
+    catalog_init(&catalog);
+    put(root, "a.1");
+    put(root, "b.1");
+    CHECK(list(root, NULL, 0, buf, sizeof(buf)) == 's');
+    replay(&catalog, buf);
+    CHECK(catalog.num_names == 2 && has(&catalog, "a.1") &&
+          has(&catalog, "b.1"));
+
+    // Only what changed since the catalog's seq
+    uint64_t reclaimed = 0;
+    uint64_t seq       = catalog.seq;
+    put(root, "c.1");
+    CHECK(store_delete(root, "a.1", &reclaimed) == STORE_ERR_NONE);
+    CHECK(list(root, catalog.epoch, seq, buf, sizeof(buf)) == 'c');
+    CHECK(strstr(buf, "+ c.1\n") && strstr(buf, "- a.1\n"));
+    CHECK(!strstr(buf, "b.1"));
+    replay(&catalog, buf);
+    CHECK(catalog.seq > seq);
+    CHECK(catalog.num_names == 2 && has(&catalog, "b.1") &&
+          has(&catalog, "c.1"));
+
+    // Up to date, nothing to replay
+    CHECK(list(root, catalog.epoch, catalog.seq, buf, sizeof(buf)) == 'c');
+    CHECK(strchr(buf, '\n')[1] == '\0');
+
+    // Saved and loaded between runs
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.catalog", root);
+    CHECK(catalog_save(&catalog, path) == 0);
+    catalog_t loaded;
+    catalog_init(&loaded);
+    CHECK(catalog_load(&loaded, path) == 0);
+    CHECK(strcmp(loaded.epoch, catalog.epoch) == 0);
+    CHECK(loaded.seq == catalog.seq && loaded.num_names == 2);
+    catalog_free(&loaded);
+
+    // A new log is a new epoch, the client must take a snapshot
+    char log[PATH_MAX];
+    snprintf(log, sizeof(log), "%s/.changes", root);
+    CHECK(unlink(log) == 0);
+    put(root, "d.1");
+    CHECK(list(root, catalog.epoch, 0, buf, sizeof(buf)) == 's');
+    replay(&catalog, buf);
+    CHECK(catalog.num_names == 3 && has(&catalog, "d.1"));
+
+    // A seq past the end of the log is not trusted either
+    CHECK(list(root, catalog.epoch, catalog.seq + 1, buf, sizeof(buf)) ==
+          's');
+    catalog_free(&catalog);
+}
+
+int main(void) {
+    char root[] = "/tmp/dfs-catalog-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    test_apply();
+    test_list(root);
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Could not remove %s\n", root);
+    }
+    printf("%s: %s\n", __FILE__, failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+/**
+ * @file cdc.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test content defined chunking
+ * @details Cuts must respect the size limits, depend only on the content,
+ * and mostly survive an insertion ahead of them, which is what lets a
+ * shifted file share chunks with the old version.
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdc.h"
+
+#define INPUT_LEN (8 << 20)
+#define MAX_CUTS  (INPUT_LEN / CDC_MIN_DEFAULT + 1)
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+/**
+ * @brief Fill buf with the same pseudo random bytes on every run
+ */
+static void fill(uint8_t *buf, size_t len, uint64_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        buf[i] = (uint8_t)seed;
+    }
+}
+
+/**
+ * @brief Chunk buf, recording where each chunk ends
+ *
+ * @return size_t Number of chunks
+ */
+static size_t cut_all(const cdc_params_t *params, const uint8_t *buf,
+                      size_t len, size_t *ends) {
+    size_t num = 0;
+    size_t off = 0;
+    while (off < len) {
+        size_t cut = cdc_cut(params, buf + off, len - off);
+        if (cut == 0 || cut > len - off || cut > params->max) {
+            printf("FAIL %s: cut of %lu at %lu\n", __FILE__, cut, off);
+            failures++;
+            break;
+        }
+        // Only the last chunk may be short
+        CHECK(cut >= params->min || off + cut == len);
+        off += cut;
+        ends[num++] = off;
+    }
+    return num;
+}
+
+static void test_init(void) {
+    cdc_params_t params;
+    CHECK(cdc_init(&params, CDC_MIN_DEFAULT, CDC_AVG_DEFAULT,
+                   CDC_MAX_DEFAULT) == 0);
+    CHECK(cdc_init(&params, 32, 64, 128) < 0);
+    CHECK(cdc_init(&params, 4096, 2048, 8192) < 0);
+    CHECK(cdc_init(&params, 4096, 8192, 4096) < 0);
+    CHECK(cdc_init(&params, 4096, 4096, 4096) == 0);
+}
+
+static void test_limits(uint8_t *buf) {
+    static size_t ends[MAX_CUTS];
+    cdc_params_t  params;
+    cdc_init(&params, CDC_MIN_DEFAULT, CDC_AVG_DEFAULT, CDC_MAX_DEFAULT);
+
+    size_t num = cut_all(&params, buf, INPUT_LEN, ends);
+    CHECK(num > 0 && ends[num - 1] == INPUT_LEN);
+    size_t avg = INPUT_LEN / (num ? num : 1);
+    CHECK(avg > CDC_AVG_DEFAULT / 2 && avg < CDC_AVG_DEFAULT * 2);
+
+    // The same content is cut the same way
+    static size_t again[MAX_CUTS];
+    CHECK(cut_all(&params, buf, INPUT_LEN, again) == num);
+    CHECK(memcmp(ends, again, num * sizeof(size_t)) == 0);
+
+    // Less than min left is one chunk
+    CHECK(cdc_cut(&params, buf, 100) == 100);
+    CHECK(cdc_cut(&params, buf, 1) == 1);
+
+    // Content without any match is cut at max
+    static uint8_t zeros[CDC_MAX_DEFAULT * 3];
+    num = cut_all(&params, zeros, sizeof(zeros), ends);
+    CHECK(num >= 3);
+}
+
+static void test_shift(uint8_t *buf) {
+    static size_t ends[MAX_CUTS];
+    static size_t shifted_ends[MAX_CUTS];
+    cdc_params_t  params;
+    cdc_init(&params, CDC_MIN_DEFAULT, CDC_AVG_DEFAULT, CDC_MAX_DEFAULT);
+
+    uint8_t *shifted = malloc(INPUT_LEN + 1);
+    shifted[0]       = 'X';
+    memcpy(shifted + 1, buf, INPUT_LEN);
+    size_t num   = cut_all(&params, buf, INPUT_LEN, ends);
+    size_t num_s = cut_all(&params, shifted, INPUT_LEN + 1, shifted_ends);
+
+    // Both lists are increasing, count the ends they share
+    size_t same = 0;
+    for (size_t i = 0, j = 0; i < num && j < num_s;) {
+        if (shifted_ends[j] == ends[i] + 1) {
+            same++;
+            i++;
+            j++;
+        } else if (shifted_ends[j] < ends[i] + 1) {
+            j++;
+        } else {
+            i++;
+        }
+    }
+    CHECK(same * 10 >= num * 9);
+    free(shifted);
+}
+
+int main(void) {
+    uint8_t *buf = malloc(INPUT_LEN);
+    fill(buf, INPUT_LEN, 0x9E3779B97F4A7C15ULL);
+    test_init();
+    test_limits(buf);
+    test_shift(buf);
+    free(buf);
+
+    printf("%s: %s\n", __FILE__, failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file compress.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test chunk compression: round trips and hostile input
+ * @details Every codec this build supports must give back what it was
+ * given. The LZ4 decoder also takes packets straight off the network, so
+ * random and damaged input must be refused without writing past the end
+ * of the output.
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+
+#define CHUNK_LEN   65536
+#define OUT_CAP     4096 // Output space in the fuzz test
+#define FUZZ_ROUNDS 100000
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+static uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t next(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (uint32_t)seed;
+}
+
+/**
+ * @brief Fill buf with data of the given kind
+ * @details 0 random, 1 text-like, 2 long runs, 3 repeats at short range
+ */
+static void fill(uint8_t *buf, size_t len, int kind) {
+    for (size_t i = 0; i < len; i++) {
+        switch (kind) {
+        case 0:
+            buf[i] = next();
+            break;
+        case 1:
+            buf[i] = "the quick brown fox "[next() % 20];
+            break;
+        case 2:
+            buf[i] = (i / 100) % 7;
+            break;
+        default:
+            buf[i] = i > 50 && next() % 4 ? buf[i - 50 + next() % 3] : next();
+        }
+    }
+}
+
+static void test_round_trip(void) {
+    static uint8_t src[CHUNK_LEN];
+    static uint8_t packed[CHUNK_LEN + CHUNK_LEN / 255 + 16];
+    static uint8_t out[CHUNK_LEN];
+    compress_codec_t codecs[] = {COMPRESS_LZ4, COMPRESS_ZSTD};
+    for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+        if (!compress_supported(codecs[c])) {
+            continue;
+        }
+        for (int trial = 0; trial < 200; trial++) {
+            size_t len = trial < 4 ? (size_t)trial : next() % (CHUNK_LEN + 1);
+            fill(src, len, trial % 4);
+            size_t n = compress_buf(codecs[c], src, len, packed,
+                                    sizeof(packed));
+            CHECK(n > 0 || len == 0);
+            if (n == 0) {
+                continue;
+            }
+            ssize_t got = decompress_buf(codecs[c], packed, n, out,
+                                         sizeof(out));
+            CHECK(got == (ssize_t)len && memcmp(src, out, len) == 0);
+            if (trial % 4 == 2) {
+                CHECK(n < len / 4 || len < COMPRESS_MIN_LEN);
+            }
+        }
+    }
+
+    // No room for the result, the caller sends the data as it is
+    fill(src, CHUNK_LEN, 0);
+    CHECK(compress_buf(COMPRESS_LZ4, src, CHUNK_LEN, packed, CHUNK_LEN / 2) ==
+          0);
+}
+
+static void test_known(void) {
+    // Five literals, then four literals and an overlapping 8 byte match
+    const uint8_t lit[]   = {0x50, 'h', 'e', 'l', 'l', 'o'};
+    const uint8_t match[] = {0x44, 'a', 'b', 'c', 'd', 4, 0, 0x10, 'x'};
+    uint8_t       out[32];
+    CHECK(decompress_buf(COMPRESS_LZ4, lit, sizeof(lit), out, sizeof(out)) ==
+          5);
+    CHECK(memcmp(out, "hello", 5) == 0);
+    CHECK(decompress_buf(COMPRESS_LZ4, match, sizeof(match), out,
+                         sizeof(out)) == 13);
+    CHECK(memcmp(out, "abcdabcdabcdx", 13) == 0);
+
+    // Too small for the output, or pointing before its start
+    CHECK(decompress_buf(COMPRESS_LZ4, match, sizeof(match), out, 12) < 0);
+    const uint8_t early[] = {0x04, 1, 0, 0x10, 'x'};
+    CHECK(decompress_buf(COMPRESS_LZ4, early, sizeof(early), out,
+                         sizeof(out)) < 0);
+    CHECK(decompress_buf(COMPRESS_NONE, lit, sizeof(lit), out, sizeof(out)) <
+          0);
+}
+
+static void test_fuzz(void) {
+    static uint8_t src[CHUNK_LEN];
+    static uint8_t valid[CHUNK_LEN + CHUNK_LEN / 255 + 16];
+    static uint8_t input[CHUNK_LEN + CHUNK_LEN / 255 + 16];
+    static uint8_t out[OUT_CAP + 64];
+    fill(src, OUT_CAP, 3);
+    size_t valid_len = compress_buf(COMPRESS_LZ4, src, OUT_CAP, valid,
+                                    sizeof(valid));
+    CHECK(valid_len > 0);
+
+    for (int round = 0; round < FUZZ_ROUNDS; round++) {
+        size_t len;
+        if (round % 2) {
+            // A valid stream with a few bytes changed or cut short
+            len = valid_len - next() % (valid_len / 8 + 1);
+            memcpy(input, valid, len);
+            for (int k = next() % 4; k >= 0; k--) {
+                input[next() % len] = next();
+            }
+        } else {
+            len = next() % 256;
+            for (size_t i = 0; i < len; i++) {
+                input[i] = next();
+            }
+        }
+        memset(out + OUT_CAP, 0xA5, 64);
+        ssize_t got = decompress_buf(COMPRESS_LZ4, input, len, out, OUT_CAP);
+        CHECK(got <= OUT_CAP);
+        int spilled = 0;
+        for (int i = 0; i < 64; i++) {
+            spilled |= out[OUT_CAP + i] != 0xA5;
+        }
+        if (spilled) {
+            printf("FAIL %s: round %d wrote past the output\n", __FILE__,
+                   round);
+            failures++;
+            break;
+        }
+    }
+}
+
+static void test_probe(void) {
+    static uint8_t buf[CHUNK_LEN];
+    fill(buf, sizeof(buf), 0);
+    CHECK(compress_probe(buf, sizeof(buf)) == 0);
+    fill(buf, sizeof(buf), 1);
+    CHECK(compress_probe(buf, sizeof(buf)) == 1);
+    CHECK(compress_probe(buf, COMPRESS_MIN_LEN - 1) == 0);
+
+    compress_codec_t codec;
+    CHECK(compress_codec_from_str("lz4", &codec) == 0 &&
+          codec == COMPRESS_LZ4);
+    CHECK(compress_codec_from_str("gzip", &codec) < 0);
+    CHECK(strcmp(compress_codec_to_str(COMPRESS_ZSTD), "zstd") == 0);
+}
+
+int main(void) {
+    test_round_trip();
+    test_known();
+    test_fuzz();
+    test_probe();
+
+    printf("%s: %s\n", __FILE__, failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file crc32c.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test CRC32C against known values and a bitwise reference
+ * @details Built twice: as crc32c with the implementation picked for this
+ * CPU, and as crc32c_sw with -DCRC32C_SOFTWARE for the slicing-by-8 table.
+ * Also checks that the store keeps a chunk's checksum with the chunk.
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "store.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+/**
+ * @brief One bit at a time, straight from the polynomial
+ */
+static uint32_t crc32c_ref(const uint8_t *p, size_t len) {
+    uint32_t crc = ~0U;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82F63B78U & (0U - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static void test_vectors(void) {
+    // RFC 3720, B.4
+    uint8_t buf[32];
+    CHECK(crc32c(0, "123456789", 9) == 0xE3069283);
+    CHECK(crc32c(0, "", 0) == 0);
+    memset(buf, 0, sizeof(buf));
+    CHECK(crc32c(0, buf, sizeof(buf)) == 0x8A9136AA);
+    memset(buf, 0xFF, sizeof(buf));
+    CHECK(crc32c(0, buf, sizeof(buf)) == 0x62A8AB43);
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = i;
+    }
+    CHECK(crc32c(0, buf, sizeof(buf)) == 0x46DD794E);
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = 31 - i;
+    }
+    CHECK(crc32c(0, buf, sizeof(buf)) == 0x113FDB5C);
+}
+
+static void test_reference(void) {
+    // Every alignment and tail length the 8 byte loops can meet
+    static uint8_t buf[4096 + 8];
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t)(i * 131 + (i >> 7));
+    }
+    for (size_t off = 0; off < 8; off++) {
+        for (size_t len = 0; len <= 4096; len += len < 64 ? 1 : 61) {
+            uint32_t want = crc32c_ref(buf + off, len);
+            CHECK(crc32c(0, buf + off, len) == want);
+            // Continued over two calls
+            uint32_t half = crc32c(0, buf + off, len / 3);
+            CHECK(crc32c(half, buf + off + len / 3, len - len / 3) == want);
+        }
+    }
+}
+
+static void test_store(const char *root) {
+    uint8_t chunk[1000];
+    for (size_t i = 0; i < sizeof(chunk); i++) {
+        chunk[i] = (uint8_t)(i * 7);
+    }
+    uint32_t crc = crc32c(0, chunk, sizeof(chunk));
+    CHECK(store_put_cas(root, "a.1", "xxh64-1", chunk, sizeof(chunk), crc) ==
+          STORE_ERR_NONE);
+    CHECK(store_link(root, "b.1", "xxh64-1") == STORE_ERR_NONE);
+
+    uint8_t  out[sizeof(chunk)];
+    size_t   len    = 0;
+    uint32_t stored = 0;
+    CHECK(store_get(root, "b.1", out, sizeof(out), &len, &stored) ==
+          STORE_ERR_NONE);
+    CHECK(stored == crc);
+    int fd = -1;
+    CHECK(store_open(root, "a.1", &fd, &len, &stored) == STORE_ERR_NONE);
+    CHECK(stored == crc && len == sizeof(chunk));
+    close(fd);
+
+    // Damaged on disk, the recorded checksum no longer matches
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/a.1", root);
+    FILE *file = fopen(path, "r+");
+    CHECK(file && fputc(chunk[0] ^ 1, file) != EOF);
+    if (file) {
+        fclose(file);
+    }
+    CHECK(store_get(root, "a.1", out, sizeof(out), &len, &stored) ==
+          STORE_ERR_CORRUPT);
+}
+
+int main(void) {
+    char root[] = "/tmp/dfs-crc32c-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    test_vectors();
+    test_reference();
+    test_store(root);
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Could not remove %s\n", root);
+    }
+    printf("%s (%s): %s\n", __FILE__, crc32c_impl(),
+           failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,165 @@
+/**
+ * @file durable.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test a PUT with "durable=sync" through the server's store
+ * @details The client half sends PUT, DATA and TERM over a socket pair; the
+ * server half strips the token with ftp_durable_parse, stores the chunk
+ * with store_put_cas, flushes with store_commit and answers TERM, as dfs
+ * does. The stored chunk is then read back.
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "store.h"
+#include "transfer.h"
+
+#define CHUNK_NAME "file.1700000000.1234.1.0"
+#define CHUNK_KEY  "xxh64-0123456789abcdef"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+typedef struct {
+    int           fd;
+    const char   *root;
+    ftp_durable_t level; // As parsed from the PUT
+    char          name[PATH_MAX];
+} server_t;
+
+/**
+ * @brief Serve one PUT the way dfs does
+ */
+static void *serve_put(void *arg) {
+    server_t *serv = arg;
+    ftp_msg_t msg  = {0};
+    if (ftp_recv_msg(serv->fd, &msg) != FTP_ERR_NONE ||
+        msg.cmd != FTP_CMD_PUT) {
+        return NULL;
+    }
+    serv->level = ftp_durable_parse((char *)msg.packet);
+    char key[PATH_MAX] = {0};
+    sscanf((char *)msg.packet, "%4095s %4095s", serv->name, key);
+
+    static uint8_t buf[FTP_PACKET_SIZE];
+    size_t         len = 0;
+    uint32_t       crc = 0;
+    while (ftp_recv_msg(serv->fd, &msg) == FTP_ERR_NONE &&
+           msg.cmd == FTP_CMD_DATA) {
+        memcpy(buf + len, msg.packet, msg.nbytes);
+        len += msg.nbytes;
+        crc = msg.crc;
+    }
+    if (msg.cmd != FTP_CMD_TERM) {
+        return NULL;
+    }
+    store_err_t err =
+        store_put_cas(serv->root, serv->name, key, buf, len, crc);
+    if (err == STORE_ERR_NONE && serv->level == FTP_DURABLE_SYNC) {
+        err = store_commit(serv->root);
+    }
+    if (err == STORE_ERR_NONE) {
+        ftp_send_msg(serv->fd, FTP_CMD_TERM, NULL, 0);
+    } else {
+        ftp_send_msg(serv->fd, FTP_CMD_ERROR, store_err_to_str(err), -1);
+    }
+    return NULL;
+}
+
+static void test_parse(void) {
+    char arg[64] = CHUNK_NAME " " CHUNK_KEY " durable=sync";
+    CHECK(ftp_durable_parse(arg) == FTP_DURABLE_SYNC);
+    CHECK(strcmp(arg, CHUNK_NAME " " CHUNK_KEY) == 0);
+
+    char plain[64] = CHUNK_NAME;
+    CHECK(ftp_durable_parse(plain) == FTP_DURABLE_NONE);
+    CHECK(strcmp(plain, CHUNK_NAME) == 0);
+
+    // An unknown level is not taken for a token
+    char bogus[64] = CHUNK_NAME " durable=often";
+    CHECK(ftp_durable_parse(bogus) == FTP_DURABLE_NONE);
+    CHECK(strcmp(bogus, CHUNK_NAME " durable=often") == 0);
+}
+
+static void test_stat(void) {
+    store_stat_t stat = {.free_bytes = 1, .total_bytes = 2, .load = 0.5};
+    char         buf[256];
+    store_stat_format(&stat, buf, sizeof(buf));
+    CHECK(strstr(buf, "\ndurable: sync\n") != NULL);
+}
+
+static void test_put(const char *root) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    server_t  serv = {.fd = fds[1], .root = root};
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve_put, &serv);
+
+    static uint8_t chunk[FTP_PACKET_SIZE];
+    for (size_t i = 0; i < sizeof(chunk); i++) {
+        chunk[i] = (uint8_t)(i * 7 + (i >> 9));
+    }
+    ftp_send_msg(fds[0], FTP_CMD_PUT,
+                 CHUNK_NAME " " CHUNK_KEY " durable=sync", -1);
+    ftp_send_msg(fds[0], FTP_CMD_DATA, (char *)chunk, sizeof(chunk));
+    ftp_send_msg(fds[0], FTP_CMD_TERM, NULL, 0);
+    ftp_msg_t msg = {0};
+    CHECK(ftp_recv_msg(fds[0], &msg) == FTP_ERR_NONE);
+    CHECK(msg.cmd == FTP_CMD_TERM);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    close(fds[1]);
+
+    CHECK(serv.level == FTP_DURABLE_SYNC);
+    CHECK(strcmp(serv.name, CHUNK_NAME) == 0);
+    CHECK(store_have(root, CHUNK_KEY) == STORE_ERR_NONE);
+
+    static uint8_t back[FTP_PACKET_SIZE];
+    size_t         len = 0;
+    uint32_t       crc = 0;
+    CHECK(store_get(root, CHUNK_NAME, back, sizeof(back), &len, &crc) ==
+          STORE_ERR_NONE);
+    CHECK(len == sizeof(chunk) && memcmp(back, chunk, len) == 0);
+    CHECK(crc == crc32c(0, chunk, sizeof(chunk)));
+}
+
+int main(void) {
+    char root[] = "/tmp/dfs-durable-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    test_parse();
+    test_stat();
+    test_put(root);
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Could not remove %s\n", root);
+    }
+    printf("%s: %s\n", __FILE__, failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}
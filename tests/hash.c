@@ -0,0 +1,154 @@
+/**
+ * @file hash.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test the hash functions against published vectors
+ * @details BLAKE3 inputs follow the reference test vectors: byte i of an
+ * input is i % 251. Lengths are picked around the 64 byte block and 1 KiB
+ * chunk boundaries, where the tree is built.
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+#define INPUT_LEN 102400
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+typedef struct {
+    hash_algo_t algo;
+    const char *text; // NULL for the first len bytes of the i % 251 input
+    size_t      len;
+    const char *hex;
+} vector_t;
+
+static const vector_t vectors[] = {
+    {HASH_MD5, "", 0, "d41d8cd98f00b204e9800998ecf8427e"},
+    {HASH_MD5, "abc", 3, "900150983cd24fb0d6963f7d28e17f72"},
+    {HASH_XXH64, "", 0, "ef46db3751d8e999"},
+    {HASH_XXH64, "abc", 3, "44bc2cf5ad770999"},
+    {HASH_XXH64, "Nobody inspects the spammish repetition", 39,
+     "fbcea83c8a378bf1"},
+    {HASH_BLAKE3, "", 0,
+     "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+    {HASH_BLAKE3, NULL, 1,
+     "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+    {HASH_BLAKE3, NULL, 1023,
+     "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11"},
+    {HASH_BLAKE3, NULL, 1024,
+     "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+    {HASH_BLAKE3, NULL, 1025,
+     "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+    {HASH_BLAKE3, NULL, 2048,
+     "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a"},
+    {HASH_BLAKE3, NULL, 2049,
+     "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030"},
+    {HASH_BLAKE3, NULL, 3072,
+     "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2"},
+    {HASH_BLAKE3, NULL, 3073,
+     "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3"},
+    {HASH_BLAKE3, NULL, 4096,
+     "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969"},
+    {HASH_BLAKE3, NULL, 8192,
+     "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63"},
+    {HASH_BLAKE3, NULL, 102400,
+     "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"},
+};
+
+static uint8_t input[INPUT_LEN];
+
+static void test_vectors(void) {
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        const vector_t *v = &vectors[i];
+        const void     *buf = v->text ? (const void *)v->text : input;
+        uint8_t         digest[HASH_MAX_LEN];
+        char            hex[HASH_HEX_LEN];
+        size_t          len = hash_buf(v->algo, buf, v->len, digest);
+        CHECK(len == hash_len(v->algo));
+        hash_to_hex(digest, len, hex);
+        if (strcmp(hex, v->hex) != 0) {
+            printf("FAIL %s %lu: %s != %s\n", hash_algo_to_str(v->algo),
+                   v->len, hex, v->hex);
+            failures++;
+        }
+    }
+}
+
+static void test_streaming(void) {
+    // Any split of the input gives the one call digest
+    hash_algo_t algos[] = {HASH_MD5, HASH_XXH64, HASH_BLAKE3};
+    for (size_t a = 0; a < sizeof(algos) / sizeof(algos[0]); a++) {
+        for (size_t len = 0; len < 9000; len += 37) {
+            uint8_t want[HASH_MAX_LEN] = {0};
+            uint8_t got[HASH_MAX_LEN]  = {0};
+            hash_buf(algos[a], input, len, want);
+            hash_ctx_t ctx;
+            hash_init(&ctx, algos[a]);
+            for (size_t off = 0, step = 1; off < len; step = step * 7 % 101) {
+                size_t n = step < len - off ? step : len - off;
+                hash_update(&ctx, input + off, n);
+                off += n;
+            }
+            hash_final(&ctx, got);
+            CHECK(memcmp(want, got, HASH_MAX_LEN) == 0);
+        }
+    }
+}
+
+static void test_fd(void) {
+    char path[] = "/tmp/dfs-hash-XXXXXX";
+    int  fd     = mkstemp(path);
+    CHECK(fd >= 0);
+    CHECK(write(fd, input, INPUT_LEN) == INPUT_LEN);
+    lseek(fd, 0, SEEK_SET);
+    uint8_t want[HASH_MAX_LEN];
+    uint8_t got[HASH_MAX_LEN];
+    hash_buf(HASH_BLAKE3, input, INPUT_LEN, want);
+    CHECK(hash_fd(HASH_BLAKE3, fd, got) == hash_len(HASH_BLAKE3));
+    CHECK(memcmp(want, got, hash_len(HASH_BLAKE3)) == 0);
+    close(fd);
+    unlink(path);
+}
+
+static void test_names(void) {
+    uint8_t digest[HASH_MAX_LEN];
+    char    key[HASH_KEY_LEN];
+    hash_buf(HASH_XXH64, "abc", 3, digest);
+    hash_to_key(HASH_XXH64, digest, key);
+    CHECK(strcmp(key, "xxh64-44bc2cf5ad770999") == 0);
+
+    hash_algo_t algo;
+    CHECK(hash_algo_from_str("blake3", &algo) == 0 && algo == HASH_BLAKE3);
+    CHECK(hash_algo_from_str("sha1", &algo) < 0);
+    CHECK(strcmp(hash_algo_to_str(HASH_MD5), "md5") == 0);
+}
+
+int main(void) {
+    for (size_t i = 0; i < INPUT_LEN; i++) {
+        input[i] = i % 251;
+    }
+    test_vectors();
+    test_streaming();
+    test_fd();
+    test_names();
+
+    printf("%s: %s\n", __FILE__, failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+/**
+ * @file hotcache.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test the server's hot chunk cache, alone and behind the store
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "crc32c.h"
+#include "hotcache.h"
+#include "store.h"
+
+#define CHUNK_LEN 4096
+#define NUM_COLD  4096 // Chunks put once, many times the cache
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+static void fill(uint8_t *buf, size_t len, int seed) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)(seed * 31 + i * 7);
+    }
+}
+
+static int cached(hotcache_t *cache, const char *key) {
+    static uint8_t buf[CHUNK_LEN];
+    size_t         len;
+    uint32_t       crc;
+    return hotcache_get(cache, key, buf, sizeof(buf), &len, &crc) == 0;
+}
+
+static void test_hit_miss(void) {
+    hotcache_t *cache = malloc(sizeof(hotcache_t));
+    hotcache_init(cache, HOTCACHE_MIN_BYTES(CHUNK_LEN));
+    uint8_t chunk[CHUNK_LEN], out[CHUNK_LEN];
+    size_t  len = 0;
+    uint32_t crc = 0;
+    fill(chunk, sizeof(chunk), 1);
+
+    CHECK(hotcache_get(cache, "a", out, sizeof(out), &len, &crc) < 0);
+    hotcache_put(cache, "a", chunk, sizeof(chunk), 0x1234,
+                 hotcache_version(cache, "a"));
+    CHECK(hotcache_get(cache, "a", out, sizeof(out), &len, &crc) == 0);
+    CHECK(len == sizeof(chunk) && memcmp(out, chunk, len) == 0);
+    CHECK(crc == 0x1234);
+    CHECK(hotcache_get(cache, "a", out, len - 1, &len, &crc) < 0);
+    CHECK(!cached(cache, "b"));
+
+    // More than a quarter of a shard is never cached
+    static uint8_t big[HOTCACHE_MIN_BYTES(CHUNK_LEN) / HOTCACHE_SHARDS];
+    hotcache_put(cache, "big", big, sizeof(big), 0,
+                 hotcache_version(cache, "big"));
+    static uint8_t big_out[sizeof(big)];
+    CHECK(hotcache_get(cache, "big", big_out, sizeof(big_out), &len, &crc) <
+          0);
+
+    hotcache_remove(cache, "a");
+    CHECK(!cached(cache, "a"));
+    hotcache_destroy(cache);
+    free(cache);
+}
+
+static void test_eviction(void) {
+    hotcache_t *cache = malloc(sizeof(hotcache_t));
+    size_t      bytes = HOTCACHE_MIN_BYTES(CHUNK_LEN) * 4;
+    hotcache_init(cache, bytes);
+    uint8_t chunk[CHUNK_LEN];
+    fill(chunk, sizeof(chunk), 2);
+
+    // Read twice, so protected from a scan of chunks read once
+    hotcache_put(cache, "hot", chunk, sizeof(chunk), 0,
+                 hotcache_version(cache, "hot"));
+    CHECK(cached(cache, "hot"));
+
+    char key[32];
+    for (int i = 0; i < NUM_COLD; i++) {
+        snprintf(key, sizeof(key), "cold.%d", i);
+        hotcache_put(cache, key, chunk, sizeof(chunk), 0,
+                     hotcache_version(cache, key));
+    }
+    CHECK(cached(cache, "hot"));
+    CHECK(cached(cache, key)); // The newest
+
+    size_t hits = 0;
+    for (int i = 0; i < NUM_COLD; i++) {
+        snprintf(key, sizeof(key), "cold.%d", i);
+        hits += cached(cache, key);
+    }
+    CHECK(hits > 0 && hits * CHUNK_LEN <= bytes);
+    snprintf(key, sizeof(key), "cold.%d", 0);
+    CHECK(!cached(cache, key)); // The oldest
+    hotcache_destroy(cache);
+    free(cache);
+}
+
+static void test_stale_put(void) {
+    hotcache_t *cache = malloc(sizeof(hotcache_t));
+    hotcache_init(cache, HOTCACHE_MIN_BYTES(CHUNK_LEN));
+    uint8_t chunk[CHUNK_LEN];
+    fill(chunk, sizeof(chunk), 3);
+
+    // Read from disk, then the chunk changes before the read is cached
+    uint64_t version = hotcache_version(cache, "c");
+    hotcache_remove(cache, "c");
+    hotcache_put(cache, "c", chunk, sizeof(chunk), 0, version);
+    CHECK(!cached(cache, "c"));
+
+    hotcache_put(cache, "c", chunk, sizeof(chunk), 0,
+                 hotcache_version(cache, "c"));
+    CHECK(cached(cache, "c"));
+    hotcache_destroy(cache);
+    free(cache);
+}
+
+static void test_store(const char *root) {
+    store_cache_init(HOTCACHE_MIN_BYTES(FTP_PACKET_SIZE));
+    static uint8_t chunk[FTP_PACKET_SIZE], out[FTP_PACKET_SIZE];
+    size_t         len = 0;
+    uint32_t       crc = 0;
+    fill(chunk, sizeof(chunk), 4);
+    CHECK(store_put(root, "n", chunk, sizeof(chunk),
+                    crc32c(0, chunk, sizeof(chunk))) == STORE_ERR_NONE);
+    CHECK(store_get(root, "n", out, sizeof(out), &len, &crc) ==
+          STORE_ERR_NONE);
+
+    // Gone from disk behind the store's back, served from memory
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/n", root);
+    unlink(path);
+    memset(out, 0, sizeof(out));
+    CHECK(store_get(root, "n", out, sizeof(out), &len, &crc) ==
+          STORE_ERR_NONE);
+    CHECK(len == sizeof(chunk) && memcmp(out, chunk, len) == 0);
+
+    // Overwritten through the store, the cached copy must go
+    fill(chunk, sizeof(chunk), 5);
+    CHECK(store_put(root, "n", chunk, sizeof(chunk),
+                    crc32c(0, chunk, sizeof(chunk))) == STORE_ERR_NONE);
+    CHECK(store_get(root, "n", out, sizeof(out), &len, &crc) ==
+          STORE_ERR_NONE);
+    CHECK(len == sizeof(chunk) && memcmp(out, chunk, len) == 0);
+
+    uint64_t reclaimed = 0;
+    CHECK(store_delete(root, "n", &reclaimed) == STORE_ERR_NONE);
+    CHECK(store_get(root, "n", out, sizeof(out), &len, &crc) ==
+          STORE_ERR_NOENT);
+}
+
+int main(void) {
+    char root[] = "/tmp/dfs-hotcache-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    test_hit_miss();
+    test_eviction();
+    test_stale_put();
+    test_store(root);
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Could not remove %s\n", root);
+    }
+    printf("%s: %s\n", __FILE__, failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}
@@ -21,7 +21,7 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "md5.h"
+#include "hash.h"
 
 #define CHUNK_SIZE  (65536) // 64Ki byte chunks
 #define REDUNDENCY  2       // Minimum number of servers to store each chunk on
@@ -30,7 +30,9 @@
 // Global variables
 uint16_t client_id;
 
-void printUsage(char *argv[]) { printf("Usage: %s <filename>\n", argv[0]); }
+void printUsage(char *argv[]) {
+    printf("Usage: %s <filename> [md5|xxh64|blake3]\n", argv[0]);
+}
 
 int main(int argc, char *argv[]) {
     // Parse arguments
@@ -39,6 +41,12 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    hash_algo_t algo = HASH_MD5;
+    if (argc > 2 && hash_algo_from_str(argv[2], &algo) < 0) {
+        printUsage(argv);
+        exit(1);
+    }
+
     srand(time(NULL));
     client_id = rand() & 0xFFFF;
     printf("client_id: %u\n", client_id);
@@ -61,31 +69,23 @@ int main(int argc, char *argv[]) {
     printf("filename: %s\n", filename);
 
     // Hash the file name
-    uint8_t hash[16];
-    char    hash_str[33];
-    md5String(filename, hash);
-    for (int i = 0; i < 16; i++) {
-        sprintf(hash_str + (i * 2), "%02x", hash[i]);
-    }
+    uint8_t hash[HASH_MAX_LEN];
+    char    hash_str[HASH_HEX_LEN];
+    hash_buf(algo, filename, strlen(filename), hash);
+    hash_to_hex(hash, hash_len(algo), hash_str);
     printf("hash: %s\n", hash_str);
 
     // Hash the file contents
-    char cmd[PATH_MAX + 8];
-    char checksum[33];
-    bzero(cmd, PATH_MAX + 8);
-    bzero(checksum, 33);
-    sprintf(cmd, "md5sum %s", filepath);
-    FILE *f_checksum = popen(cmd, "r");
-    if (f_checksum == NULL) {
-        perror("popen");
-        exit(1);
-    }
-    if (fread(checksum, 1, 32, f_checksum) != 32) {
-        perror("fread");
+    uint8_t digest[HASH_MAX_LEN];
+    char    checksum[HASH_HEX_LEN];
+    int     f_checksum = open(filepath, O_RDONLY);
+    if (f_checksum < 0 || hash_fd(algo, f_checksum, digest) == 0) {
+        perror("hash_fd");
         exit(1);
     }
-    pclose(f_checksum);
-    printf("checksum: %s\n", checksum);
+    close(f_checksum);
+    hash_to_hex(digest, hash_len(algo), checksum);
+    printf("checksum (%s): %s\n", hash_algo_to_str(algo), checksum);
 
     // Stat the file
     struct stat st;
@@ -136,6 +136,7 @@ int main(int argc, char *argv[]) {
     fprintf(f_manifest, "full_chunks: %lu\n", full_chunks);
     fprintf(f_manifest, "num_chunks: %lu\n", num_chunks);
     fprintf(f_manifest, "residual_len: %lu\n", residual_len);
+    fprintf(f_manifest, "hash_algo: %s\n", hash_algo_to_str(algo));
     fprintf(f_manifest, "checksum: %s\n", checksum);
     // TODO: Send the manifest to the server
     fclose(f_manifest);
@@ -0,0 +1,132 @@
+/**
+ * @file prefetch.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test read-ahead of chunks for sequential readers
+ * @details A fake fetch stamps each chunk with its index, sleeps a little
+ * to look like the network and counts how many fetches overlap.
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+
+#define NUM_CHUNKS 64
+#define WINDOW     8
+#define BAD_CHUNK  37 // Fails to fetch
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t          fetches; // Calls to fetch
+    size_t          running; // Fetches in progress
+    size_t          most;    // Most fetches in progress at once
+    size_t          highest; // Highest index fetched
+    useconds_t      delay;   // Time a fetch takes
+} source_t;
+
+static ftp_err_t fetch(void *arg, size_t index, ftp_msg_t *msg) {
+    source_t *source = arg;
+    pthread_mutex_lock(&source->lock);
+    source->fetches++;
+    source->running++;
+    if (source->running > source->most) {
+        source->most = source->running;
+    }
+    if (index > source->highest) {
+        source->highest = index;
+    }
+    pthread_mutex_unlock(&source->lock);
+
+    usleep(source->delay);
+    msg->nbytes = snprintf((char *)msg->packet, FTP_PACKET_SIZE, "chunk %lu",
+                           index);
+
+    pthread_mutex_lock(&source->lock);
+    source->running--;
+    pthread_mutex_unlock(&source->lock);
+    return index == BAD_CHUNK ? FTP_ERR_SERVER : FTP_ERR_NONE;
+}
+
+/**
+ * @brief Whether msg holds chunk index
+ */
+static int is_chunk(const ftp_msg_t *msg, size_t index) {
+    char want[32];
+    snprintf(want, sizeof(want), "chunk %lu", index);
+    return msg->nbytes == strlen(want) &&
+           memcmp(msg->packet, want, msg->nbytes) == 0;
+}
+
+static void test_sequential(void) {
+    source_t   source = {.lock = PTHREAD_MUTEX_INITIALIZER, .delay = 2000};
+    prefetch_t prefetch;
+    CHECK(prefetch_init(&prefetch, fetch, &source, NUM_CHUNKS, WINDOW) == 0);
+    for (size_t i = 0; i < NUM_CHUNKS; i++) {
+        ftp_msg_t *msg = NULL;
+        ftp_err_t  err = prefetch_get(&prefetch, i, &msg);
+        CHECK(err == (i == BAD_CHUNK ? FTP_ERR_SERVER : FTP_ERR_NONE));
+        CHECK(msg && is_chunk(msg, i));
+    }
+    prefetch_destroy(&prefetch);
+
+    // Each chunk once, several at a time, never more than the slots
+    CHECK(source.fetches == NUM_CHUNKS);
+    CHECK(source.most > 1 && source.most <= WINDOW + 1);
+    CHECK(source.highest == NUM_CHUNKS - 1);
+}
+
+static void test_random(void) {
+    source_t   source = {.lock = PTHREAD_MUTEX_INITIALIZER};
+    prefetch_t prefetch;
+    CHECK(prefetch_init(&prefetch, fetch, &source, NUM_CHUNKS, WINDOW) == 0);
+    size_t order[] = {40, 3, 17, 18, 19, 2};
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        ftp_msg_t *msg = NULL;
+        CHECK(prefetch_get(&prefetch, order[i], &msg) == FTP_ERR_NONE);
+        CHECK(msg && is_chunk(msg, order[i]));
+    }
+    prefetch_destroy(&prefetch);
+    // A jump drops the read-ahead, so little is fetched beyond what is read
+    CHECK(source.fetches < 6 + 3 * (PREFETCH_MIN_WINDOW + 1));
+}
+
+static void test_no_window(void) {
+    source_t   source = {.lock = PTHREAD_MUTEX_INITIALIZER};
+    prefetch_t prefetch;
+    CHECK(prefetch_init(&prefetch, fetch, &source, NUM_CHUNKS, 0) == 0);
+    for (size_t i = 0; i < 10; i++) {
+        ftp_msg_t *msg = NULL;
+        CHECK(prefetch_get(&prefetch, i, &msg) == FTP_ERR_NONE);
+        CHECK(msg && is_chunk(msg, i));
+    }
+    prefetch_destroy(&prefetch);
+    CHECK(source.fetches == 10 && source.highest == 9 && source.most == 1);
+}
+
+int main(void) {
+    test_sequential();
+    test_random();
+    test_no_window();
+
+    printf("%s: %s\n", __FILE__, failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}
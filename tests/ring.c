@@ -0,0 +1,157 @@
+/**
+ * @file ring.c
+ * @author Matthew Teta (matthew.teta@colorado.edu)
+ * @brief Test chunk placement on the consistent hashing ring
+ * @details Placement must not depend on the order servers are listed in,
+ * should spread keys evenly, and adding or losing a server should only
+ * move the keys that server gains or held.
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "ring.h"
+
+#define NUM_KEYS  100000
+#define MAX_NODES 5
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);           \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+static const char *names[MAX_NODES] = {"dfs1", "dfs2", "dfs3", "dfs4",
+                                       "dfs5"};
+
+static uint64_t key_of(uint32_t i) {
+    uint8_t digest[HASH_MAX_LEN];
+    hash_buf(HASH_XXH64, &i, sizeof(i), digest);
+    return ring_key(digest);
+}
+
+/**
+ * @brief A ring of the first num servers, skipping skip (-1 for none)
+ */
+static void build(ring_t *ring, int num, int skip) {
+    ring_init(ring);
+    for (int i = 0; i < num; i++) {
+        if (i != skip) {
+            ring_add(ring, names[i], i, RING_VNODES);
+        }
+    }
+}
+
+static void test_lookup(void) {
+    ring_t ring;
+    int    nodes[MAX_NODES + 1];
+    ring_init(&ring);
+    CHECK(ring_lookup(&ring, 42, nodes, MAX_NODES) == 0);
+    build(&ring, 4, -1);
+    CHECK(ring.num_nodes == 4 && ring.count == 4 * RING_VNODES);
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        size_t n = ring_lookup(&ring, key_of(i), nodes, MAX_NODES + 1);
+        CHECK(n == 4);
+        for (size_t a = 0; a < n; a++) {
+            for (size_t b = a + 1; b < n; b++) {
+                CHECK(nodes[a] != nodes[b]);
+            }
+        }
+        CHECK(ring_lookup(&ring, key_of(i), nodes, 2) == 2);
+    }
+
+    // Past the last point wraps around to the first
+    uint64_t past = ring.points[ring.count - 1].point + 1;
+    CHECK(past != 0);
+    CHECK(ring_lookup(&ring, past, nodes, 1) == 1);
+    CHECK(nodes[0] == ring.points[0].node);
+
+    uint8_t digest[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    CHECK(ring_key(digest) == 0x0102030405060708ULL);
+    ring_free(&ring);
+}
+
+static void test_order(void) {
+    ring_t forward;
+    ring_t backward;
+    build(&forward, 4, -1);
+    ring_init(&backward);
+    for (int i = 3; i >= 0; i--) {
+        ring_add(&backward, names[i], i, RING_VNODES);
+    }
+    int a[MAX_NODES];
+    int b[MAX_NODES];
+    for (uint32_t i = 0; i < 1000; i++) {
+        size_t n = ring_lookup(&forward, key_of(i), a, MAX_NODES);
+        CHECK(ring_lookup(&backward, key_of(i), b, MAX_NODES) == n);
+        CHECK(memcmp(a, b, n * sizeof(int)) == 0);
+    }
+    ring_free(&forward);
+    ring_free(&backward);
+}
+
+static void test_movement(void) {
+    ring_t four;
+    ring_t five;
+    ring_t lost;
+    build(&four, 4, -1);
+    build(&five, 5, -1);
+    build(&lost, 4, 2);
+
+    size_t share[MAX_NODES] = {0};
+    size_t moved            = 0;
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        int      was[MAX_NODES];
+        int      now[MAX_NODES];
+        int      left[MAX_NODES];
+        uint64_t key = key_of(i);
+        ring_lookup(&four, key, was, MAX_NODES);
+        ring_lookup(&five, key, now, MAX_NODES);
+        ring_lookup(&lost, key, left, MAX_NODES);
+        share[was[0]]++;
+
+        // A new server only takes keys, it never shuffles the others
+        if (now[0] != was[0]) {
+            moved++;
+            CHECK(now[0] == 4);
+        }
+        // Losing dfs3 moves its keys to their next choice, and only those
+        if (was[0] == 2) {
+            CHECK(left[0] == was[1]);
+        } else {
+            CHECK(left[0] == was[0]);
+        }
+    }
+    for (int n = 0; n < 4; n++) {
+        // Within 20% of an even share
+        CHECK(share[n] * 4 * 10 > NUM_KEYS * 8 &&
+              share[n] * 4 * 10 < NUM_KEYS * 12);
+    }
+    // About a fifth of the keys move to the fifth server
+    CHECK(moved * 5 * 10 > NUM_KEYS * 8 && moved * 5 * 10 < NUM_KEYS * 12);
+    ring_free(&four);
+    ring_free(&five);
+    ring_free(&lost);
+}
+
+int main(void) {
+    test_lookup();
+    test_order();
+    test_movement();
+
+    printf("%s: %s\n", __FILE__, failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}